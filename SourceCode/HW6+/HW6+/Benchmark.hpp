@@ -0,0 +1,819 @@
+#pragma once
+
+#include "CameraRays.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+
+#include "rapidjson/istreamwrapper.h"
+
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+#include <thread>
+
+// Best time of several runs of task, in seconds
+template <typename Task>
+double MeasureBest(uint32_t repetitions, const Task& task)
+{
+	double best = std::numeric_limits<double>::max();
+	for (uint32_t i = 0; i < repetitions; ++i)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		task();
+		const auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double>(end - start).count());
+	}
+	return best;
+}
+
+// Parse throughput of the scene loaders, in MB/s of .crtscene text:
+//   stream DOM  - std::ifstream + IStreamWrapper into a default Document (the original reader)
+//   in-situ DOM - copy-on-write mapping parsed in place into an arena-backed Document
+//   SAX         - copy-on-write mapping parsed in place into a no-op handler (bare tokenizer cost)
+//   DOM/SAX scene - complete Scene construction with the .crtbin cache disabled
+inline void RunParseBenchmark(const std::vector<std::string>& sceneFiles, uint32_t repetitions)
+{
+	using namespace rapidjson;
+
+	auto throughput = [](size_t bytes, double seconds) { return static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds; };
+
+	std::cout << std::left << std::setw(20) << "scene" << std::right
+		<< std::setw(10) << "KB"
+		<< std::setw(14) << "stream DOM"
+		<< std::setw(14) << "in-situ DOM"
+		<< std::setw(14) << "SAX"
+		<< std::setw(14) << "DOM scene"
+		<< std::setw(14) << "SAX scene"
+		<< "   (MB/s, best of " << repetitions << ")\n";
+
+	for (const auto& sceneFile : sceneFiles)
+	{
+		const size_t fileSize = std::filesystem::file_size(sceneFile);
+
+		const double streamDom = MeasureBest(repetitions, [&]()
+			{
+				std::ifstream ifs(sceneFile);
+				IStreamWrapper isw(ifs);
+				Document doc;
+				doc.ParseStream(isw);
+				assert(!doc.HasParseError());
+			});
+
+		const double insituDom = MeasureBest(repetitions, [&]()
+			{
+				JsonText text(sceneFile);
+				JsonArena arena(JsonArena::CapacityFor(text.Size()));
+				Document doc(&arena.Allocator());
+				doc.ParseInsitu(text.Data());
+				assert(!doc.HasParseError());
+			});
+
+		const double sax = MeasureBest(repetitions, [&]()
+			{
+				JsonText text(sceneFile);
+				InsituStringStream stream(text.Data());
+				BaseReaderHandler<> handler;
+				Reader reader;
+				[[maybe_unused]] ParseResult result = reader.Parse<kParseInsituFlag>(stream, handler);
+				assert(!result.IsError());
+			});
+
+		const double domScene = MeasureBest(repetitions, [&]() { Scene scene(sceneFile, { .loader = Scene::LoaderType::DOM, .useCache = false }); });
+		const double saxScene = MeasureBest(repetitions, [&]() { Scene scene(sceneFile, { .loader = Scene::LoaderType::SAX, .useCache = false }); });
+
+		std::cout << std::left << std::setw(20) << sceneFile << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(10) << fileSize / 1024.0
+			<< std::setw(14) << throughput(fileSize, streamDom)
+			<< std::setw(14) << throughput(fileSize, insituDom)
+			<< std::setw(14) << throughput(fileSize, sax)
+			<< std::setw(14) << throughput(fileSize, domScene)
+			<< std::setw(14) << throughput(fileSize, saxScene)
+			<< '\n';
+	}
+}
+
+// Camera rays through the pixel centers, as the renderer generates them
+inline std::vector<Ray> MakePrimaryRays(const Scene& scene, uint32_t width, uint32_t height)
+{
+	const PrimaryRayGenerator generator(scene.camera, width, height);
+	RayBatch batch;
+	generator.GenerateTile(0, 0, width, height, batch);
+	std::vector<Ray> rays(batch.Size());
+	for (size_t i = 0; i < rays.size(); ++i)
+		rays[i] = batch.Get(i);
+	return rays;
+}
+
+// Closest hit search over the primary rays of a scene, comparing two ways of tracking the best candidate:
+//   full record - a complete HitInfo (point, normal, mesh and triangle index) is built and copied for every
+//                 closer candidate, as ClosestHit() used to do
+//   slim record - Scene::ClosestTraversalHit() keeps only t, u, v and the triangle ID, and Scene::MakeHitInfo()
+//                 builds the HitInfo once per ray
+// Stores are counted as record updates times record size; both variants accept exactly the same candidates.
+inline void RunTraversalBenchmark(const std::string& sceneFile, uint32_t width, uint32_t height, uint32_t repetitions)
+{
+	Scene scene(sceneFile, { .useCache = false, .bvhLayout = BvhLayout::NONE });
+
+	const std::vector<Ray> rays = MakePrimaryRays(scene, width, height);
+
+	size_t updates = 0;
+	size_t hits = 0;
+	volatile float sink = 0.f;
+
+	auto fullRecordSearch = [&](const Ray& ray, uint32_t meshIndex, const auto* indices, HitInfo& best)
+		{
+			const Mesh& mesh = scene.meshes[meshIndex];
+			const Vector3* positions = scene.geometry.Positions(mesh);
+			for (uint32_t triangleIndex = 0; triangleIndex < mesh.triangleCount; ++triangleIndex)
+			{
+				const Vector3& a = positions[indices[3 * triangleIndex]];
+				const Vector3& b = positions[indices[3 * triangleIndex + 1]];
+				const Vector3& c = positions[indices[3 * triangleIndex + 2]];
+				HitInfo candidate;
+				if (!IntersectTriangle(a, b, c, ray, std::numeric_limits<float>::infinity(), candidate.t, candidate.u, candidate.v) || !(candidate.t < best.t))
+					continue;
+				candidate.hit = true;
+				candidate.point = ray(candidate.t);
+				candidate.normal = Normalize(Cross(b - a, c - a));
+				candidate.meshIndex = meshIndex;
+				candidate.triangleIndex = triangleIndex;
+				best = candidate;
+				++updates;
+			}
+		};
+
+	const double fullTime = MeasureBest(repetitions, [&]()
+		{
+			updates = 0;
+			for (const Ray& ray : rays)
+			{
+				HitInfo best;
+				for (uint32_t meshIndex = 0; meshIndex < scene.meshes.size(); ++meshIndex)
+				{
+					const Mesh& mesh = scene.meshes[meshIndex];
+					if (mesh.wideIndices)
+						fullRecordSearch(ray, meshIndex, scene.geometry.Indices<uint32_t>(mesh), best);
+					else
+						fullRecordSearch(ray, meshIndex, scene.geometry.Indices<uint16_t>(mesh), best);
+				}
+				sink = sink + best.t;
+			}
+		});
+
+	const double slimTime = MeasureBest(repetitions, [&]()
+		{
+			hits = 0;
+			for (const Ray& ray : rays)
+			{
+				const HitInfo hitInfo = scene.MakeHitInfo(ray, scene.ClosestTraversalHit(ray));
+				hits += hitInfo.hit;
+				sink = sink + hitInfo.t;
+			}
+		});
+
+	const double fullBytes = static_cast<double>(updates) * sizeof(HitInfo);
+	const double slimBytes = static_cast<double>(updates) * sizeof(TraversalHit) + static_cast<double>(hits) * sizeof(HitInfo);
+	std::cout << sceneFile << ": " << rays.size() << " primary rays, " << hits << " hits, "
+		<< std::fixed << std::setprecision(2) << static_cast<double>(updates) / rays.size() << " closer candidates per ray\n"
+		<< "  full record: " << std::setw(3) << sizeof(HitInfo) << " B/update, " << std::setw(8) << fullBytes / 1024.0 << " KB stored, "
+		<< std::setw(8) << fullTime * 1e9 / rays.size() << " ns/ray\n"
+		<< "  slim record: " << std::setw(3) << sizeof(TraversalHit) << " B/update, " << std::setw(8) << slimBytes / 1024.0 << " KB stored, "
+		<< std::setw(8) << slimTime * 1e9 / rays.size() << " ns/ray (HitInfo built once per hit)\n";
+}
+
+// The closest and any hit searches of a scene with each BvhLayout: no hierarchy, float nodes and quantized nodes.
+// Reports the nodes and their memory next to the geometry, the build time, the box and triangle tests and the time
+// per ray for the primary rays at 192x108 and shadow rays from their hits to the first light, and a full render
+// at the given scale. Every layout must find the same hit distances and the same occlusion as the one without a
+// hierarchy; any difference is reported as a mismatch. Where two triangles meet, the hierarchy may report the
+// other one of the two at the same distance.
+inline void RunBvhBenchmark(const std::string& sceneFile, float scale, uint32_t repetitions)
+{
+	const Scene reference(sceneFile, { .useCache = false, .bvhLayout = BvhLayout::NONE });
+	const std::vector<Ray> rays = MakePrimaryRays(reference, 192, 108);
+	std::vector<TraversalHit> referenceHits(rays.size());
+	std::vector<Ray> shadowRays;
+	std::vector<bool> referenceOccluded;
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		referenceHits[i] = reference.ClosestTraversalHit(rays[i]);
+		const HitInfo hitInfo = reference.MakeHitInfo(rays[i], referenceHits[i]);
+		if (!hitInfo.hit || reference.lights.empty())
+			continue;
+		const Vector3 origin = OffsetRayOrigin(hitInfo.point, hitInfo.normal);
+		const Vector3 toLight = reference.lights[0].position - origin;
+		shadowRays.push_back({ origin, Normalize(toLight), toLight.Magnitude() });
+		referenceOccluded.push_back(reference.AnyHit(shadowRays.back()));
+	}
+
+	const uint64_t triangleCount = std::accumulate(reference.meshes.begin(), reference.meshes.end(), uint64_t(0), [](uint64_t sum, const Mesh& mesh) { return sum + mesh.triangleCount; });
+	std::cout << sceneFile << ": " << triangleCount << " triangles, "
+		<< reference.geometry.Size() / 1024.0 << " KB of geometry, " << rays.size() << " primary rays, " << shadowRays.size() << " shadow rays\n";
+	std::cout << std::right << std::setw(11) << "layout" << std::setw(8) << "nodes" << std::setw(8) << "B/node" << std::setw(10) << "BVH KB"
+		<< std::setw(10) << "build ms" << std::setw(14) << "closest ns" << std::setw(10) << "boxes" << std::setw(11) << "triangles"
+		<< std::setw(10) << "any ns" << std::setw(11) << "render ms" << std::setw(12) << "mismatches" << '\n';
+
+	for (BvhLayout layout : { BvhLayout::NONE, BvhLayout::FULL, BvhLayout::QUANTIZED })
+	{
+		std::unique_ptr<Scene> scene;
+		const double buildTime = MeasureBest(1, [&]() { scene = std::make_unique<Scene>(sceneFile, Scene::LoadOptions{ .useCache = false, .bvhLayout = layout }); });
+
+		std::vector<TraversalHit> hits(rays.size());
+		const RenderStats before = ThreadRenderStats();
+		const double closestTime = MeasureBest(repetitions, [&]()
+			{
+				for (size_t i = 0; i < rays.size(); ++i)
+					hits[i] = scene->ClosestTraversalHit(rays[i]);
+			});
+		const RenderStats after = ThreadRenderStats();
+		const double perRay = 1.0 / (double(repetitions) * rays.size());
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < rays.size(); ++i)
+			mismatches += hits[i].Hit() != referenceHits[i].Hit() || std::abs(hits[i].t - referenceHits[i].t) > 1e-5f * std::max(1.f, referenceHits[i].t);
+		std::vector<bool> occluded(shadowRays.size());
+		const double anyTime = MeasureBest(repetitions, [&]()
+			{
+				for (size_t i = 0; i < shadowRays.size(); ++i)
+					occluded[i] = scene->AnyHit(shadowRays[i]);
+			});
+		mismatches += std::inner_product(occluded.begin(), occluded.end(), referenceOccluded.begin(), size_t(0), std::plus<>(), std::not_equal_to<>());
+
+		scene->settings.imageSettings.width = std::max(1u, static_cast<uint32_t>(scene->settings.imageSettings.width * scale));
+		scene->settings.imageSettings.height = std::max(1u, static_cast<uint32_t>(scene->settings.imageSettings.height * scale));
+		Renderer renderer(*scene);
+		const double renderTime = MeasureBest(repetitions, [&]() { renderer.Render(); });
+
+		std::cout << std::setw(11) << BvhLayoutName(layout) << std::setw(8) << scene->bvh.NodeCount() << std::setw(8) << (scene->bvh.IsBuilt() ? scene->bvh.NodeBytes() : 0)
+			<< std::fixed << std::setprecision(1) << std::setw(10) << scene->bvh.MemoryBytes() / 1024.0 << std::setw(10) << buildTime * 1e3
+			<< std::setw(14) << closestTime * 1e9 / rays.size() << std::setw(10) << (after.boxTests - before.boxTests) * perRay
+			<< std::setw(11) << (after.triangleTests - before.triangleTests) * perRay << std::setw(10) << anyTime * 1e9 / std::max<size_t>(shadowRays.size(), 1)
+			<< std::setw(11) << renderTime * 1e3 << std::setw(12) << mismatches << '\n';
+	}
+	std::cout << "  build includes loading the scene; box and triangle tests are per primary ray\n";
+}
+
+// The SIMD kernels of every instruction set this CPU supports, against the scalar ones:
+//   closest hit - primary rays of the scene at 192x108; results must match the scalar kernels bit for bit
+//   any hit     - shadow rays from every primary hit point to the first light
+inline void RunSimdBenchmark(const std::string& sceneFile, uint32_t repetitions)
+{
+	Scene scene(sceneFile, { .useCache = false, .bvhLayout = BvhLayout::NONE });
+	const std::vector<Ray> rays = MakePrimaryRays(scene, 192, 108);
+
+	std::vector<Ray> shadowRays;
+	if (!scene.lights.empty())
+	{
+		for (const Ray& ray : rays)
+		{
+			const HitInfo hitInfo = scene.ClosestHit(ray);
+			if (!hitInfo.hit)
+				continue;
+			const Vector3 origin = OffsetRayOrigin(hitInfo.point, hitInfo.normal);
+			const Vector3 toLight = scene.lights[0].position - origin;
+			shadowRays.push_back({ origin, Normalize(toLight), toLight.Magnitude() });
+		}
+	}
+
+	const SimdLevel bestLevel = DetectSimdLevel();
+	std::vector<TraversalHit> reference;
+	double scalarClosest = 0.0, scalarAny = 0.0;
+	std::cout << sceneFile << ": " << rays.size() << " primary rays, " << shadowRays.size() << " shadow rays, best level " << SimdLevelName(bestLevel) << '\n';
+	for (SimdLevel level : { SimdLevel::SCALAR, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512 })
+	{
+		if (level > bestLevel)
+			break;
+		SelectSimdLevel(level);
+
+		std::vector<TraversalHit> results(rays.size());
+		const double closestTime = MeasureBest(repetitions, [&]()
+			{
+				for (size_t i = 0; i < rays.size(); ++i)
+					results[i] = scene.ClosestTraversalHit(rays[i]);
+			});
+
+		size_t occluded = 0;
+		const double anyTime = MeasureBest(repetitions, [&]()
+			{
+				occluded = 0;
+				for (const Ray& ray : shadowRays)
+					occluded += scene.AnyHit(ray);
+			});
+
+		bool identical = true;
+		if (level == SimdLevel::SCALAR)
+		{
+			reference = results;
+			scalarClosest = closestTime;
+			scalarAny = anyTime;
+		}
+		else
+		{
+			for (size_t i = 0; i < rays.size() && identical; ++i)
+				identical = std::memcmp(&results[i], &reference[i], sizeof(TraversalHit)) == 0 || (!results[i].Hit() && !reference[i].Hit());
+		}
+
+		std::cout << "  " << std::left << std::setw(8) << SimdLevelName(level) << std::right << std::fixed << std::setprecision(2)
+			<< " closest hit " << std::setw(9) << closestTime * 1e6 / rays.size() << " us/ray (x" << std::setw(5) << scalarClosest / closestTime << ")"
+			<< "   any hit " << std::setw(9) << anyTime * 1e6 / std::max<size_t>(shadowRays.size(), 1) << " us/ray (x" << std::setw(5) << scalarAny / anyTime << ", " << occluded << " occluded)"
+			<< (identical ? "" : "   MISMATCH") << '\n';
+	}
+	SelectSimdLevel(bestLevel);
+}
+
+// Primary ray generation for a 1920x1080 frame in 64x64 tiles, for each camera model:
+//   per pixel - the basis and screen coordinates recomputed for every pixel, as the renderer used to do
+//               (pinhole only)
+//   batched   - PrimaryRayGenerator, through the kernels of every instruction set this CPU supports; the rays
+//               must match those of the scalar kernels bit for bit
+inline void RunCameraBenchmark(const std::string& sceneFile, uint32_t repetitions)
+{
+	constexpr uint32_t width = 1920, height = 1080, tileSize = 64;
+	const size_t rayCount = size_t(width) * height;
+	const Scene scene(sceneFile, { .useCache = false });
+
+	auto perPixelRay = [&](uint32_t column, uint32_t row)
+		{
+			float y = static_cast<float>(row) + 0.5f;
+			y /= height;
+			y = 1.f - (2.f * y);
+			float x = static_cast<float>(column) + 0.5f;
+			x /= width;
+			x = 2.f * x - 1.f;
+			x *= static_cast<float>(width) / height;
+
+			const Vector3 origin = scene.camera.GetPosition();
+			const Vector3 forward = scene.camera.GetLookDirection();
+			const Vector3 up = Normalize(scene.camera.transform * Vector3(0.f, 1.f, 0.f));
+			const Vector3 right = Cross(forward, up);
+			return Ray{ origin, Normalize(forward + right * x + up * y) };
+		};
+
+	// Consumes every ray, so the generation is not optimized away
+	auto checksum = [](const RayBatch& rays)
+		{
+			float sum = 0.f;
+			for (size_t i = 0; i < rays.Size(); ++i)
+				sum += rays.originX[i] + rays.directionX[i] + rays.directionY[i] + rays.directionZ[i];
+			return sum;
+		};
+
+	auto generateFrame = [&](const PrimaryRayGenerator& generator, std::vector<RayBatch>& tiles)
+		{
+			size_t tile = 0;
+			for (uint32_t row = 0; row < height; row += tileSize)
+			{
+				for (uint32_t column = 0; column < width; column += tileSize, ++tile)
+					generator.GenerateTile(column, row, std::min(tileSize, width - column), std::min(tileSize, height - row), tiles[tile]);
+			}
+		};
+
+	const size_t tileCount = size_t((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+	const SimdLevel bestLevel = DetectSimdLevel();
+	std::cout << sceneFile << ": " << width << "x" << height << " primary rays, " << tileSize << "x" << tileSize << " tiles\n";
+	std::cout << std::fixed << std::setprecision(1);
+
+	float sum = 0.f;
+	const double perPixelTime = MeasureBest(repetitions, [&]()
+		{
+			for (uint32_t row = 0; row < height; ++row)
+			{
+				for (uint32_t column = 0; column < width; ++column)
+				{
+					const Ray ray = perPixelRay(column, row);
+					sum += ray.origin.x + ray.directionN.x + ray.directionN.y + ray.directionN.z;
+				}
+			}
+		});
+	std::cout << "  per pixel (pinhole)  " << std::setw(8) << rayCount / perPixelTime / 1e6 << " M rays/s\n";
+
+	for (Camera::Projection projection : { Camera::Projection::PINHOLE, Camera::Projection::ORTHOGRAPHIC, Camera::Projection::THIN_LENS })
+	{
+		Camera camera = scene.camera;
+		camera.projection = projection;
+		camera.apertureRadius = 0.1f;
+		camera.focusDistance = 5.f;
+		const PrimaryRayGenerator generator(camera, width, height);
+
+		std::vector<RayBatch> reference(tileCount);
+		for (SimdLevel level : { SimdLevel::SCALAR, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512 })
+		{
+			if (level > bestLevel)
+				break;
+			SelectSimdLevel(level);
+
+			std::vector<RayBatch> tiles(tileCount);
+			const double time = MeasureBest(repetitions, [&]()
+				{
+					generateFrame(generator, tiles);
+					sum += checksum(tiles[0]);
+				});
+
+			bool identical = true;
+			if (level == SimdLevel::SCALAR)
+			{
+				reference = tiles;
+				if (projection == Camera::Projection::PINHOLE)
+				{
+					// The batched pinhole rays are the ones the renderer used to generate per pixel
+					for (uint32_t row = 0; row < tileSize && identical; ++row)
+					{
+						for (uint32_t column = 0; column < tileSize && identical; ++column)
+						{
+							const Ray expected = perPixelRay(column, row);
+							const Ray generated = tiles[0].Get(size_t(row) * tileSize + column);
+							identical = std::memcmp(&expected.origin, &generated.origin, sizeof(Vector3)) == 0 && std::memcmp(&expected.directionN, &generated.directionN, sizeof(Vector3)) == 0;
+						}
+					}
+				}
+			}
+			else
+			{
+				for (size_t tile = 0; tile < tileCount && identical; ++tile)
+				{
+					identical = tiles[tile].originX == reference[tile].originX && tiles[tile].originY == reference[tile].originY && tiles[tile].originZ == reference[tile].originZ &&
+						tiles[tile].directionX == reference[tile].directionX && tiles[tile].directionY == reference[tile].directionY && tiles[tile].directionZ == reference[tile].directionZ;
+				}
+			}
+
+			const char* projectionName = projection == Camera::Projection::PINHOLE ? "pinhole" : projection == Camera::Projection::ORTHOGRAPHIC ? "orthographic" : "thin lens";
+			std::cout << "  " << std::left << std::setw(13) << projectionName << std::setw(8) << SimdLevelName(level) << std::right
+				<< std::setw(8) << rayCount / time / 1e6 << " M rays/s (x" << std::setprecision(2) << perPixelTime / time << std::setprecision(1) << " vs per pixel)"
+				<< (identical ? "" : "   MISMATCH") << '\n';
+		}
+	}
+	SelectSimdLevel(bestLevel);
+	std::cout << "  (checksum " << sum << ")\n";
+}
+
+// Streaming read bandwidth of threadCount threads, each summing its own slice of data into checksum, in GB/s
+inline double MeasureReadBandwidth(const std::vector<uint64_t>& data, uint32_t threadCount, uint32_t repetitions, uint64_t& checksum)
+{
+	std::vector<uint64_t> sums(threadCount);
+	const double time = MeasureBest(repetitions, [&]()
+		{
+			std::vector<std::jthread> threads;
+			const size_t slice = data.size() / threadCount;
+			for (uint32_t i = 0; i < threadCount; ++i)
+			{
+				threads.emplace_back([&, i]()
+					{
+						const size_t begin = i * slice;
+						const size_t end = i + 1 == threadCount ? data.size() : begin + slice;
+						sums[i] = std::accumulate(data.begin() + begin, data.begin() + end, uint64_t(0));
+					});
+			}
+		});
+	checksum += std::accumulate(sums.begin(), sums.end(), uint64_t(0));
+	return data.size() * sizeof(uint64_t) / time / 1e9;
+}
+
+// Renders one scene with 1, 2, 4, ... threads up to maxThreads (hardware_concurrency() by default) and reports:
+//   speedup     - time of one thread over time of n threads
+//   efficiency  - speedup / n
+//   idle        - mean and worst share of the frame a thread waited for the others, from the static row split
+//   read GB/s   - streaming read bandwidth of n threads over 256 MB, the ceiling of a memory bound render
+// The plateau is the thread count after which one more doubling gains less than 10%; when the render plateaus
+// where the bandwidth does, below the hardware thread count, the render is limited by memory bandwidth rather than
+// by the row split.
+inline void RunScalingBenchmark(const std::string& sceneFile, float scale, uint32_t maxThreads, uint32_t repetitions)
+{
+	Scene scene(sceneFile);
+	scene.settings.imageSettings.width = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.width * scale));
+	scene.settings.imageSettings.height = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.height * scale));
+	if (maxThreads == 0)
+		maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<uint32_t> threadCounts;
+	for (uint32_t count = 1; count < maxThreads; count *= 2)
+		threadCounts.push_back(count);
+	threadCounts.push_back(maxThreads);
+
+	std::cout << sceneFile << " at " << scene.settings.imageSettings.width << "x" << scene.settings.imageSettings.height << ", "
+		<< std::thread::hardware_concurrency() << " hardware threads\n";
+	std::cout << std::right << std::setw(8) << "threads" << std::setw(11) << "ms" << std::setw(9) << "speedup" << std::setw(12) << "efficiency"
+		<< std::setw(12) << "mean idle" << std::setw(12) << "worst idle" << std::setw(11) << "read GB/s" << '\n';
+
+	const std::vector<uint64_t> data(size_t(256) << 20 >> 3, 1);
+	Renderer renderer(scene);
+	std::vector<double> renderTimes;
+	std::vector<double> bandwidths;
+	uint64_t checksum = 0;
+	for (uint32_t count : threadCounts)
+	{
+		renderer.SetThreadCount(count);
+		double meanIdle = 0.0, worstIdle = 0.0;
+		double bestFrame = std::numeric_limits<double>::max();
+		const double time = MeasureBest(repetitions, [&]()
+			{
+				const auto start = std::chrono::steady_clock::now();
+				renderer.Render();
+				const double frame = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				// Of the fastest run so far, so in the end of the best one
+				if (frame >= bestFrame)
+					return;
+				bestFrame = frame;
+				const std::vector<double>& busy = renderer.GetThreadBusySeconds();
+				const double idle = frame * busy.size() - std::accumulate(busy.begin(), busy.end(), 0.0);
+				meanIdle = idle / (frame * busy.size());
+				worstIdle = 1.0 - *std::min_element(busy.begin(), busy.end()) / frame;
+			});
+		renderTimes.push_back(time);
+		bandwidths.push_back(MeasureReadBandwidth(data, count, repetitions, checksum));
+
+		const double speedup = renderTimes.front() / time;
+		std::cout << std::fixed << std::setw(8) << count << std::setprecision(1) << std::setw(11) << time * 1e3
+			<< std::setprecision(2) << std::setw(9) << speedup << std::setprecision(1) << std::setw(11) << 100.0 * speedup / count << '%'
+			<< std::setw(11) << 100.0 * meanIdle << '%' << std::setw(11) << 100.0 * worstIdle << '%'
+			<< std::setw(11) << bandwidths.back() << '\n';
+	}
+
+	auto plateau = [&](const std::vector<double>& rates)
+		{
+			for (size_t i = 1; i < rates.size(); ++i)
+			{
+				if (rates[i] < rates[i - 1] * 1.1)
+					return threadCounts[i - 1];
+			}
+			return threadCounts.back();
+		};
+	std::vector<double> renderRates(renderTimes.size());
+	std::transform(renderTimes.begin(), renderTimes.end(), renderRates.begin(), [](double time) { return 1.0 / time; });
+	const uint32_t renderPlateau = plateau(renderRates);
+	const uint32_t bandwidthPlateau = plateau(bandwidths);
+	std::cout << "  render plateaus at " << renderPlateau << " thread(s), read bandwidth at " << bandwidthPlateau << " thread(s)";
+	if (renderPlateau >= std::thread::hardware_concurrency())
+		std::cout << ": out of hardware threads";
+	else if (renderPlateau < threadCounts.back())
+		std::cout << (renderPlateau >= bandwidthPlateau ? ": memory bandwidth bound" : ": limited by the row split or shared state, not bandwidth");
+	std::cout << "\n  (checksum " << checksum << ")\n";
+}
+
+// PSNR of image against reference over the 8 bit channels, in dB
+inline double ImagePsnr(const Image& image, const Image& reference)
+{
+	double squaredError = 0.0;
+	for (uint32_t row = 0; row < image.GetHeight(); ++row)
+	{
+		for (uint32_t column = 0; column < image.GetWidth(); ++column)
+		{
+			const RGB& a = image.GetPixel(column, row);
+			const RGB& b = reference.GetPixel(column, row);
+			for (const auto& [x, y] : { std::pair{ a.r, b.r }, std::pair{ a.g, b.g }, std::pair{ a.b, b.b } })
+				squaredError += double(int(x) - int(y)) * (int(x) - int(y));
+		}
+	}
+	const double meanSquaredError = squaredError / (3.0 * image.GetWidth() * image.GetHeight());
+	return meanSquaredError > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / meanSquaredError) : std::numeric_limits<double>::infinity();
+}
+
+// Renders one scene with 1, 2, 4, ... samples per pixel, up to half of referenceSamples, without and with the
+// denoiser, and compares every image with a render of referenceSamples samples. The verdict compares the denoised
+// render with the given samples against the fewest samples that reach the same PSNR without the denoiser.
+// An aperture radius above 0 turns the camera into a thin lens focused on the center of the image; its defocus blur
+// is what a render with few samples gets noisy from, while a pinhole camera only shows aliasing.
+inline void RunDenoiseBenchmark(const std::string& sceneFile, float scale, uint32_t samples, uint32_t referenceSamples, float apertureRadius)
+{
+	Scene scene(sceneFile);
+	auto& imageSettings = scene.settings.imageSettings;
+	imageSettings.width = std::max(1u, static_cast<uint32_t>(imageSettings.width * scale));
+	imageSettings.height = std::max(1u, static_cast<uint32_t>(imageSettings.height * scale));
+	if (apertureRadius > 0.f)
+	{
+		const PrimaryRayGenerator generator(scene.camera, imageSettings.width, imageSettings.height);
+		const HitInfo center = scene.ClosestHit<Scene::ALL_FEATURES>(generator.GenerateRay(imageSettings.width / 2, imageSettings.height / 2));
+		scene.camera.projection = Camera::Projection::THIN_LENS;
+		scene.camera.apertureRadius = apertureRadius;
+		scene.camera.focusDistance = center.hit ? center.t : 5.f;
+	}
+
+	std::cout << sceneFile << " at " << imageSettings.width << "x" << imageSettings.height;
+	if (apertureRadius > 0.f)
+		std::cout << ", thin lens of radius " << apertureRadius << " focused at " << scene.camera.focusDistance;
+	std::cout << ", reference of " << referenceSamples << " samples per pixel\n";
+
+	Renderer renderer(scene);
+	renderer.SetSamplesPerPixel(referenceSamples);
+	const auto referenceStart = std::chrono::steady_clock::now();
+	const Image reference = renderer.Render();
+	const double referenceTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - referenceStart).count();
+
+	struct Result
+	{
+		uint32_t samples;
+		double time;
+		double psnr;
+	};
+	auto measure = [&](uint32_t sampleCount, bool denoise)
+		{
+			renderer.SetSamplesPerPixel(sampleCount);
+			renderer.SetDenoiser(denoise);
+			Image image(0, 0);
+			const double time = MeasureBest(3, [&]() { image = renderer.Render(); });
+			return Result{ sampleCount, time, ImagePsnr(image, reference) };
+		};
+
+	std::cout << std::right << std::setw(8) << "samples" << std::setw(11) << "ms" << std::setw(10) << "PSNR"
+		<< std::setw(16) << "denoised ms" << std::setw(13) << "denoise ms" << std::setw(10) << "PSNR" << '\n';
+	std::vector<Result> plain;
+	Result denoised{};
+	for (uint32_t count = 1; count <= std::max(referenceSamples / 2, samples); count *= 2)
+	{
+		plain.push_back(measure(count, false));
+		const Result filtered = measure(count, true);
+		if (count == samples)
+			denoised = filtered;
+		std::cout << std::fixed << std::setprecision(1) << std::setw(8) << count << std::setw(11) << plain.back().time * 1e3 << std::setw(10) << plain.back().psnr
+			<< std::setw(16) << filtered.time * 1e3 << std::setw(13) << renderer.GetDenoiseSeconds() * 1e3 << std::setw(10) << filtered.psnr << '\n';
+	}
+	if (denoised.samples == 0)
+		denoised = measure(samples, true);
+	std::cout << "  reference " << referenceTime * 1e3 << " ms\n";
+
+	const auto match = std::find_if(plain.begin(), plain.end(), [&](const Result& result) { return result.psnr >= denoised.psnr; });
+	std::cout << "  denoised " << denoised.samples << " sample(s): " << denoised.psnr << " dB in " << denoised.time * 1e3 << " ms; ";
+	if (match == plain.end())
+		std::cout << "better than every render without the denoiser, up to " << plain.back().samples << " samples in " << plain.back().time * 1e3 << " ms\n";
+	else if (match->samples <= denoised.samples || match->time <= denoised.time)
+		std::cout << "no gain over " << match->samples << " sample(s) without the denoiser, " << match->psnr << " dB in " << match->time * 1e3 << " ms\n";
+	else
+		std::cout << "without the denoiser " << match->samples << " samples get there in " << match->time * 1e3 << " ms: "
+			<< std::setprecision(0) << 100.0 * (1.0 - denoised.time / match->time) << "% of the time saved\n";
+}
+
+// Renders one scene with each hierarchy, testing the shadow rays of every shading point as it is shaded and in
+// packets per light and 8x8 pixels, and compares the batched image with the other. Box and triangle tests are per
+// pixel and include those of the closest hit searches, which are the same both ways.
+inline void RunShadowBenchmark(const std::string& sceneFile, float scale, uint32_t repetitions)
+{
+	std::cout << sceneFile << " at " << scale << " of its size\n";
+	std::cout << std::right << std::setw(11) << "layout" << std::setw(9) << "batched" << std::setw(11) << "render ms" << std::setw(13) << "shadow rays"
+		<< std::setw(10) << "boxes" << std::setw(11) << "triangles" << std::setw(10) << "PSNR" << '\n';
+	for (BvhLayout layout : { BvhLayout::FULL, BvhLayout::QUANTIZED })
+	{
+		Scene scene(sceneFile, { .bvhLayout = layout });
+		auto& imageSettings = scene.settings.imageSettings;
+		imageSettings.width = std::max(1u, static_cast<uint32_t>(imageSettings.width * scale));
+		imageSettings.height = std::max(1u, static_cast<uint32_t>(imageSettings.height * scale));
+		const double perPixel = 1.0 / (double(imageSettings.width) * imageSettings.height);
+
+		Renderer renderer(scene);
+		Image unbatched(0, 0);
+		for (bool batched : { false, true })
+		{
+			renderer.SetShadowBatching(batched);
+			Image image(0, 0);
+			const double time = MeasureBest(repetitions, [&]() { image = renderer.Render(); });
+			const RenderStats& stats = renderer.GetStats();
+			if (!batched)
+				unbatched = image;
+			std::cout << std::setw(11) << BvhLayoutName(layout) << std::setw(9) << (batched ? "yes" : "no") << std::fixed << std::setprecision(1)
+				<< std::setw(11) << time * 1e3 << std::setw(13) << stats.shadowRays << std::setw(10) << stats.boxTests * perPixel
+				<< std::setw(11) << stats.triangleTests * perPixel << std::setw(10) << ImagePsnr(image, unbatched) << '\n';
+		}
+	}
+	std::cout << "  PSNR against the render without batching, inf where they are the same\n";
+}
+
+// Renders one scene with preview shadows from depth cube maps of several resolutions and compares every image with
+// the render with exact shadow rays. "off" counts the pixels where some channel is more than 8 of 255 away from the
+// exact one. The floor a preview can reach is the render without any light, which traces the same primary,
+// reflected and refracted rays and nothing else; the closest hit search of the primary rays alone is given too.
+inline void RunShadowMapBenchmark(const std::string& sceneFile, float scale, uint32_t repetitions)
+{
+	Scene scene(sceneFile);
+	auto& imageSettings = scene.settings.imageSettings;
+	imageSettings.width = std::max(1u, static_cast<uint32_t>(imageSettings.width * scale));
+	imageSettings.height = std::max(1u, static_cast<uint32_t>(imageSettings.height * scale));
+
+	Renderer renderer(scene);
+	Image exact(0, 0);
+	const double exactTime = MeasureBest(repetitions, [&]() { exact = renderer.Render(); });
+	const std::vector<Ray> rays = MakePrimaryRays(scene, imageSettings.width, imageSettings.height);
+	const double primaryTime = MeasureBest(repetitions, [&]()
+		{
+			for (const Ray& ray : rays)
+				scene.ClosestTraversalHit(ray);
+		});
+	Renderer::View unlit = renderer.GetView();
+	unlit.lights.clear();
+	Renderer unlitRenderer(scene);
+	unlitRenderer.SetView(std::move(unlit));
+	const double unlitTime = MeasureBest(repetitions, [&]() { unlitRenderer.Render(); });
+	std::cout << sceneFile << " at " << imageSettings.width << "x" << imageSettings.height << ", " << scene.lights.size() << " light(s): exact shadows "
+		<< std::fixed << std::setprecision(1) << exactTime * 1e3 << " ms, without lights " << unlitTime * 1e3 << " ms, primary rays alone " << primaryTime * 1e3 << " ms\n";
+	std::cout << std::right << std::setw(11) << "resolution" << std::setw(9) << "MB" << std::setw(10) << "build ms" << std::setw(11) << "render ms"
+		<< std::setw(10) << "speedup" << std::setw(10) << "PSNR" << std::setw(9) << "off %" << '\n';
+
+	for (uint32_t resolution : { 128u, 256u, 512u, 1024u, 2048u })
+	{
+		// The first render builds the maps it then uses
+		renderer.SetShadowMapResolution(resolution);
+		Image image(0, 0);
+		image = renderer.Render();
+		const double buildTime = renderer.GetShadowMapBuildSeconds();
+		const double time = MeasureBest(repetitions, [&]() { image = renderer.Render(); });
+
+		size_t offPixels = 0;
+		for (uint32_t row = 0; row < image.GetHeight(); ++row)
+		{
+			for (uint32_t column = 0; column < image.GetWidth(); ++column)
+			{
+				const RGB& a = image.GetPixel(column, row);
+				const RGB& b = exact.GetPixel(column, row);
+				offPixels += std::abs(int(a.r) - int(b.r)) > 8 || std::abs(int(a.g) - int(b.g)) > 8 || std::abs(int(a.b) - int(b.b)) > 8;
+			}
+		}
+		std::cout << std::setw(11) << resolution << std::setw(9) << renderer.GetShadowMaps().MemoryBytes() / (1024.0 * 1024.0) << std::setw(10) << buildTime * 1e3
+			<< std::setw(11) << time * 1e3 << std::setw(9) << exactTime / time << "x" << std::setw(10) << ImagePsnr(image, exact)
+			<< std::setw(9) << 100.0 * offPixels / (double(image.GetWidth()) * image.GetHeight()) << '\n';
+	}
+	std::cout << "  render ms excludes building the maps, which happens once per scene and set of lights\n";
+}
+
+// Write throughput of threadCount threads each filling its part of a width x height frame passes times, in millions
+// of pixels per second. With interleavedTiles, thread i writes every threadCount-th block of 8x8 pixels, as a tile
+// scheduler would hand them out; otherwise it writes one band of rows, starting on a multiple of bandAlignment rows.
+template <typename SetPixel>
+double MeasureFramebufferWrites(uint32_t width, uint32_t height, uint32_t threadCount, bool interleavedTiles, uint32_t bandAlignment,
+	uint32_t passes, uint32_t repetitions, const SetPixel& setPixel)
+{
+	constexpr uint32_t kBlock = Image::kTileSize;
+	const uint32_t blocksPerRow = (width + kBlock - 1) / kBlock;
+	const uint32_t blockCount = blocksPerRow * ((height + kBlock - 1) / kBlock);
+	auto bandStart = [&](uint32_t i) { return i == threadCount ? height : static_cast<uint32_t>(uint64_t(i) * height / threadCount) / bandAlignment * bandAlignment; };
+
+	const double time = MeasureBest(repetitions, [&]()
+		{
+			std::vector<std::jthread> threads;
+			for (uint32_t i = 0; i < threadCount; ++i)
+			{
+				threads.emplace_back([&, i]()
+					{
+						for (uint32_t pass = 0; pass < passes; ++pass)
+						{
+							auto fill = [&](uint32_t left, uint32_t top, uint32_t right, uint32_t bottom)
+								{
+									for (uint32_t y = top; y < bottom; ++y)
+									{
+										for (uint32_t x = left; x < right; ++x)
+											setPixel(x, y, RGB{ static_cast<uint8_t>(x + pass), static_cast<uint8_t>(y), static_cast<uint8_t>(i) });
+									}
+								};
+							if (!interleavedTiles)
+							{
+								fill(0, bandStart(i), width, bandStart(i + 1));
+								continue;
+							}
+							for (uint32_t block = i; block < blockCount; block += threadCount)
+							{
+								const uint32_t left = block % blocksPerRow * kBlock, top = block / blocksPerRow * kBlock;
+								fill(left, top, std::min(left + kBlock, width), std::min(top + kBlock, height));
+							}
+						}
+					});
+			}
+		});
+	return double(width) * height * passes / time / 1e6;
+}
+
+// Framebuffer write throughput with 1, 2, 4, ... threads up to maxThreads (hardware_concurrency() by default), in
+// millions of pixels per second, for the row-major buffer the renderer used to write and the tiled Image:
+//   row bands    - each thread one band of rows, as the static row split does; row-major bands as the split used to
+//                  cut them, tiled ones starting on a row of tiles as it does now
+//   8x8 tiles    - the blocks of 8x8 pixels dealt round robin to the threads. Row-major, a block row is 24 bytes, so
+//                  two or three threads write every cache line; tiled, a block is three lines of its own.
+// Contention shows as row-major falling behind once the threads run on separate cores; with one core the columns
+// only differ by the cost of the index arithmetic.
+inline void RunFramebufferBenchmark(uint32_t width, uint32_t height, uint32_t maxThreads, uint32_t repetitions)
+{
+	if (maxThreads == 0)
+		maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<uint32_t> threadCounts;
+	for (uint32_t count = 1; count < maxThreads; count *= 2)
+		threadCounts.push_back(count);
+	threadCounts.push_back(maxThreads);
+
+	constexpr uint32_t kPasses = 8;
+	std::cout << width << "x" << height << " frame written " << kPasses << " times, Mpixels/s, " << std::thread::hardware_concurrency() << " hardware threads\n";
+	std::cout << std::right << std::setw(8) << "threads" << std::setw(18) << "row-major bands" << std::setw(14) << "tiled bands"
+		<< std::setw(18) << "row-major 8x8" << std::setw(14) << "tiled 8x8" << '\n';
+
+	std::vector<RGB> rowMajor(size_t(width) * height);
+	Image tiled(width, height);
+	auto setRowMajor = [&](uint32_t x, uint32_t y, const RGB& color) { rowMajor[size_t(y) * width + x] = color; };
+	auto setTiled = [&](uint32_t x, uint32_t y, const RGB& color) { tiled.SetPixel(x, y, color); };
+	double rowMajorTiles = 0.0, tiledTiles = 0.0;
+	for (uint32_t count : threadCounts)
+	{
+		const double rowMajorBands = MeasureFramebufferWrites(width, height, count, false, 1, kPasses, repetitions, setRowMajor);
+		const double tiledBands = MeasureFramebufferWrites(width, height, count, false, Image::kTileSize, kPasses, repetitions, setTiled);
+		rowMajorTiles = MeasureFramebufferWrites(width, height, count, true, 1, kPasses, repetitions, setRowMajor);
+		tiledTiles = MeasureFramebufferWrites(width, height, count, true, 1, kPasses, repetitions, setTiled);
+		std::cout << std::fixed << std::setprecision(0) << std::setw(8) << count << std::setw(18) << rowMajorBands << std::setw(14) << tiledBands
+			<< std::setw(18) << rowMajorTiles << std::setw(14) << tiledTiles << '\n';
+	}
+	std::cout << std::setprecision(2) << "  8x8 tiles at " << threadCounts.back() << " thread(s): tiled writes " << tiledTiles / rowMajorTiles << "x as fast as row-major\n";
+	std::cout << "  (checksum " << int(rowMajor[size_t(width) * height / 2].r) + int(tiled.GetPixel(width / 2, height / 2).r) << ")\n";
+}
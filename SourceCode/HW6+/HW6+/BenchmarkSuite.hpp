@@ -0,0 +1,435 @@
+#pragma once
+
+#include "Benchmark.hpp"
+#include "CameraRays.hpp"
+#include "CommandLine.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+
+#include "rapidjson/document.h"
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Times of every run of one benchmark, and the amount of work one run does
+struct BenchmarkResult
+{
+	std::string name;		// Stable across versions, results are matched by name: "micro/closest_hit", "scene0/render"
+	std::string unit;		// Of the throughput, e.g. "Mrays/s"
+	double work = 0.0;		// Per run, in millions of the unit's items; 0 for phases without a throughput
+	std::vector<double> seconds;
+
+	double Best() const { return *std::min_element(seconds.begin(), seconds.end()); }
+	double Mean() const { return std::accumulate(seconds.begin(), seconds.end(), 0.0) / seconds.size(); }
+
+	// Sample standard deviation
+	double StdDev() const
+	{
+		if (seconds.size() < 2)
+			return 0.0;
+		const double mean = Mean();
+		double sum = 0.0;
+		for (double s : seconds)
+			sum += (s - mean) * (s - mean);
+		return std::sqrt(sum / (seconds.size() - 1));
+	}
+
+	// Of the best run
+	double Throughput() const { return work > 0.0 ? work / Best() : 0.0; }
+};
+
+// Micro and macro benchmarks of the whole renderer, with a report on stdout and optionally a JSON file to keep
+// and compare later runs against:
+//   micro/triangle_intersect       - IntersectTriangle() on the scalar path, in million ray-triangle tests per second
+//   micro/triangle_intersect_simd  - the same tests through the active SIMD kernels
+//   micro/closest_hit              - Scene::ClosestHit() for the primary rays at 192x108
+//   micro/any_hit                  - Scene::AnyHit() for shadow rays from those hits to the first light
+//   micro/camera_rays              - PrimaryRayGenerator on a 1920x1080 frame in 64x64 tiles
+//   micro/image_encode             - PPM encoding of a 1920x1080 image
+//   <scene>/load, render, encode   - every phase of one scene end to end, at the scene's resolution times --scale
+// The micro benchmarks use the scene with the most triangles.
+class BenchmarkSuite
+{
+public:
+	struct Options
+	{
+		std::vector<std::string> sceneFiles;
+		uint32_t repetitions = 5;
+		float scale = 0.25f;			// Of the image resolution of the scene benchmarks
+		std::string jsonFile;			// Where to write the results, if not empty
+		std::string baselineFile;		// Results to compare against, if not empty
+		double tolerance = 0.1;			// Slowdown of the best time above which a benchmark counts as a regression
+	};
+
+	// Command line: --benchmark [--repetitions N] [--scale S] [--json FILE] [--compare FILE] [--tolerance T] [scenes...]
+	static bool ParseArguments(const std::vector<std::string>& arguments, const std::vector<std::string>& defaultScenes, Options& options)
+	{
+		for (size_t i = 1; i < arguments.size(); ++i)
+		{
+			const std::string& argument = arguments[i];
+			const bool hasValue = i + 1 < arguments.size();
+			if (argument == "--repetitions" && hasValue)
+			{
+				if (!ParseFlagNumber("--repetitions", arguments[++i], "N", options.repetitions))
+					return false;
+				options.repetitions = std::max(1u, options.repetitions);
+			}
+			else if (argument == "--scale" && hasValue)
+			{
+				if (!ParseFlagNumber("--scale", arguments[++i], "S", options.scale))
+					return false;
+				if (!(options.scale > 0.f))
+				{
+					std::cout << "--scale must be above 0\n";
+					return false;
+				}
+			}
+			else if (argument == "--json" && hasValue)
+				options.jsonFile = arguments[++i];
+			else if (argument == "--compare" && hasValue)
+				options.baselineFile = arguments[++i];
+			else if (argument == "--tolerance" && hasValue)
+			{
+				if (!ParseFlagNumber("--tolerance", arguments[++i], "T", options.tolerance))
+					return false;
+			}
+			else if (argument.starts_with("--"))
+			{
+				std::cout << "Unknown benchmark option: " << argument << '\n';
+				return false;
+			}
+			else
+				options.sceneFiles.push_back(argument);
+		}
+		if (options.sceneFiles.empty())
+			options.sceneFiles = defaultScenes;
+		return true;
+	}
+
+	explicit BenchmarkSuite(const Options& options) : options(options) {}
+
+	// Returns the exit code: 1 if any benchmark regressed against the baseline
+	int Run()
+	{
+		std::cout << "Benchmark suite: " << options.repetitions << " repetitions, " << std::thread::hardware_concurrency() << " threads, SIMD "
+			<< SimdLevelName(ActiveSimdKernels().level) << ", scenes at " << options.scale << "x resolution\n";
+
+		runMicroBenchmarks();
+		for (const auto& sceneFile : options.sceneFiles)
+			runSceneBenchmark(sceneFile);
+
+		printResults();
+		if (!options.jsonFile.empty())
+			writeJson(options.jsonFile);
+		return options.baselineFile.empty() ? 0 : compareWithBaseline(options.baselineFile);
+	}
+
+	const std::vector<BenchmarkResult>& GetResults() const { return results; }
+
+protected:
+
+	template <typename Task>
+	BenchmarkResult& measure(const std::string& name, const std::string& unit, double work, const Task& task)
+	{
+		BenchmarkResult result{ name, unit, work, {} };
+		for (uint32_t i = 0; i < options.repetitions; ++i)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			task();
+			const auto end = std::chrono::steady_clock::now();
+			result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+		}
+		results.push_back(std::move(result));
+		return results.back();
+	}
+
+	void runMicroBenchmarks()
+	{
+		std::string largestScene;
+		size_t largestTriangleCount = 0;
+		for (const auto& sceneFile : options.sceneFiles)
+		{
+			const Scene scene(sceneFile);
+			const size_t triangleCount = scene.meshes.empty() ? 0 : scene.meshes.back().firstTriangle + scene.meshes.back().triangleCount;
+			if (largestScene.empty() || triangleCount > largestTriangleCount)
+			{
+				largestScene = sceneFile;
+				largestTriangleCount = triangleCount;
+			}
+		}
+		if (largestScene.empty())
+			return;
+
+		microScene = std::filesystem::path(largestScene).filename().string();
+		Scene scene(largestScene);
+		const std::vector<Ray> rays = MakePrimaryRays(scene, 192, 108);
+		std::cout << "Micro benchmarks on " << largestScene << " (" << largestTriangleCount << " triangles)\n";
+
+		// Every primary ray against every triangle of the largest mesh
+		const Mesh* largestMesh = nullptr;
+		for (const auto& mesh : scene.meshes)
+		{
+			if (!largestMesh || mesh.triangleCount > largestMesh->triangleCount)
+				largestMesh = &mesh;
+		}
+		if (largestMesh && largestMesh->triangleCount > 0)
+		{
+			const Mesh& mesh = *largestMesh;
+			const Vector3* positions = scene.geometry.Positions(mesh);
+			const double tests = static_cast<double>(rays.size()) * mesh.triangleCount / 1e6;
+			uint32_t hits = 0;
+			measure("micro/triangle_intersect", "Mtests/s", tests, [&]()
+				{
+					float t, u, v;
+					for (const Ray& ray : rays)
+					{
+						for (uint32_t triangle = 0; triangle < mesh.triangleCount; ++triangle)
+						{
+							const uint32_t i = 3 * triangle;
+							hits += IntersectTriangle(positions[scene.geometry.Index(mesh, i)], positions[scene.geometry.Index(mesh, i + 1)],
+								positions[scene.geometry.Index(mesh, i + 2)], ray, std::numeric_limits<float>::infinity(), t, u, v);
+						}
+					}
+				});
+			measure("micro/triangle_intersect_simd", "Mtests/s", tests, [&]()
+				{
+					const SimdKernels& kernels = ActiveSimdKernels();
+					for (const Ray& ray : rays)
+					{
+						TraversalHit closest;
+						hits += mesh.wideIndices
+							? kernels.closestHit32(positions, scene.geometry.Indices<uint32_t>(mesh), mesh.triangleCount, mesh.firstTriangle, ray, closest)
+							: kernels.closestHit16(positions, scene.geometry.Indices<uint16_t>(mesh), mesh.triangleCount, mesh.firstTriangle, ray, closest);
+					}
+				});
+			sink += hits;
+		}
+
+		std::vector<Ray> shadowRays;
+		measure("micro/closest_hit", "Mrays/s", rays.size() / 1e6, [&]()
+			{
+				shadowRays.clear();
+				for (const Ray& ray : rays)
+				{
+					const HitInfo hitInfo = scene.ClosestHit(ray);
+					if (!hitInfo.hit || scene.lights.empty())
+						continue;
+					const Vector3 origin = OffsetRayOrigin(hitInfo.point, hitInfo.normal);
+					const Vector3 toLight = scene.lights[0].position - origin;
+					shadowRays.push_back({ origin, Normalize(toLight), toLight.Magnitude() });
+				}
+			});
+
+		if (!shadowRays.empty())
+		{
+			measure("micro/any_hit", "Mrays/s", shadowRays.size() / 1e6, [&]()
+				{
+					for (const Ray& ray : shadowRays)
+						sink += scene.AnyHit(ray);
+				});
+		}
+
+		constexpr uint32_t width = 1920, height = 1080, tileSize = 64;
+		const PrimaryRayGenerator generator(scene.camera, width, height);
+		RayBatch batch;
+		measure("micro/camera_rays", "Mrays/s", width * height / 1e6, [&]()
+			{
+				for (uint32_t row = 0; row < height; row += tileSize)
+				{
+					for (uint32_t column = 0; column < width; column += tileSize)
+					{
+						generator.GenerateTile(column, row, std::min(tileSize, width - column), std::min(tileSize, height - row), batch);
+						sink += static_cast<size_t>(batch.directionZ[0] > 0.f);
+					}
+				}
+			});
+
+		Image image(width, height);
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			for (uint32_t column = 0; column < width; ++column)
+				image.SetPixel(column, row, { static_cast<uint8_t>(column), static_cast<uint8_t>(row), static_cast<uint8_t>(column ^ row) });
+		}
+		Scene::Settings settings = scene.settings;
+		settings.sceneName = temporaryImageName();
+		Renderer renderer(scene);
+		measure("micro/image_encode", "Mpixels/s", width * height / 1e6, [&]() { renderer.WriteToFile(image, settings); });
+		removeTemporaryImage(settings.sceneName);
+	}
+
+	// Load without the cache, render and encode, each timed on its own
+	void runSceneBenchmark(const std::string& sceneFile)
+	{
+		const std::string name = std::filesystem::path(sceneFile).stem().string();
+		std::cout << "Scene " << sceneFile << '\n';
+
+		const size_t fileSize = std::filesystem::file_size(sceneFile);
+		measure(name + "/load", "MB/s", fileSize / 1e6, [&]() { Scene scene(sceneFile, { .useCache = false }); });
+
+		Scene scene(sceneFile, { .useCache = false });
+		scene.settings.imageSettings.width = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.width * options.scale));
+		scene.settings.imageSettings.height = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.height * options.scale));
+		scene.settings.sceneName = temporaryImageName();
+		const double primaryRays = static_cast<double>(scene.settings.imageSettings.width) * scene.settings.imageSettings.height / 1e6;
+
+		Renderer renderer(scene);
+		Image image(1, 1);
+		measure(name + "/render", "Mrays/s", primaryRays, [&]() { image = renderer.Render(); });
+		measure(name + "/encode", "Mpixels/s", primaryRays, [&]() { renderer.WriteToFile(image, scene.settings); });
+		removeTemporaryImage(scene.settings.sceneName);
+	}
+
+	void printResults() const
+	{
+		std::cout << '\n' << std::left << std::setw(34) << "benchmark" << std::right
+			<< std::setw(12) << "best ms" << std::setw(12) << "mean ms" << std::setw(10) << "stddev %" << std::setw(14) << "throughput" << '\n';
+		for (const auto& result : results)
+		{
+			std::cout << std::left << std::setw(34) << result.name << std::right << std::fixed
+				<< std::setprecision(3) << std::setw(12) << result.Best() * 1e3
+				<< std::setw(12) << result.Mean() * 1e3
+				<< std::setprecision(1) << std::setw(10) << 100.0 * result.StdDev() / result.Mean();
+			if (result.work > 0.0)
+				std::cout << std::setprecision(2) << std::setw(14) << result.Throughput() << ' ' << result.unit;
+			std::cout << '\n';
+		}
+	}
+
+	void writeJson(const std::string& fileName) const
+	{
+		using namespace rapidjson;
+		StringBuffer buffer;
+		PrettyWriter<StringBuffer> writer(buffer);
+
+		const std::time_t now = std::time(nullptr);
+		char timestamp[32];
+		std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+		writer.StartObject();
+		writer.Key("version");
+		writer.Uint(1);
+		writer.Key("timestamp");
+		writer.String(timestamp);
+		writer.Key("threads");
+		writer.Uint(std::thread::hardware_concurrency());
+		writer.Key("simd_level");
+		writer.String(SimdLevelName(ActiveSimdKernels().level));
+		writer.Key("repetitions");
+		writer.Uint(options.repetitions);
+		writer.Key("scale");
+		writer.Double(options.scale);
+		writer.Key("micro_scene");
+		writer.String(microScene.c_str());
+		writer.Key("results");
+		writer.StartArray();
+		for (const auto& result : results)
+		{
+			writer.StartObject();
+			writer.Key("name");
+			writer.String(result.name.c_str());
+			writer.Key("unit");
+			writer.String(result.unit.c_str());
+			writer.Key("throughput");
+			writer.Double(result.Throughput());
+			writer.Key("best_seconds");
+			writer.Double(result.Best());
+			writer.Key("mean_seconds");
+			writer.Double(result.Mean());
+			writer.Key("stddev_seconds");
+			writer.Double(result.StdDev());
+			writer.Key("seconds");
+			writer.StartArray();
+			for (double s : result.seconds)
+				writer.Double(s);
+			writer.EndArray();
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.EndObject();
+
+		std::ofstream ofs(fileName, std::ios::out | std::ios::trunc);
+		if (!ofs.is_open())
+		{
+			std::cout << "Failed to write " << fileName << '\n';
+			return;
+		}
+		ofs << buffer.GetString() << '\n';
+		std::cout << "Results written to " << fileName << '\n';
+	}
+
+	// Best times against those of an earlier JSON report. Benchmarks missing from either side are skipped, and so are
+	// the micro benchmarks when the baseline ran them on another scene.
+	int compareWithBaseline(const std::string& fileName) const
+	{
+		using namespace rapidjson;
+		std::ifstream ifs(fileName);
+		if (!ifs.is_open())
+		{
+			std::cout << "Failed to open baseline " << fileName << '\n';
+			return 1;
+		}
+		std::stringstream text;
+		text << ifs.rdbuf();
+
+		Document doc;
+		doc.Parse(text.str().c_str());
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("results") || !doc["results"].IsArray())
+		{
+			std::cout << "Invalid baseline " << fileName << '\n';
+			return 1;
+		}
+
+		const bool sameMicroScene = doc.HasMember("micro_scene") && doc["micro_scene"].IsString() && microScene == doc["micro_scene"].GetString();
+		std::map<std::string, double> baseline;
+		for (const auto& entry : doc["results"].GetArray())
+		{
+			if (entry.HasMember("name") && entry["name"].IsString() && entry.HasMember("best_seconds") && entry["best_seconds"].IsNumber())
+				baseline[entry["name"].GetString()] = entry["best_seconds"].GetDouble();
+		}
+
+		std::cout << "\nAgainst " << fileName << " (tolerance " << std::setprecision(0) << options.tolerance * 100.0 << "%)\n";
+		uint32_t regressions = 0;
+		for (const auto& result : results)
+		{
+			const auto it = baseline.find(result.name);
+			if (it == baseline.end() || it->second <= 0.0 || (!sameMicroScene && result.name.starts_with("micro/")))
+				continue;
+			const double ratio = result.Best() / it->second;
+			const bool regressed = ratio > 1.0 + options.tolerance;
+			regressions += regressed;
+			std::cout << std::left << std::setw(34) << result.name << std::right << std::fixed << std::setprecision(3)
+				<< std::setw(10) << ratio << "x time" << (regressed ? "   REGRESSION" : "") << '\n';
+		}
+		std::cout << regressions << " regression(s)\n";
+		return regressions > 0 ? 1 : 0;
+	}
+
+	static std::string temporaryImageName()
+	{
+		return (std::filesystem::temp_directory_path() / "crt_benchmark").string();
+	}
+
+	static void removeTemporaryImage(const std::string& name)
+	{
+		std::error_code error;
+		std::filesystem::remove(name + "_render.ppm", error);
+	}
+
+	Options options;
+	std::string microScene;
+	std::vector<BenchmarkResult> results;
+	size_t sink = 0;	// Keeps the results of the timed loops alive
+};
@@ -0,0 +1,659 @@
+#pragma once
+
+#include "Geometry.hpp"
+#include "Math3D.hpp"
+#include "RenderStats.hpp"
+#include "SimdKernels.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// How the closest and any hit searches of a scene find their triangles
+enum class BvhLayout
+{
+	NONE,		// No hierarchy: every triangle of every mesh, through the SIMD kernels
+	FULL,		// Bounding volume hierarchy with float bounds, 32 bytes a node
+	QUANTIZED	// Same hierarchy with the bounds of a node as 8-bit steps of its parent's box, 12 bytes a node
+};
+
+inline const char* BvhLayoutName(BvhLayout layout)
+{
+	switch (layout)
+	{
+	case BvhLayout::NONE: return "none";
+	case BvhLayout::FULL: return "full";
+	case BvhLayout::QUANTIZED: return "quantized";
+	}
+	return "?";
+}
+
+// The layout of this name, as BvhLayoutName() gives it; false for none of them
+inline bool ParseBvhLayout(const std::string& name, BvhLayout& layout)
+{
+	for (auto candidate : { BvhLayout::NONE, BvhLayout::FULL, BvhLayout::QUANTIZED })
+	{
+		if (name == BvhLayoutName(candidate))
+		{
+			layout = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Up to kMaxRays rays that all end at one point, such as the shadow rays of neighbouring pixels toward one light:
+// ray i runs from its origin to target, which it reaches at rays[i].maxT. Finish() bounds the rays with a frustum
+// whose apex is the target, which lets Bvh::TraversePacket() skip a node for all of them at once.
+struct ShadowPacket
+{
+	static constexpr uint32_t kMaxRays = RayPacket::kMaxRays;
+
+	struct Plane
+	{
+		Vector3 normal;
+		float offset;		// The inside is where Dot(normal, point) + offset >= 0
+	};
+
+	Ray rays[kMaxRays];
+	RayPacket packed;		// The same rays, for the box tests
+	uint32_t count = 0;
+	Vector3 target{ 0.f };
+	Plane planes[6];
+	bool hasFrustum = false;	// False when the origins do not all lie in front of the target, seen along their mean direction
+
+	void Add(const Vector3& origin, const Vector3& direction, float distance)
+	{
+		assert(count < kMaxRays);
+		rays[count] = { origin, direction, distance };
+		packed.Set(count, rays[count]);
+		++count;
+	}
+
+	// Four side planes through the target that enclose the origins as seen from it, one plane through the target
+	// facing the origins and one behind the farthest origin
+	void Finish()
+	{
+		hasFrustum = false;
+		Vector3 center{ 0.f };
+		for (uint32_t i = 0; i < count; ++i)
+			center += rays[i].origin;
+		Vector3 axis = center * (1.f / static_cast<float>(count)) - target;
+		const float axisLength = Magnitude(axis);
+		if (!(axisLength > 0.f))
+			return;
+		axis *= 1.f / axisLength;
+		const Vector3 u = Normalize(Cross(axis, std::abs(axis.x) < 0.9f ? Vector3(1.f, 0.f, 0.f) : Vector3(0.f, 1.f, 0.f)));
+		const Vector3 v = Cross(axis, u);
+
+		float minU = std::numeric_limits<float>::max(), maxU = std::numeric_limits<float>::lowest();
+		float minV = minU, maxV = maxU, maxDepth = 0.f;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const Vector3 offset = rays[i].origin - target;
+			const float depth = Dot(offset, axis);
+			if (!(depth > 1e-4f * axisLength))
+				return;
+			const float x = Dot(offset, u) / depth, y = Dot(offset, v) / depth;
+			minU = std::min(minU, x);
+			maxU = std::max(maxU, x);
+			minV = std::min(minV, y);
+			maxV = std::max(maxV, y);
+			maxDepth = std::max(maxDepth, depth);
+		}
+
+		const Vector3 normals[6] = { u - axis * minU, axis * maxU - u, v - axis * minV, axis * maxV - v, axis, -axis };
+		for (int plane = 0; plane < 6; ++plane)
+			planes[plane] = { normals[plane], -Dot(normals[plane], target) };
+		planes[5].offset += maxDepth;
+		hasFrustum = true;
+	}
+};
+
+// Binary bounding volume hierarchy over the triangles of all meshes of a scene, built with the surface area
+// heuristic over binned centroids. A leaf holds triangles of one mesh only, and Build() reorders the triangles
+// of every mesh so those of a leaf are consecutive: a leaf is a range of scene-wide triangle IDs that the SIMD
+// kernels take as it is.
+//
+// In the quantized layout a node stores its box as 8-bit steps of 1/255 of its parent's box, the lower corner
+// counted up from the parent's lower corner and the upper one down from the parent's upper corner. The steps are
+// rounded outwards and checked against the exact bounds when encoding, so a decoded box always contains the
+// triangles below it; it is only a little looser. Traversal decodes the boxes of the children from the decoded
+// box of their parent, which it keeps on its stack; only the root box is stored as floats.
+class Bvh
+{
+public:
+	struct Bounds
+	{
+		float min[3];
+		float max[3];
+
+		// Contains nothing; takes the first point or box it grows by
+		static Bounds Empty()
+		{
+			constexpr float kMax = std::numeric_limits<float>::max(), kLowest = std::numeric_limits<float>::lowest();
+			return { { kMax, kMax, kMax }, { kLowest, kLowest, kLowest } };
+		}
+
+		void Grow(const Vector3& point)
+		{
+			const float coordinates[3] = { point.x, point.y, point.z };
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				min[axis] = std::min(min[axis], coordinates[axis]);
+				max[axis] = std::max(max[axis], coordinates[axis]);
+			}
+		}
+
+		void Grow(const Bounds& other)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				min[axis] = std::min(min[axis], other.min[axis]);
+				max[axis] = std::max(max[axis], other.max[axis]);
+			}
+		}
+
+		float HalfArea() const
+		{
+			const float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+			return x < 0.f ? 0.f : x * y + y * z + z * x;
+		}
+	};
+
+	// Two to a cache line; the children of a node are next to each other
+	struct Node
+	{
+		Bounds bounds;
+		uint32_t first;				// Inner nodes: the left child, the right one follows. Leaves: the first triangle, scene-wide
+		uint32_t triangleCount;		// 0 for inner nodes
+	};
+	static_assert(sizeof(Node) == 32);
+
+	struct QuantizedNode
+	{
+		uint8_t lower[3];			// Steps above the lower corner of the parent's box
+		uint8_t upper[3];			// Steps below the upper corner of the parent's box
+		uint16_t triangleCount;		// 0 for inner nodes
+		uint32_t first;				// As in Node
+	};
+	static_assert(sizeof(QuantizedNode) == 12);
+
+	Bvh() = default;
+
+	// Builds the hierarchy over the meshes and reorders the triangles in geometry to match; NONE builds nothing
+	static Bvh Build(const std::vector<Mesh>& meshes, GeometryArena& geometry, BvhLayout layout)
+	{
+		Bvh bvh;
+		if (layout == BvhLayout::NONE)
+			return bvh;
+
+		TraceScope trace("build bvh", [&] { return BvhLayoutName(layout); });
+		std::vector<BuildTriangle> triangles;
+		for (uint32_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+		{
+			const Mesh& mesh = meshes[meshIndex];
+			const Vector3* positions = geometry.Positions(mesh);
+			for (uint32_t triangleIndex = 0; triangleIndex < mesh.triangleCount; ++triangleIndex)
+			{
+				BuildTriangle triangle{ Bounds::Empty(), {}, meshIndex, triangleIndex };
+				for (uint32_t corner = 0; corner < 3; ++corner)
+					triangle.bounds.Grow(positions[geometry.Index(mesh, 3 * size_t(triangleIndex) + corner)]);
+				for (int axis = 0; axis < 3; ++axis)
+					triangle.center[axis] = 0.5f * (triangle.bounds.min[axis] + triangle.bounds.max[axis]);
+				triangles.push_back(triangle);
+			}
+		}
+		if (triangles.empty())
+			return bvh;
+
+		bvh.layout = layout;
+		bvh.buildNodes(triangles);
+		bvh.reorderTriangles(meshes, geometry, triangles);
+		if (layout == BvhLayout::QUANTIZED)
+			bvh.quantize();
+		return bvh;
+	}
+
+	BvhLayout GetLayout() const { return layout; }
+	bool IsBuilt() const { return layout != BvhLayout::NONE; }
+
+	size_t NodeCount() const { return layout == BvhLayout::QUANTIZED ? quantizedNodes.size() : nodes.size(); }
+	size_t NodeBytes() const { return layout == BvhLayout::QUANTIZED ? sizeof(QuantizedNode) : sizeof(Node); }
+	// Everything traversal reads, the float root box of the quantized layout included
+	size_t MemoryBytes() const { return NodeCount() * NodeBytes() + (layout == BvhLayout::QUANTIZED ? sizeof(Bounds) : 0); }
+
+	// Calls leaf(firstTriangle, triangleCount) for every leaf whose box the ray enters at or below tMax, visiting
+	// nearer boxes first, until leaf returns true. tMax may shrink while the search runs, as the closest hit does.
+	// Counts the box tests in the render statistics.
+	template <typename Leaf>
+	void Traverse(const Ray& ray, const float& tMax, const Leaf& leaf) const
+	{
+		if (layout == BvhLayout::QUANTIZED)
+			traverse<true>(ray, tMax, leaf);
+		else if (layout == BvhLayout::FULL)
+			traverse<false>(ray, tMax, leaf);
+	}
+
+	// Finds which rays of a finished packet are blocked: calls leaf(firstTriangle, triangleCount, rays) for the
+	// leaves that some unblocked ray enters, rays being the mask of those that do, and takes the mask it returns as
+	// blocked. Every node is tested against the rays that entered its parent only, all at once with the SIMD
+	// kernels, after a test against the frustum of the packet that can skip it for all of them. Returns the mask of
+	// the blocked rays and counts a box test for each ray tested against a box and for each frustum test.
+	template <typename Leaf>
+	uint64_t TraversePacket(const ShadowPacket& packet, const Leaf& leaf) const
+	{
+		uint64_t active = packet.count >= 64 ? ~uint64_t(0) : (uint64_t(1) << packet.count) - 1;
+		if (!IsBuilt() || active == 0)
+			return 0;
+
+		struct Entry
+		{
+			uint32_t node;
+			uint64_t rays;		// That entered the parent
+			Bounds bounds;
+		};
+		const SimdKernels& kernels = ActiveSimdKernels();
+		const bool quantized = layout == BvhLayout::QUANTIZED;
+		Entry stack[kMaxDepth + 1];
+		stack[0] = { 0, active, quantized ? rootBounds : nodes[0].bounds };
+		uint32_t size = 1;
+		uint64_t blocked = 0;
+		uint64_t boxTests = 0;
+		while (size > 0 && active != 0)
+		{
+			const Entry entry = stack[--size];
+			const uint64_t candidates = entry.rays & active;
+			if (candidates == 0)
+				continue;
+			if (packet.hasFrustum)
+			{
+				++boxTests;
+				if (outsideFrustum(entry.bounds, packet))
+					continue;
+			}
+			boxTests += std::popcount(candidates);
+			const uint64_t entering = kernels.packetBoxHits(packet.packed, entry.bounds.min, entry.bounds.max, candidates);
+			if (entering == 0)
+				continue;
+
+			const uint32_t first = quantized ? quantizedNodes[entry.node].first : nodes[entry.node].first;
+			const uint32_t triangleCount = quantized ? quantizedNodes[entry.node].triangleCount : nodes[entry.node].triangleCount;
+			if (triangleCount > 0)
+			{
+				const uint64_t leafBlocked = leaf(first, triangleCount, entering) & entering;
+				blocked |= leafBlocked;
+				active &= ~leafBlocked;
+				continue;
+			}
+
+			for (uint32_t child = first; child < first + 2; ++child)
+				stack[size++] = { child, entering, quantized ? decode(quantizedNodes[child], entry.bounds) : nodes[child].bounds };
+		}
+		CountRenderStat(&RenderStats::boxTests, boxTests);
+		return blocked;
+	}
+
+private:
+	static constexpr uint32_t kBinCount = 16;
+	static constexpr uint32_t kMaxLeafTriangles = 8;
+	static constexpr float kTraversalCost = 1.f;		// Of a box test, in triangle tests
+	// Past this depth nodes are split in half by count, which keeps the depth below kMaxDepth for any scene
+	static constexpr uint32_t kMedianSplitDepth = 32;
+	static constexpr uint32_t kMaxDepth = kMedianSplitDepth + 32 + kMaxLeafTriangles;
+	static constexpr float kQuantizationStep = 1.f / 255.f;
+
+	struct BuildTriangle
+	{
+		Bounds bounds;
+		float center[3];
+		uint32_t mesh;
+		uint32_t triangle;			// Within the mesh
+	};
+
+	// Splits by the surface area heuristic until a node is cheaper as a leaf than split; leaves have at most
+	// kMaxLeafTriangles triangles, all of one mesh. Leaves are left holding their range of triangles;
+	// reorderTriangles() turns that into triangle IDs.
+	void buildNodes(std::vector<BuildTriangle>& triangles)
+	{
+		struct Task
+		{
+			uint32_t node, begin, end, depth;
+		};
+		nodes.reserve(2 * triangles.size());
+		nodes.push_back({});
+		std::vector<Task> tasks{ { 0, 0, static_cast<uint32_t>(triangles.size()), 0 } };
+		while (!tasks.empty())
+		{
+			const Task task = tasks.back();
+			tasks.pop_back();
+			const uint32_t count = task.end - task.begin;
+
+			Bounds bounds = Bounds::Empty(), centers = Bounds::Empty();
+			bool singleMesh = true;
+			for (uint32_t i = task.begin; i < task.end; ++i)
+			{
+				bounds.Grow(triangles[i].bounds);
+				centers.Grow(Vector3(triangles[i].center[0], triangles[i].center[1], triangles[i].center[2]));
+				singleMesh = singleMesh && triangles[i].mesh == triangles[task.begin].mesh;
+			}
+			nodes[task.node].bounds = bounds;
+
+			uint32_t middle = task.begin;
+			if (count > 1 && task.depth < kMedianSplitDepth)
+				middle = splitBySah(triangles, task.begin, task.end, bounds, centers, count <= kMaxLeafTriangles);
+			if (middle == task.begin && (count > kMaxLeafTriangles || !singleMesh))
+			{
+				const uint32_t firstMesh = triangles[task.begin].mesh;
+				middle = count > kMaxLeafTriangles
+					? task.begin + count / 2
+					: static_cast<uint32_t>(std::partition(triangles.begin() + task.begin, triangles.begin() + task.end, [&](const BuildTriangle& triangle) { return triangle.mesh == firstMesh; }) - triangles.begin());
+			}
+
+			if (middle == task.begin)
+			{
+				nodes[task.node].first = task.begin;
+				nodes[task.node].triangleCount = count;
+				continue;
+			}
+			const uint32_t left = static_cast<uint32_t>(nodes.size());
+			nodes[task.node].first = left;
+			nodes[task.node].triangleCount = 0;
+			nodes.push_back({});
+			nodes.push_back({});
+			tasks.push_back({ left + 1, middle, task.end, task.depth + 1 });
+			tasks.push_back({ left, task.begin, middle, task.depth + 1 });
+		}
+	}
+
+	// Partitions the triangles at the cheapest split plane between bins of the centroids, along any axis, and returns
+	// the first triangle of the right half. Returns begin when the node is better off as a leaf, which is only allowed
+	// for small nodes, or when all centroids coincide.
+	static uint32_t splitBySah(std::vector<BuildTriangle>& triangles, uint32_t begin, uint32_t end, const Bounds& bounds, const Bounds& centers, bool allowLeaf)
+	{
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1;
+		uint32_t bestBin = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const float extent = centers.max[axis] - centers.min[axis];
+			if (!(extent > 0.f))
+				continue;
+			const float binScale = kBinCount / extent;
+			auto binOf = [&](const BuildTriangle& triangle) { return std::min(static_cast<uint32_t>((triangle.center[axis] - centers.min[axis]) * binScale), kBinCount - 1); };
+
+			std::array<Bounds, kBinCount> binBounds;
+			binBounds.fill(Bounds::Empty());
+			std::array<uint32_t, kBinCount> binCounts{};
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				const uint32_t bin = binOf(triangles[i]);
+				binBounds[bin].Grow(triangles[i].bounds);
+				++binCounts[bin];
+			}
+
+			// Area times count of everything right of each split, swept from the right
+			std::array<float, kBinCount> rightCosts{};
+			Bounds right = Bounds::Empty();
+			uint32_t rightCount = 0;
+			for (uint32_t bin = kBinCount - 1; bin > 0; --bin)
+			{
+				right.Grow(binBounds[bin]);
+				rightCount += binCounts[bin];
+				rightCosts[bin] = right.HalfArea() * rightCount;
+			}
+			Bounds left = Bounds::Empty();
+			uint32_t leftCount = 0;
+			for (uint32_t bin = 0; bin + 1 < kBinCount; ++bin)
+			{
+				left.Grow(binBounds[bin]);
+				leftCount += binCounts[bin];
+				const float cost = left.HalfArea() * leftCount + rightCosts[bin + 1];
+				if (leftCount > 0 && leftCount < end - begin && cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = bin;
+				}
+			}
+		}
+
+		if (bestAxis < 0)
+			return begin;
+		const float area = bounds.HalfArea();
+		if (allowLeaf && area > 0.f && kTraversalCost + bestCost / area >= static_cast<float>(end - begin))
+			return begin;
+
+		const float extent = centers.max[bestAxis] - centers.min[bestAxis];
+		const float binScale = kBinCount / extent;
+		auto middle = std::partition(triangles.begin() + begin, triangles.begin() + end, [&](const BuildTriangle& triangle)
+			{
+				return std::min(static_cast<uint32_t>((triangle.center[bestAxis] - centers.min[bestAxis]) * binScale), kBinCount - 1) <= bestBin;
+			});
+		return static_cast<uint32_t>(middle - triangles.begin());
+	}
+
+	// Gives the leaves their triangle IDs, in depth-first order, and rewrites the index buffer of every mesh in that order
+	void reorderTriangles(const std::vector<Mesh>& meshes, GeometryArena& geometry, const std::vector<BuildTriangle>& triangles)
+	{
+		std::vector<std::vector<uint32_t>> newIndices(meshes.size());
+		for (size_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+			newIndices[meshIndex].reserve(3 * size_t(meshes[meshIndex].triangleCount));
+
+		std::vector<uint32_t> stack{ 0 };
+		while (!stack.empty())
+		{
+			Node& node = nodes[stack.back()];
+			stack.pop_back();
+			if (node.triangleCount == 0)
+			{
+				stack.push_back(node.first + 1);
+				stack.push_back(node.first);
+				continue;
+			}
+
+			const uint32_t meshIndex = triangles[node.first].mesh;
+			const Mesh& mesh = meshes[meshIndex];
+			std::vector<uint32_t>& indices = newIndices[meshIndex];
+			const uint32_t begin = node.first;
+			node.first = mesh.firstTriangle + static_cast<uint32_t>(indices.size() / 3);
+			for (uint32_t i = begin; i < begin + node.triangleCount; ++i)
+			{
+				assert(triangles[i].mesh == meshIndex);
+				for (uint32_t corner = 0; corner < 3; ++corner)
+					indices.push_back(geometry.Index(mesh, 3 * size_t(triangles[i].triangle) + corner));
+			}
+		}
+
+		for (size_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+		{
+			const Mesh& mesh = meshes[meshIndex];
+			const std::vector<uint32_t>& indices = newIndices[meshIndex];
+			assert(indices.size() == 3 * size_t(mesh.triangleCount));
+			if (mesh.wideIndices)
+				std::copy(indices.begin(), indices.end(), geometry.Indices32() + mesh.firstIndex);
+			else
+				std::transform(indices.begin(), indices.end(), geometry.Indices16() + mesh.firstIndex, [](uint32_t index) { return static_cast<uint16_t>(index); });
+		}
+	}
+
+	// The lower corner of the box step steps above the parent's, the upper corner step steps below the parent's
+	static float decodeLower(const Bounds& parent, int axis, uint8_t step)
+	{
+		return parent.min[axis] + static_cast<float>(step) * ((parent.max[axis] - parent.min[axis]) * kQuantizationStep);
+	}
+
+	static float decodeUpper(const Bounds& parent, int axis, uint8_t step)
+	{
+		return parent.max[axis] - static_cast<float>(step) * ((parent.max[axis] - parent.min[axis]) * kQuantizationStep);
+	}
+
+	static Bounds decode(const QuantizedNode& node, const Bounds& parent)
+	{
+		Bounds bounds;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			bounds.min[axis] = decodeLower(parent, axis, node.lower[axis]);
+			bounds.max[axis] = decodeUpper(parent, axis, node.upper[axis]);
+		}
+		return bounds;
+	}
+
+	// Replaces the float nodes with quantized ones, each child encoded against the decoded box of its parent. Step 0
+	// decodes to the parent's corner exactly, so rounding a step down until it covers the exact bound always ends.
+	void quantize()
+	{
+		TraceScope trace("quantize bvh");
+		rootBounds = nodes[0].bounds;
+		quantizedNodes.assign(nodes.size(), {});
+		std::vector<std::pair<uint32_t, Bounds>> stack{ { 0, rootBounds } };
+		while (!stack.empty())
+		{
+			const auto [nodeIndex, decoded] = stack.back();
+			stack.pop_back();
+			const Node& node = nodes[nodeIndex];
+			QuantizedNode& quantized = quantizedNodes[nodeIndex];
+			quantized.first = node.first;
+			quantized.triangleCount = static_cast<uint16_t>(node.triangleCount);
+			if (node.triangleCount > 0)
+				continue;
+
+			for (uint32_t child = node.first; child < node.first + 2; ++child)
+			{
+				const Bounds& exact = nodes[child].bounds;
+				QuantizedNode& encoded = quantizedNodes[child];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					const float step = (decoded.max[axis] - decoded.min[axis]) * kQuantizationStep;
+					auto initialStep = [&](float distance) { return step > 0.f ? static_cast<uint8_t>(std::clamp(std::floor(distance / step), 0.f, 255.f)) : uint8_t(0); };
+					encoded.lower[axis] = initialStep(exact.min[axis] - decoded.min[axis]);
+					while (encoded.lower[axis] > 0 && decodeLower(decoded, axis, encoded.lower[axis]) > exact.min[axis])
+						--encoded.lower[axis];
+					encoded.upper[axis] = initialStep(decoded.max[axis] - exact.max[axis]);
+					while (encoded.upper[axis] > 0 && decodeUpper(decoded, axis, encoded.upper[axis]) < exact.max[axis])
+						--encoded.upper[axis];
+				}
+				stack.push_back({ child, decode(encoded, decoded) });
+			}
+		}
+		nodes.clear();
+		nodes.shrink_to_fit();
+	}
+
+	// Slab test, clipped to [0, min(tMax, ray.maxT)]. An axis the ray is parallel to gives NaN distances when the
+	// origin lies on a slab plane; the comparisons are ordered so those leave the interval as it is.
+	static bool intersectBox(const Bounds& bounds, const Ray& ray, const float (&inverseDirection)[3], float tMax, float& tNear)
+	{
+		const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+		float entry = 0.f, exit = std::min(tMax, ray.maxT);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float slabNear = (bounds.min[axis] - origin[axis]) * inverseDirection[axis];
+			float slabFar = (bounds.max[axis] - origin[axis]) * inverseDirection[axis];
+			if (slabNear > slabFar)
+				std::swap(slabNear, slabFar);
+			slabFar *= kSlabFarScale;
+			entry = slabNear > entry ? slabNear : entry;
+			exit = slabFar < exit ? slabFar : exit;
+			if (entry > exit)
+				return false;
+		}
+		tNear = entry;
+		return true;
+	}
+
+	// Whether the box lies wholly outside one of the planes of the packet's frustum. The corner of the box farthest
+	// inside each plane is tested, with a little slack for rounding.
+	static bool outsideFrustum(const Bounds& bounds, const ShadowPacket& packet)
+	{
+		for (const ShadowPacket::Plane& plane : packet.planes)
+		{
+			const Vector3 corner(plane.normal.x >= 0.f ? bounds.max[0] : bounds.min[0], plane.normal.y >= 0.f ? bounds.max[1] : bounds.min[1],
+				plane.normal.z >= 0.f ? bounds.max[2] : bounds.min[2]);
+			const float distance = Dot(plane.normal, corner);
+			if (distance + plane.offset < -1e-5f * (1.f + std::abs(distance) + std::abs(plane.offset)))
+				return true;
+		}
+		return false;
+	}
+
+	template <bool kQuantized, typename Leaf>
+	void traverse(const Ray& ray, const float& tMax, const Leaf& leaf) const
+	{
+		const float inverseDirection[3] = { 1.f / ray.directionN.x, 1.f / ray.directionN.y, 1.f / ray.directionN.z };
+		uint32_t nodeStack[kMaxDepth + 1];
+		float nearStack[kMaxDepth + 1];
+		Bounds boundsStack[kQuantized ? kMaxDepth + 1 : 1];
+		uint32_t size = 0;
+		uint64_t boxTests = 1;
+
+		const Bounds& root = kQuantized ? rootBounds : nodes[0].bounds;
+		float rootNear;
+		if (intersectBox(root, ray, inverseDirection, tMax, rootNear))
+		{
+			nodeStack[0] = 0;
+			nearStack[0] = rootNear;
+			if constexpr (kQuantized)
+				boundsStack[0] = root;
+			size = 1;
+		}
+
+		while (size > 0)
+		{
+			--size;
+			if (nearStack[size] > tMax)
+				continue;
+			const uint32_t nodeIndex = nodeStack[size];
+			const uint32_t first = kQuantized ? quantizedNodes[nodeIndex].first : nodes[nodeIndex].first;
+			const uint32_t triangleCount = kQuantized ? quantizedNodes[nodeIndex].triangleCount : nodes[nodeIndex].triangleCount;
+			if (triangleCount > 0)
+			{
+				if (leaf(first, triangleCount))
+					break;
+				continue;
+			}
+
+			Bounds childBounds[2];
+			if constexpr (kQuantized)
+			{
+				const Bounds parent = boundsStack[size];
+				childBounds[0] = decode(quantizedNodes[first], parent);
+				childBounds[1] = decode(quantizedNodes[first + 1], parent);
+			}
+			else
+			{
+				childBounds[0] = nodes[first].bounds;
+				childBounds[1] = nodes[first + 1].bounds;
+			}
+			float childNear[2];
+			const bool hit[2] = { intersectBox(childBounds[0], ray, inverseDirection, tMax, childNear[0]), intersectBox(childBounds[1], ray, inverseDirection, tMax, childNear[1]) };
+			boxTests += 2;
+
+			// The nearer child goes on top
+			const uint32_t nearer = hit[1] && (!hit[0] || childNear[1] < childNear[0]) ? 1 : 0;
+			for (uint32_t child : { 1 - nearer, nearer })
+			{
+				if (!hit[child])
+					continue;
+				nodeStack[size] = first + child;
+				nearStack[size] = childNear[child];
+				if constexpr (kQuantized)
+					boundsStack[size] = childBounds[child];
+				++size;
+			}
+		}
+		CountRenderStat(&RenderStats::boxTests, boxTests);
+	}
+
+	BvhLayout layout = BvhLayout::NONE;
+	std::vector<Node> nodes;
+	std::vector<QuantizedNode> quantizedNodes;
+	Bounds rootBounds{};					// Of the quantized layout, whose nodes only know their box relative to the parent
+};
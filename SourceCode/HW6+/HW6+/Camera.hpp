@@ -5,9 +5,33 @@
 class Camera
 {
 public:
+	enum class Projection
+	{
+		PINHOLE,
+		ORTHOGRAPHIC,
+		THIN_LENS
+	};
+
+	// Everything the primary rays of a frame have in common, computed once per frame
+	struct Basis
+	{
+		Projection projection;
+		Vector3 position;
+		Vector3 forward;
+		Vector3 up;
+		Vector3 right;
+		float orthographicScale;	// World units per unit of screen space
+		float apertureRadius;
+		float focusDistance;
+	};
+
 	Camera() = default;
 
 	Matrix4 transform = Matrix4::Identity();
+	Projection projection = Projection::PINHOLE;
+	float orthographicHeight = 2.f;	// Height of the view of the ORTHOGRAPHIC camera, in world units
+	float apertureRadius = 0.f;		// THIN_LENS only
+	float focusDistance = 1.f;		// THIN_LENS only: distance of the plane in focus, along the look direction
 
 	Point3 GetPosition() const
 	{
@@ -18,4 +42,19 @@ public:
 	{
 		return Normalize(transform * Vector3(0.f, 0.f, -1.f));
 	}
-};
\ No newline at end of file
+
+	// Up vector is Y axis in camera space and right vector is X axis in camera space
+	Basis GetBasis() const
+	{
+		Basis basis;
+		basis.projection = projection;
+		basis.position = GetPosition();
+		basis.forward = GetLookDirection();
+		basis.up = Normalize(transform * Vector3(0.f, 1.f, 0.f));
+		basis.right = Cross(basis.forward, basis.up);
+		basis.orthographicScale = 0.5f * orthographicHeight; // Screen y spans [-1, 1]
+		basis.apertureRadius = apertureRadius;
+		basis.focusDistance = focusDistance;
+		return basis;
+	}
+};
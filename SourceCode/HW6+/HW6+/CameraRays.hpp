@@ -0,0 +1,164 @@
+#pragma once
+
+#include "Camera.hpp"
+#include "Math3D.hpp"
+#include "SimdKernels.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <vector>
+
+// Primary rays of one frame. The camera basis, the screen coordinates of every column and row and the lens samples
+// are computed once in the constructor, so a tile of rays costs only the per pixel combination, done by the SIMD
+// kernels.
+class PrimaryRayGenerator
+{
+public:
+	// The thin lens samples repeat every kLensPatternRows rows
+	static constexpr uint32_t kLensPatternRows = 32;
+
+	PrimaryRayGenerator(const Camera& camera, uint32_t imageWidth, uint32_t imageHeight)
+		: basis(camera.GetBasis()), imageWidth(imageWidth), imageHeight(imageHeight)
+	{
+		screenX.resize(imageWidth);
+		for (uint32_t column = 0; column < imageWidth; ++column)
+		{
+			float x = static_cast<float>(column) + 0.5f; // To pixel center
+			x /= imageWidth; // To NDC
+			x = 2.f * x - 1.f; // To screen space
+			x *= static_cast<float>(imageWidth) / imageHeight; // Consider aspect ratio
+			screenX[column] = x;
+		}
+
+		screenY.resize(imageHeight);
+		for (uint32_t row = 0; row < imageHeight; ++row)
+		{
+			float y = static_cast<float>(row) + 0.5f; // To pixel center
+			y /= imageHeight; // To NDC
+			y = 1.f - (2.f * y); // To screen space
+			screenY[row] = y;
+		}
+
+		if (basis.projection == Camera::Projection::THIN_LENS)
+			makeLensSamples();
+	}
+
+	const Camera::Basis& GetBasis() const { return basis; }
+
+	// Rays of a tile, row by row. Sample 0 goes through the pixel centers; every further sample of a pixel is moved
+	// within the pixel along the R2 sequence, and takes the lens sample of another row, rotated by the golden angle.
+	void GenerateTile(uint32_t firstColumn, uint32_t firstRow, uint32_t width, uint32_t height, RayBatch& rays, uint32_t sample = 0) const
+	{
+		rays.Resize(size_t(width) * height);
+		const SimdKernels& kernels = ActiveSimdKernels();
+
+		const float* tileScreenX = screenX.data() + firstColumn;
+		float offsetY = 0.f;
+		std::vector<float> jitteredX, rotatedLensX, rotatedLensY;
+		float lensCos = 1.f, lensSin = 0.f;
+		if (sample > 0)
+		{
+			// Screen space is 2 / imageHeight per pixel in both directions
+			constexpr double g = 1.32471795724474602596;
+			const float pixelSize = 2.f / imageHeight;
+			const float offsetX = static_cast<float>(std::fmod(0.5 + sample / g, 1.0) - 0.5);
+			offsetY = -static_cast<float>(std::fmod(0.5 + sample / (g * g), 1.0) - 0.5) * pixelSize;
+			jitteredX.resize(width);
+			for (uint32_t column = 0; column < width; ++column)
+				jitteredX[column] = tileScreenX[column] + offsetX * pixelSize;
+			tileScreenX = jitteredX.data();
+
+			const float angle = sample * std::numbers::pi_v<float> * (3.f - std::sqrt(5.f));
+			lensCos = std::cos(angle);
+			lensSin = std::sin(angle);
+			if (!lensX.empty())
+			{
+				rotatedLensX.resize(width);
+				rotatedLensY.resize(width);
+			}
+		}
+
+		for (uint32_t tileRow = 0; tileRow < height; ++tileRow)
+		{
+			const uint32_t row = firstRow + tileRow;
+			const float* rowLensX = nullptr;
+			const float* rowLensY = nullptr;
+			if (!lensX.empty())
+			{
+				const size_t offset = size_t((row + sample) % kLensPatternRows) * imageWidth + firstColumn;
+				rowLensX = lensX.data() + offset;
+				rowLensY = lensY.data() + offset;
+				if (sample > 0)
+				{
+					for (uint32_t column = 0; column < width; ++column)
+					{
+						rotatedLensX[column] = lensCos * rowLensX[column] - lensSin * rowLensY[column];
+						rotatedLensY[column] = lensSin * rowLensX[column] + lensCos * rowLensY[column];
+					}
+					rowLensX = rotatedLensX.data();
+					rowLensY = rotatedLensY.data();
+				}
+			}
+			kernels.primaryRays(basis, tileScreenX, screenY[row] + offsetY, rowLensX, rowLensY, width, rays, size_t(tileRow) * width);
+		}
+	}
+
+	// A single ray, through the scalar code
+	Ray GenerateRay(uint32_t column, uint32_t row) const
+	{
+		RayBatch rays;
+		rays.Resize(1);
+		const size_t lensOffset = size_t(row % kLensPatternRows) * imageWidth + column;
+		simd_scalar::PrimaryRays(basis, &screenX[column], screenY[row], lensX.empty() ? nullptr : &lensX[lensOffset], lensY.empty() ? nullptr : &lensY[lensOffset], 1, rays, 0);
+		return rays.Get(0);
+	}
+
+protected:
+
+	// One point on the lens per pixel, from a hash of the pixel position mapped to the disk with the concentric mapping
+	void makeLensSamples()
+	{
+		auto hash = [](uint32_t value)
+			{
+				value ^= value >> 16;
+				value *= 0x7feb352du;
+				value ^= value >> 15;
+				value *= 0x846ca68bu;
+				value ^= value >> 16;
+				return value;
+			};
+		auto toUnit = [](uint32_t value) { return static_cast<float>(value >> 8) * (2.f / 16777216.f) - 1.f; }; // [-1, 1)
+
+		const size_t sampleCount = size_t(kLensPatternRows) * imageWidth;
+		lensX.resize(sampleCount);
+		lensY.resize(sampleCount);
+		for (size_t i = 0; i < sampleCount; ++i)
+		{
+			const uint32_t h = hash(static_cast<uint32_t>(i));
+			const float a = toUnit(h);
+			const float b = toUnit(hash(h));
+			float radius = 0.f, phi = 0.f;
+			if (std::abs(a) > std::abs(b))
+			{
+				radius = a;
+				phi = (std::numbers::pi_v<float> / 4.f) * (b / a);
+			}
+			else if (b != 0.f)
+			{
+				radius = b;
+				phi = (std::numbers::pi_v<float> / 2.f) - (std::numbers::pi_v<float> / 4.f) * (a / b);
+			}
+			lensX[i] = basis.apertureRadius * radius * std::cos(phi);
+			lensY[i] = basis.apertureRadius * radius * std::sin(phi);
+		}
+	}
+
+	Camera::Basis basis;
+	uint32_t imageWidth;
+	uint32_t imageHeight;
+	std::vector<float> screenX;
+	std::vector<float> screenY;
+	std::vector<float> lensX;
+	std::vector<float> lensY;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <concepts>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+// The argument after flag, empty when the flag is missing, last, or followed by another flag, so that
+// "--trace --heatmap" does not take --heatmap for a file name. found tells whether the flag is there at all.
+inline std::string FlagValue(const std::vector<std::string>& arguments, const char* flag, bool& found)
+{
+	const auto it = std::find(arguments.begin(), arguments.end(), flag);
+	found = it != arguments.end();
+	return found && it + 1 != arguments.end() && !(it + 1)->starts_with("--") ? *(it + 1) : std::string();
+}
+
+// Parses the value of a numeric flag, or prints its usage when the value is not a number of the flag's type: a
+// whole number in range for unsigned types, a finite one in range for floating point types
+template <typename Number>
+	requires std::unsigned_integral<Number> || std::floating_point<Number>
+bool ParseFlagNumber(const char* flag, const std::string& value, const char* usage, Number& number)
+{
+	try
+	{
+		size_t end = 0;
+		if constexpr (std::unsigned_integral<Number>)
+		{
+			const unsigned long long parsed = std::stoull(value, &end);
+			if (end == value.size() && value[0] != '-' && parsed <= std::numeric_limits<Number>::max())
+			{
+				number = static_cast<Number>(parsed);
+				return true;
+			}
+		}
+		else
+		{
+			const double parsed = std::stod(value, &end);
+			if (end == value.size() && std::abs(parsed) <= std::numeric_limits<Number>::max())
+			{
+				number = static_cast<Number>(parsed);
+				return true;
+			}
+		}
+	}
+	catch (const std::exception&)
+	{
+	}
+	std::cout << "Usage: " << flag << ' ' << usage << '\n';
+	return false;
+}
+
+// The same for the value at index of a mode's positional arguments, arguments[0] being the mode. A value that is not
+// given leaves number as it is.
+template <typename Number>
+bool ParseArgumentNumber(const std::vector<std::string>& arguments, size_t index, const char* usage, Number& number)
+{
+	return arguments.size() <= index || ParseFlagNumber(arguments[0].c_str(), arguments[index], usage, number);
+}
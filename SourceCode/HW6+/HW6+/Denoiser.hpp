@@ -0,0 +1,225 @@
+#pragma once
+
+#include "Math3D.hpp"
+#include "Parallel.hpp"
+#include "SimdKernels.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// What the first surface seen through a pixel looks like, recorded by the primary rays for the denoiser
+struct PixelGuide
+{
+	Vector3 normal{ 0.f };		// Shading normal, zero where the ray escaped
+	float depth = 0.f;			// Distance along the primary ray, 0 where the ray escaped
+	Vector3 albedo{ 1.f };		// Of the material hit, white where the ray escaped
+};
+
+// Linear radiance and guides of every pixel of a frame, each channel in a plane of its own for the vector kernels
+struct FeatureBuffers
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::array<std::vector<float>, 3> radiance;
+	std::array<std::vector<float>, 3> normal;
+	std::array<std::vector<float>, 3> albedo;
+	std::vector<float> depth;
+	std::vector<float> variance;	// Of the luminance of the radiance, the mean of the samples; negative if unknown
+
+	void Resize(uint32_t newWidth, uint32_t newHeight)
+	{
+		width = newWidth;
+		height = newHeight;
+		const size_t count = size_t(width) * height;
+		for (size_t channel = 0; channel < 3; ++channel)
+		{
+			radiance[channel].assign(count, 0.f);
+			normal[channel].assign(count, 0.f);
+			albedo[channel].assign(count, 0.f);
+		}
+		depth.assign(count, 0.f);
+		variance.assign(count, -1.f);
+	}
+
+	void Set(uint32_t x, uint32_t y, const Vector3& pixelRadiance, const PixelGuide& guide, float luminanceVariance)
+	{
+		const size_t i = size_t(y) * width + x;
+		radiance[0][i] = pixelRadiance.x;
+		radiance[1][i] = pixelRadiance.y;
+		radiance[2][i] = pixelRadiance.z;
+		normal[0][i] = guide.normal.x;
+		normal[1][i] = guide.normal.y;
+		normal[2][i] = guide.normal.z;
+		albedo[0][i] = guide.albedo.x;
+		albedo[1][i] = guide.albedo.y;
+		albedo[2][i] = guide.albedo.z;
+		depth[i] = guide.depth;
+		variance[i] = luminanceVariance;
+	}
+
+	Vector3 GetRadiance(uint32_t x, uint32_t y) const
+	{
+		const size_t i = size_t(y) * width + x;
+		return Vector3(radiance[0][i], radiance[1][i], radiance[2][i]);
+	}
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., 2010) for renders with few samples per pixel. Each pass
+// blurs with a 5x5 B3 spline kernel whose taps are 1, 2, 4, ... pixels apart, and weights every tap down by how much
+// its luminance, normal, depth and albedo differ from the centre pixel, so the blur stops at edges. As in SVGF
+// (Schied et al., 2017), the luminance tolerance follows the variance around each pixel, which is filtered along
+// with the colour: noise is smoothed away while clean shadow and texture edges stay. Pixels of one sample estimate their
+// variance from their 3x3 neighbourhood. What is filtered is the radiance divided by the albedo; multiplying the
+// albedo back afterwards keeps material boundaries sharp. The rows of a pass are spread over all threads and go
+// through the SIMD kernels.
+class Denoiser
+{
+public:
+	struct Options
+	{
+		uint32_t passes = 4;			// The last pass reaches 2^(passes + 1) pixels
+		float sigmaLuminance = 4.f;		// In standard deviations around the centre pixel
+		float sigmaNormal = 0.5f;		// Length of the difference of the unit normals
+		float sigmaDepth = 0.1f;		// Difference of the depths relative to the larger one
+		float sigmaAlbedo = 0.1f;
+	};
+
+	Denoiser() = default;
+	explicit Denoiser(const Options& options) : options(options) {}
+
+	// Replaces the radiance of buffers with the filtered one
+	void Denoise(FeatureBuffers& buffers) const
+	{
+		TraceScope trace("denoise", [&] { return std::to_string(buffers.width) + "x" + std::to_string(buffers.height); });
+		const size_t count = size_t(buffers.width) * buffers.height;
+		if (count == 0)
+			return;
+
+		std::array<std::vector<float>, 3> current, filtered;
+		for (size_t channel = 0; channel < 3; ++channel)
+		{
+			current[channel].resize(count);
+			filtered[channel].resize(count);
+			for (size_t i = 0; i < count; ++i)
+				current[channel][i] = buffers.radiance[channel][i] / std::max(buffers.albedo[channel][i], kMinAlbedo);
+		}
+		std::vector<float> variance = demodulatedVariance(buffers, current);
+		std::vector<float> filteredVariance(count);
+		std::vector<float> localVariance(count);
+
+		AtrousPass pass{};
+		for (size_t channel = 0; channel < 3; ++channel)
+		{
+			pass.normal[channel] = buffers.normal[channel].data();
+			pass.albedo[channel] = buffers.albedo[channel].data();
+		}
+		pass.depth = buffers.depth.data();
+		pass.width = buffers.width;
+		pass.height = buffers.height;
+		pass.luminanceSigma2 = options.sigmaLuminance * options.sigmaLuminance;
+		pass.normalWeight = 1.f / (options.sigmaNormal * options.sigmaNormal);
+		pass.depthWeight = 1.f / (options.sigmaDepth * options.sigmaDepth);
+		pass.albedoWeight = 1.f / (options.sigmaAlbedo * options.sigmaAlbedo);
+
+		const SimdKernels& kernels = ActiveSimdKernels();
+		for (uint32_t passIndex = 0; passIndex < options.passes; ++passIndex)
+		{
+			for (size_t channel = 0; channel < 3; ++channel)
+			{
+				pass.color[channel] = current[channel].data();
+				pass.filtered[channel] = filtered[channel].data();
+			}
+			pass.variance = variance.data();
+			pass.localVariance = localVariance.data();
+			pass.filteredVariance = filteredVariance.data();
+			pass.step = 1u << passIndex;
+			ParallelFor(buffers.height, 8, [&](size_t row)
+				{
+					blurRow(variance, localVariance, buffers.width, buffers.height, static_cast<uint32_t>(row));
+					kernels.atrousRow(pass, static_cast<uint32_t>(row));
+				});
+			std::swap(current, filtered);
+			std::swap(variance, filteredVariance);
+		}
+
+		for (size_t channel = 0; channel < 3; ++channel)
+		{
+			for (size_t i = 0; i < count; ++i)
+				buffers.radiance[channel][i] = current[channel][i] * std::max(buffers.albedo[channel][i], kMinAlbedo);
+		}
+	}
+
+private:
+	static constexpr float kMinAlbedo = 1e-3f;	// Black materials are divided by this instead
+
+	// One row of a 3x3 Gaussian blur of the variance, so a pixel whose few samples happened to agree does not
+	// stand out as clean among noisy neighbours
+	static void blurRow(const std::vector<float>& source, std::vector<float>& blurred, uint32_t width, uint32_t height, uint32_t row)
+	{
+		constexpr float kWeights[2] = { 0.5f, 0.25f };
+		for (uint32_t column = 0; column < width; ++column)
+		{
+			float sum = 0.f, weightSum = 0.f;
+			for (int32_t dy = -1; dy <= 1; ++dy)
+			{
+				const int64_t y = int64_t(row) + dy;
+				if (y < 0 || y >= height)
+					continue;
+				for (int32_t dx = -1; dx <= 1; ++dx)
+				{
+					const int64_t x = int64_t(column) + dx;
+					if (x < 0 || x >= width)
+						continue;
+					const float weight = kWeights[std::abs(dy)] * kWeights[std::abs(dx)];
+					sum += weight * source[size_t(y) * width + size_t(x)];
+					weightSum += weight;
+				}
+			}
+			blurred[size_t(row) * width + column] = sum / weightSum;
+		}
+	}
+
+	// Variance of the luminance of the demodulated colour of every pixel. Where the samples of a pixel did not give
+	// one, the variance of the luminance over the 3x3 pixels around it stands in.
+	std::vector<float> demodulatedVariance(const FeatureBuffers& buffers, const std::array<std::vector<float>, 3>& color) const
+	{
+		const uint32_t width = buffers.width, height = buffers.height;
+		auto luminance = [&](size_t i) { return simd_scalar::Luminance(color[0][i], color[1][i], color[2][i]); };
+
+		std::vector<float> variance(size_t(width) * height);
+		ParallelFor(height, 8, [&](size_t row)
+			{
+				for (uint32_t column = 0; column < width; ++column)
+				{
+					const size_t i = row * width + column;
+					if (buffers.variance[i] >= 0.f)
+					{
+						const float albedo = std::max(simd_scalar::Luminance(buffers.albedo[0][i], buffers.albedo[1][i], buffers.albedo[2][i]), kMinAlbedo);
+						variance[i] = buffers.variance[i] / (albedo * albedo);
+						continue;
+					}
+
+					float sum = 0.f, squaredSum = 0.f;
+					uint32_t count = 0;
+					for (size_t y = row > 0 ? row - 1 : 0; y <= std::min<size_t>(row + 1, height - 1); ++y)
+					{
+						for (uint32_t x = column > 0 ? column - 1 : 0; x <= std::min(column + 1, width - 1); ++x)
+						{
+							const float value = luminance(y * width + x);
+							sum += value;
+							squaredSum += value * value;
+							++count;
+						}
+					}
+					const float mean = sum / count;
+					variance[i] = std::max(squaredSum / count - mean * mean, 0.f);
+				}
+			});
+		return variance;
+	}
+
+	Options options;
+};
@@ -0,0 +1,598 @@
+#pragma once
+
+#include "CommandLine.hpp"
+#include "MappedFile.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "Socket.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tile farming between one coordinator and any number of worker processes over TCP. The coordinator listens, and
+// workers connect to it, from the same machine or others, at any time during a frame. A worker loads every scene
+// once, from its own copy of the file at the path the coordinator uses, and refuses the job when the content hash
+// differs. It then renders the tiles it is given with Renderer::RenderRegion(). A tile whose worker disconnects
+// or stays silent past the tile timeout goes back to the queue for the next free worker.
+//
+// The job carries the settings that change the pixels, so the workers render them like a local Renderer would. A
+// frame fails when no worker has been connected for the worker timeout.
+//
+// Every message is a MessageHeader and size bytes of payload, in the byte order of the machines, which must match:
+//   JOB       coordinator -> worker   JobMessage, then the scene file path
+//   READY     worker -> coordinator   uint32_t, 1 once the scene is loaded, 0 if it could not be
+//   TILE      coordinator -> worker   TileMessage
+//   PIXELS    worker -> coordinator   uint32_t tile id, then width * height RGB triplets row by row
+//   FINISHED  coordinator -> worker   no more jobs, the worker exits
+namespace render_protocol
+{
+	constexpr uint32_t kMagic = 0x44545243; // "CRTD"
+	constexpr uint32_t kMaxPayload = 1u << 28;
+
+	enum class MessageType : uint32_t
+	{
+		JOB = 1,
+		READY,
+		TILE,
+		PIXELS,
+		FINISHED,
+		REQUEST,	// Render server, see RenderServer
+		RESPONSE
+	};
+
+	struct MessageHeader
+	{
+		uint32_t magic;
+		MessageType type;
+		uint32_t size;
+	};
+
+	struct JobMessage
+	{
+		uint64_t sceneHash;
+		uint32_t width;
+		uint32_t height;
+		uint32_t samplesPerPixel;
+		BvhLayout bvhLayout;
+		uint32_t optimizeMeshes;
+		uint32_t padding;	// Zero, so the message has no indeterminate bytes
+	};
+
+	struct TileMessage
+	{
+		uint32_t id;
+		uint32_t column;
+		uint32_t row;
+		uint32_t width;
+		uint32_t height;
+	};
+
+	// Refuses payloads over kMaxPayload, which the other side would not read
+	inline bool WriteMessage(Socket& socket, MessageType type, const void* payload, size_t size, const void* extra = nullptr, size_t extraSize = 0)
+	{
+		if (size > kMaxPayload || extraSize > kMaxPayload - size)
+			return false;
+		const MessageHeader header{ kMagic, type, static_cast<uint32_t>(size + extraSize) };
+		return socket.Send(&header, sizeof(header)) && socket.Send(payload, size) && socket.Send(extra, extraSize);
+	}
+
+	inline bool ReadMessage(Socket& socket, MessageType& type, std::vector<char>& payload)
+	{
+		MessageHeader header;
+		if (!socket.Receive(&header, sizeof(header)) || header.magic != kMagic || header.size > kMaxPayload)
+		{
+			socket.Close();
+			return false;
+		}
+		type = header.type;
+		payload.resize(header.size);
+		return socket.Receive(payload.data(), payload.size());
+	}
+
+	inline uint64_t HashFile(const std::string& fileName)
+	{
+		const MappedFile file(fileName);
+		return file.IsOpen() ? HashBytes(file.Data(), file.Size()) : 0;
+	}
+}
+
+class RenderCoordinator
+{
+public:
+	struct Options
+	{
+		std::vector<std::string> sceneFiles;
+		uint16_t port = 5555;
+		uint32_t tileSize = 64;
+		uint32_t tileTimeoutSeconds = 120;	// Covers loading the scene too
+		uint32_t workerTimeoutSeconds = 60;	// How long a frame waits while no worker is connected before it fails
+		uint32_t samplesPerPixel = 1;
+		Scene::LoadOptions loadOptions;		// Only the mesh optimization and BVH layout reach the workers
+	};
+
+	// Command line: --coordinator [--port P] [--tile N] [--tile-timeout SECONDS] [--worker-timeout SECONDS] [--samples N]
+	//               [--bvh none|full|quantized] [--optimize-meshes] [scenes...]
+	static bool ParseArguments(const std::vector<std::string>& arguments, const std::vector<std::string>& defaultScenes, Options& options)
+	{
+		for (size_t i = 1; i < arguments.size(); ++i)
+		{
+			const std::string& argument = arguments[i];
+			const bool hasValue = i + 1 < arguments.size();
+			if (argument == "--port" && hasValue)
+			{
+				if (!ParseFlagNumber("--port", arguments[++i], "P", options.port))
+					return false;
+			}
+			else if (argument == "--tile" && hasValue)
+			{
+				if (!ParseFlagNumber("--tile", arguments[++i], "N", options.tileSize))
+					return false;
+				options.tileSize = std::max(1u, options.tileSize);
+			}
+			else if (argument == "--tile-timeout" && hasValue)
+			{
+				if (!ParseFlagNumber("--tile-timeout", arguments[++i], "SECONDS", options.tileTimeoutSeconds))
+					return false;
+				options.tileTimeoutSeconds = std::max(1u, options.tileTimeoutSeconds);
+			}
+			else if (argument == "--worker-timeout" && hasValue)
+			{
+				if (!ParseFlagNumber("--worker-timeout", arguments[++i], "SECONDS", options.workerTimeoutSeconds))
+					return false;
+			}
+			else if (argument == "--samples" && hasValue)
+			{
+				if (!ParseFlagNumber("--samples", arguments[++i], "N", options.samplesPerPixel))
+					return false;
+				options.samplesPerPixel = std::max(1u, options.samplesPerPixel);
+			}
+			else if (argument == "--bvh" && hasValue)
+			{
+				if (!ParseBvhLayout(arguments[++i], options.loadOptions.bvhLayout))
+				{
+					std::cout << "Usage: --bvh none|full|quantized\n";
+					return false;
+				}
+			}
+			else if (argument == "--optimize-meshes")
+				options.loadOptions.optimizeMeshes = true;
+			else if (argument.starts_with("--"))
+			{
+				std::cout << "Unknown coordinator option: " << argument << '\n';
+				return false;
+			}
+			else
+				options.sceneFiles.push_back(argument);
+		}
+		if (options.sceneFiles.empty())
+			options.sceneFiles = defaultScenes;
+		return true;
+	}
+
+	explicit RenderCoordinator(const Options& options) : options(options) {}
+
+	// Renders and writes every scene, then releases the workers. Returns the exit code.
+	int Run()
+	{
+		if (!Listen())
+			return 1;
+		std::cout << "Coordinator on port " << GetPort() << ", start workers with --worker <host>:" << GetPort() << '\n';
+
+		for (const auto& sceneFile : options.sceneFiles)
+		{
+			std::unique_ptr<Scene> loaded;
+			try
+			{
+				loaded = std::make_unique<Scene>(sceneFile, options.loadOptions);
+			}
+			catch (const SceneLoadError& error)
+			{
+				std::cout << sceneFile << ": " << error.what() << ", skipped\n";
+				continue;
+			}
+			Scene& scene = *loaded;
+			const auto start = std::chrono::steady_clock::now();
+			Image image(0, 0);
+			if (!RenderFrame(sceneFile, scene.settings.imageSettings, image))
+			{
+				ReleaseWorkers();
+				return 1;
+			}
+			const auto end = std::chrono::steady_clock::now();
+			std::cout << sceneFile << ": " << std::chrono::duration<double>(end - start).count() << " s, tiles per worker:";
+			for (const auto& worker : workers)
+				std::cout << ' ' << worker->number << ':' << worker->tilesRendered;
+			std::cout << '\n';
+			Renderer(scene).WriteToFile(image, scene.settings);
+		}
+
+		ReleaseWorkers();
+		return 0;
+	}
+
+	bool Listen()
+	{
+		listener = Socket::Listen(options.port);
+		if (!listener.IsOpen())
+			std::cout << "Failed to listen on port " << options.port << '\n';
+		return listener.IsOpen();
+	}
+
+	uint16_t GetPort() const { return listener.GetPort(); }
+
+	// Farms the tiles of one image of the scene at this size out to the workers, connected or yet to connect. Fails
+	// when no worker has been connected for the worker timeout.
+	bool RenderFrame(const std::string& sceneFile, const Scene::ImageSettings& imageSettings, Image& image)
+	{
+		Frame frame(sceneFile, imageSettings, options);
+		for (uint32_t row = 0; row < imageSettings.height; row += options.tileSize)
+		{
+			for (uint32_t column = 0; column < imageSettings.width; column += options.tileSize)
+			{
+				frame.pending.push_back(static_cast<uint32_t>(frame.tiles.size()));
+				frame.tiles.push_back({ column, row, std::min(options.tileSize, imageSettings.width - column), std::min(options.tileSize, imageSettings.height - row) });
+			}
+		}
+
+		std::vector<std::jthread> threads;
+		auto startWorker = [&](Worker& worker)
+			{
+				{
+					std::lock_guard lock(frame.mutex);
+					++frame.activeWorkers;
+				}
+				threads.emplace_back([&frame, &worker, this]()
+					{
+						serveWorker(worker, frame);
+						std::lock_guard lock(frame.mutex);
+						--frame.activeWorkers;
+					});
+			};
+		for (auto& worker : workers)
+			startWorker(*worker);
+
+		// New workers join the frame as they connect
+		auto idleSince = std::chrono::steady_clock::now();
+		bool failed = false;
+		for (bool announced = false;;)
+		{
+			bool idle = false;
+			{
+				std::lock_guard lock(frame.mutex);
+				if (frame.IsFinished())
+					break;
+				idle = frame.activeWorkers == 0;
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (!idle)
+			{
+				idleSince = now;
+				announced = false;
+			}
+			else if (now - idleSince >= std::chrono::seconds(options.workerTimeoutSeconds))
+			{
+				std::cout << "No worker for " << options.workerTimeoutSeconds << " s, " << sceneFile << " failed\n";
+				failed = true;
+				break;
+			}
+			else if (!announced)
+			{
+				std::cout << "Waiting for workers\n";
+				announced = true;
+			}
+
+			Socket connection = listener.Accept(200);
+			if (!connection.IsOpen())
+				continue;
+			workers.push_back(std::make_unique<Worker>(Worker{ std::move(connection), nextWorkerNumber++ }));
+			std::cout << "Worker " << workers.back()->number << " connected\n";
+			startWorker(*workers.back());
+		}
+
+		// Only reached while failing with no worker thread left, or once every tile is done
+		for (auto& thread : threads)
+			thread.join();
+		std::erase_if(workers, [](const std::unique_ptr<Worker>& worker) { return !worker->socket.IsOpen(); });
+		if (failed)
+			return false;
+		image = std::move(frame.image);
+		return true;
+	}
+
+	// Tells every worker there are no more jobs, so they exit
+	void ReleaseWorkers()
+	{
+		for (auto& worker : workers)
+			render_protocol::WriteMessage(worker->socket, render_protocol::MessageType::FINISHED, nullptr, 0);
+	}
+
+protected:
+	struct Worker
+	{
+		Socket socket;
+		uint32_t number;
+		uint32_t tilesRendered = 0;
+	};
+
+	struct Tile
+	{
+		uint32_t column, row, width, height;
+	};
+
+	// What the worker threads of one frame share
+	struct Frame
+	{
+		Frame(const std::string& sceneFile, const Scene::ImageSettings& imageSettings, const Options& options)
+			: job{ render_protocol::HashFile(sceneFile), imageSettings.width, imageSettings.height, options.samplesPerPixel,
+				options.loadOptions.bvhLayout, options.loadOptions.optimizeMeshes, 0 },
+			sceneFile(sceneFile), image(imageSettings.width, imageSettings.height)
+		{}
+
+		render_protocol::JobMessage job;
+		std::string sceneFile;
+		std::vector<Tile> tiles;
+		Image image;
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::deque<uint32_t> pending;
+		size_t finishedTiles = 0;
+		uint32_t activeWorkers = 0;		// Threads serving a worker
+
+		bool IsFinished() const { return finishedTiles == tiles.size(); }
+	};
+
+	// Hands tiles to one worker until the frame is finished or the worker is lost
+	void serveWorker(Worker& worker, Frame& frame)
+	{
+		using namespace render_protocol;
+		worker.tilesRendered = 0;
+		worker.socket.SetReceiveTimeout(options.tileTimeoutSeconds * 1000);
+
+		MessageType type;
+		std::vector<char> payload;
+		uint32_t ready = 0;
+		if (!WriteMessage(worker.socket, MessageType::JOB, &frame.job, sizeof(frame.job), frame.sceneFile.data(), frame.sceneFile.size())
+			|| !ReadMessage(worker.socket, type, payload) || type != MessageType::READY || payload.size() != sizeof(ready)
+			|| (std::memcpy(&ready, payload.data(), sizeof(ready)), ready == 0))
+		{
+			std::cout << "Worker " << worker.number << " could not load " << frame.sceneFile << '\n';
+			worker.socket.Close();
+			return;
+		}
+
+		for (;;)
+		{
+			uint32_t id;
+			{
+				std::unique_lock lock(frame.mutex);
+				frame.changed.wait(lock, [&] { return !frame.pending.empty() || frame.IsFinished(); });
+				if (frame.IsFinished())
+					return;
+				id = frame.pending.front();
+				frame.pending.pop_front();
+			}
+
+			const Tile& tile = frame.tiles[id];
+			const TileMessage request{ id, tile.column, tile.row, tile.width, tile.height };
+			const size_t pixelBytes = size_t(tile.width) * tile.height * 3;
+			uint32_t resultId = 0;
+			if (!WriteMessage(worker.socket, MessageType::TILE, &request, sizeof(request)) || !ReadMessage(worker.socket, type, payload)
+				|| type != MessageType::PIXELS || payload.size() != sizeof(uint32_t) + pixelBytes
+				|| (std::memcpy(&resultId, payload.data(), sizeof(resultId)), resultId != id))
+			{
+				std::cout << "Worker " << worker.number << " lost, tile " << id << " re-issued\n";
+				worker.socket.Close();
+				std::lock_guard lock(frame.mutex);
+				frame.pending.push_front(id);
+				frame.changed.notify_all();
+				return;
+			}
+
+			// Tiles never overlap, so no lock is needed for the pixels
+			const char* pixels = payload.data() + sizeof(uint32_t);
+			for (uint32_t row = 0; row < tile.height; ++row)
+			{
+				for (uint32_t column = 0; column < tile.width; ++column, pixels += 3)
+					frame.image.SetPixel(tile.column + column, tile.row + row, { static_cast<uint8_t>(pixels[0]), static_cast<uint8_t>(pixels[1]), static_cast<uint8_t>(pixels[2]) });
+			}
+			++worker.tilesRendered;
+
+			std::lock_guard lock(frame.mutex);
+			++frame.finishedTiles;
+			frame.changed.notify_all();
+		}
+	}
+
+	Options options;
+	Socket listener;
+	std::vector<std::unique_ptr<Worker>> workers;
+	uint32_t nextWorkerNumber = 1;
+};
+
+class RenderWorker
+{
+public:
+	// address is <host>:<port> of the coordinator. Returns the exit code.
+	static int Run(const std::string& address)
+	{
+		using namespace render_protocol;
+		const size_t colon = address.rfind(':');
+		const std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+		uint16_t port = 0;
+		if (!ParseFlagNumber("--worker", colon == std::string::npos ? address : address.substr(colon + 1), "<host>:<port>", port))
+			return 1;
+
+		// The coordinator may still be starting
+		Socket socket;
+		for (uint32_t attempt = 0; attempt < 100 && !socket.IsOpen(); ++attempt)
+		{
+			socket = Socket::Connect(host, port);
+			if (!socket.IsOpen())
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		if (!socket.IsOpen())
+		{
+			std::cout << "Failed to connect to " << host << ':' << port << '\n';
+			return 1;
+		}
+		std::cout << "Connected to " << host << ':' << port << '\n';
+
+		std::string sceneFile;
+		uint64_t sceneHash = 0;
+		Scene::LoadOptions loadOptions;		// Of the scene loaded
+		std::unique_ptr<Scene> scene;
+		std::unique_ptr<Renderer> renderer;
+		MessageType type;
+		std::vector<char> payload;
+		std::vector<char> result;
+		while (ReadMessage(socket, type, payload))
+		{
+			if (type == MessageType::FINISHED)
+				return 0;
+
+			if (type == MessageType::JOB && payload.size() >= sizeof(JobMessage))
+			{
+				JobMessage job;
+				std::memcpy(&job, payload.data(), sizeof(job));
+				const std::string jobSceneFile(payload.begin() + sizeof(job), payload.end());
+				uint32_t ready = 1;
+				if (jobSceneFile != sceneFile || job.sceneHash != sceneHash || !scene || job.bvhLayout != loadOptions.bvhLayout
+					|| job.optimizeMeshes != static_cast<uint32_t>(loadOptions.optimizeMeshes)
+					|| scene->settings.imageSettings.width != job.width || scene->settings.imageSettings.height != job.height)
+				{
+					renderer.reset();
+					scene.reset();
+					sceneFile.clear();
+					if (job.bvhLayout != BvhLayout::NONE && job.bvhLayout != BvhLayout::FULL && job.bvhLayout != BvhLayout::QUANTIZED)
+					{
+						std::cout << "Invalid job\n";
+						ready = 0;
+					}
+					else if (HashFile(jobSceneFile) != job.sceneHash)
+					{
+						std::cout << jobSceneFile << " is missing or differs from the coordinator's\n";
+						ready = 0;
+					}
+					else
+					{
+						try
+						{
+							loadOptions.bvhLayout = job.bvhLayout;
+							loadOptions.optimizeMeshes = job.optimizeMeshes != 0;
+							scene = std::make_unique<Scene>(jobSceneFile, loadOptions);
+							scene->settings.imageSettings = { job.width, job.height };
+							renderer = std::make_unique<Renderer>(*scene);
+							sceneFile = jobSceneFile;
+							sceneHash = job.sceneHash;
+							std::cout << "Loaded " << sceneFile << '\n';
+						}
+						catch (const SceneLoadError& error)
+						{
+							std::cout << jobSceneFile << ": " << error.what() << '\n';
+							ready = 0;
+						}
+					}
+				}
+				if (renderer)
+					renderer->SetSamplesPerPixel(job.samplesPerPixel);
+				if (!WriteMessage(socket, MessageType::READY, &ready, sizeof(ready)))
+					break;
+			}
+			else if (type == MessageType::TILE && payload.size() == sizeof(TileMessage) && renderer)
+			{
+				TileMessage tile;
+				std::memcpy(&tile, payload.data(), sizeof(tile));
+				const Scene::ImageSettings& imageSettings = scene->settings.imageSettings;
+				if (tile.width == 0 || tile.height == 0 || tile.column >= imageSettings.width || tile.row >= imageSettings.height
+					|| tile.width > imageSettings.width - tile.column || tile.height > imageSettings.height - tile.row)
+					break;
+
+				const Image image = renderer->RenderRegion(tile.column, tile.row, tile.width, tile.height);
+				result.resize(size_t(tile.width) * tile.height * 3);
+				char* pixels = result.data();
+				for (uint32_t row = 0; row < tile.height; ++row)
+				{
+					for (uint32_t column = 0; column < tile.width; ++column, pixels += 3)
+					{
+						const RGB& color = image.GetPixel(column, row);
+						pixels[0] = static_cast<char>(color.r);
+						pixels[1] = static_cast<char>(color.g);
+						pixels[2] = static_cast<char>(color.b);
+					}
+				}
+				if (!WriteMessage(socket, MessageType::PIXELS, &tile.id, sizeof(tile.id), result.data(), result.size()))
+					break;
+			}
+			else
+				break;
+		}
+
+		std::cout << "Connection to the coordinator lost\n";
+		return 1;
+	}
+};
+
+// Localhost check of the whole protocol: a coordinator in this process renders the scenes at a quarter of their
+// resolution on workerCount worker threads, connected over the loopback interface as separate processes would be,
+// in tiles small enough for every worker to get some, with two samples a pixel and the quantized BVH, which the
+// workers must take from the job. Each image must match a local Renderer::Render() with those settings exactly.
+// Returns the exit code.
+inline int RunDistributedTest(const std::vector<std::string>& sceneFiles, uint32_t workerCount)
+{
+	RenderCoordinator::Options options;
+	options.port = 0;
+	options.tileSize = 16;
+	options.workerTimeoutSeconds = 10;
+	options.samplesPerPixel = 2;
+	options.loadOptions.bvhLayout = BvhLayout::QUANTIZED;
+	RenderCoordinator coordinator(options);
+	if (!coordinator.Listen())
+		return 1;
+
+	const std::string address = "127.0.0.1:" + std::to_string(coordinator.GetPort());
+	std::vector<std::jthread> workers;
+	for (uint32_t i = 0; i < workerCount; ++i)
+		workers.emplace_back([address]() { RenderWorker::Run(address); });
+
+	uint32_t failures = 0;
+	for (const auto& sceneFile : sceneFiles)
+	{
+		Scene scene(sceneFile, options.loadOptions);
+		scene.settings.imageSettings.width = std::max(1u, scene.settings.imageSettings.width / 4);
+		scene.settings.imageSettings.height = std::max(1u, scene.settings.imageSettings.height / 4);
+		Image image(0, 0);
+		if (!coordinator.RenderFrame(sceneFile, scene.settings.imageSettings, image))
+		{
+			++failures;
+			continue;
+		}
+		Renderer renderer(scene);
+		renderer.SetSamplesPerPixel(options.samplesPerPixel);
+		const Image expected = renderer.Render();
+
+		size_t differentPixels = 0;
+		for (uint32_t row = 0; row < expected.GetHeight(); ++row)
+		{
+			for (uint32_t column = 0; column < expected.GetWidth(); ++column)
+			{
+				const RGB& a = image.GetPixel(column, row);
+				const RGB& b = expected.GetPixel(column, row);
+				differentPixels += a.r != b.r || a.g != b.g || a.b != b.b;
+			}
+		}
+		std::cout << sceneFile << ": " << differentPixels << " pixel(s) differ from the local render" << (differentPixels == 0 ? "" : "   FAILED") << '\n';
+		failures += differentPixels != 0;
+	}
+
+	coordinator.ReleaseWorkers();
+	workers.clear();
+	std::cout << failures << " of " << sceneFiles.size() << " scene(s) failed\n";
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "MappedFile.hpp"
+#include "Math3D.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+
+// One mesh of the scene, as a range of the GeometryArena. Triangles of all meshes are numbered consecutively, so
+// a single 32-bit triangle ID identifies a triangle of the scene. Indices are relative to firstVertex.
+struct Mesh
+{
+	static constexpr uint32_t kNoNormals = std::numeric_limits<uint32_t>::max();
+
+	uint64_t firstIndex = 0;			// Into the 16-bit index array, or the 32-bit one if wideIndices is set
+	uint32_t firstTriangle = 0;
+	uint32_t triangleCount = 0;
+	uint32_t firstVertex = 0;
+	uint32_t vertexCount = 0;
+	uint32_t firstNormal = kNoNormals;	// One normal per vertex; kNoNormals for flat shaded meshes
+	uint32_t wideIndices = 0;
+	uint32_t materialIndex = 0;
+
+	bool HasNormals() const { return firstNormal != kNoNormals; }
+};
+
+// Geometry of every mesh of a scene in one 64-byte aligned allocation. Positions, octahedral encoded vertex
+// normals, 32-bit and 16-bit indices each form one contiguous array, starting on a cache line boundary.
+// Meshes with at most 65536 vertices use 16-bit indices. The arena owns its memory, or is a view of an arena saved as
+// is into a file mapping, which it then keeps open.
+class GeometryArena
+{
+public:
+	static constexpr size_t kAlignment = 64;
+	static constexpr uint32_t kMaxNarrowVertices = std::numeric_limits<uint16_t>::max() + 1u;
+
+	struct Counts
+	{
+		uint64_t vertexCount = 0;
+		uint64_t normalCount = 0;
+		uint64_t index32Count = 0;
+		uint64_t index16Count = 0;
+	};
+
+	GeometryArena() = default;
+
+	explicit GeometryArena(const Counts& counts)
+	{
+		setLayout(counts);
+		if (size == 0)
+			return;
+
+		memory.reset(static_cast<std::byte*>(::operator new[](size, std::align_val_t{ kAlignment })));
+		data = memory.get();
+		// Only the padding is cleared here, the arrays are filled by the owner. Keeps cache files deterministic.
+		const size_t positionsEnd = counts.vertexCount * sizeof(Vector3);
+		const size_t normalsEnd = normalsOffset + counts.normalCount * sizeof(uint32_t);
+		const size_t indices32End = indices32Offset + counts.index32Count * sizeof(uint32_t);
+		const size_t indices16End = indices16Offset + counts.index16Count * sizeof(uint16_t);
+		std::fill(data + positionsEnd, data + normalsOffset, std::byte{ 0 });
+		std::fill(data + normalsEnd, data + indices32Offset, std::byte{ 0 });
+		std::fill(data + indices32End, data + indices16Offset, std::byte{ 0 });
+		std::fill(data + indices16End, data + size, std::byte{ 0 });
+	}
+
+	// The arena saved at offset of the file, which must be mapped COPY_ON_WRITE: in-place changes, like the BVH
+	// reordering the indices, copy only the pages they touch and never reach the file
+	GeometryArena(const Counts& counts, MappedFile&& file, size_t offset)
+		: mapping(std::move(file))
+	{
+		setLayout(counts);
+		data = reinterpret_cast<std::byte*>(mapping.MutableData()) + offset;
+	}
+
+	// Bytes an arena with these counts takes
+	static size_t SizeFor(const Counts& counts)
+	{
+		GeometryArena arena;
+		arena.setLayout(counts);
+		return arena.size;
+	}
+
+	const Counts& GetCounts() const { return counts; }
+	size_t Size() const { return size; }
+	std::byte* Data() { return data; }
+	const std::byte* Data() const { return data; }
+
+	Vector3* Positions() { return reinterpret_cast<Vector3*>(data); }
+	uint32_t* Normals() { return reinterpret_cast<uint32_t*>(data + normalsOffset); }
+	uint32_t* Indices32() { return reinterpret_cast<uint32_t*>(data + indices32Offset); }
+	uint16_t* Indices16() { return reinterpret_cast<uint16_t*>(data + indices16Offset); }
+
+	const Vector3* Positions(const Mesh& mesh) const
+	{
+		return reinterpret_cast<const Vector3*>(data) + mesh.firstVertex;
+	}
+
+	template <typename Index>
+	const Index* Indices(const Mesh& mesh) const
+	{
+		const size_t offset = sizeof(Index) == sizeof(uint16_t) ? indices16Offset : indices32Offset;
+		return reinterpret_cast<const Index*>(data + offset) + mesh.firstIndex;
+	}
+
+	uint32_t Index(const Mesh& mesh, size_t i) const
+	{
+		return mesh.wideIndices ? Indices<uint32_t>(mesh)[i] : Indices<uint16_t>(mesh)[i];
+	}
+
+	Vector3 GetFaceNormal(const Mesh& mesh, uint32_t triangleIndex) const
+	{
+		const Vector3* positions = Positions(mesh);
+		const Vector3& a = positions[Index(mesh, 3 * triangleIndex)];
+		const Vector3& b = positions[Index(mesh, 3 * triangleIndex + 1)];
+		const Vector3& c = positions[Index(mesh, 3 * triangleIndex + 2)];
+		return Normalize(Cross(b - a, c - a));
+	}
+
+	// Interpolated vertex normal, only valid for meshes with normals
+	Vector3 GetNormal(const Mesh& mesh, uint32_t triangleIndex, float u, float v) const
+	{
+		const uint32_t* normals = reinterpret_cast<const uint32_t*>(data + normalsOffset) + mesh.firstNormal;
+		float w = 1.f - u - v;
+		const Vector3 n0 = DecodeOctahedral(normals[Index(mesh, 3 * triangleIndex)]);
+		const Vector3 n1 = DecodeOctahedral(normals[Index(mesh, 3 * triangleIndex + 1)]);
+		const Vector3 n2 = DecodeOctahedral(normals[Index(mesh, 3 * triangleIndex + 2)]);
+		return Normalize(n0 * u + n1 * v + n2 * w);
+	}
+
+private:
+	struct AlignedDelete
+	{
+		void operator()(std::byte* p) const { ::operator delete[](p, std::align_val_t{ kAlignment }); }
+	};
+
+	static size_t align(size_t offset) { return (offset + kAlignment - 1) & ~(kAlignment - 1); }
+
+	void setLayout(const Counts& newCounts)
+	{
+		counts = newCounts;
+		normalsOffset = align(counts.vertexCount * sizeof(Vector3));
+		indices32Offset = align(normalsOffset + counts.normalCount * sizeof(uint32_t));
+		indices16Offset = align(indices32Offset + counts.index32Count * sizeof(uint32_t));
+		size = align(indices16Offset + counts.index16Count * sizeof(uint16_t));
+	}
+
+	Counts counts;
+	size_t normalsOffset = 0;
+	size_t indices32Offset = 0;
+	size_t indices16Offset = 0;
+	size_t size = 0;
+	std::unique_ptr<std::byte[], AlignedDelete> memory;
+	MappedFile mapping;
+	std::byte* data = nullptr;		// Into memory or mapping
+};
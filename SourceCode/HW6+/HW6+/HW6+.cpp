@@ -1,24 +1,325 @@
 #include "Renderer.hpp"
+#include "Benchmark.hpp"
+#include "BenchmarkSuite.hpp"
+#include "CommandLine.hpp"
+#include "DistributedRender.hpp"
+#include "RegressionSuite.hpp"
+#include "RenderServer.hpp"
 
-int main()
+// The scale of the image resolution at index of a benchmark's arguments, if given: a number above 0
+static bool ParseScaleArgument(const std::vector<std::string>& arguments, size_t index, const char* usage, float& scale)
 {
-	std::vector<Scene> scenes{
-		Scene{ "scene0.crtscene" },
-		Scene{ "scene1.crtscene" },
-		Scene{ "scene2.crtscene" },
-		Scene{ "scene3.crtscene" },
-		Scene{ "scene4.crtscene" },
-		Scene{ "scene5.crtscene" },
-		Scene{ "scene6.crtscene" },
-		Scene{ "scene7.crtscene" },
-		Scene{ "scene8.crtscene" },
+	if (!ParseArgumentNumber(arguments, index, usage, scale))
+		return false;
+	if (scale > 0.f)
+		return true;
+	std::cout << "Usage: " << arguments[0] << ' ' << usage << '\n';
+	return false;
+}
+
+int main(int argc, char* argv[])
+{
+	const std::vector<std::string> arguments(argv + 1, argv + argc);
+
+	const std::vector<std::string> sceneFiles{
+		"scene0.crtscene",
+		"scene1.crtscene",
+		"scene2.crtscene",
+		"scene3.crtscene",
+		"scene4.crtscene",
+		"scene5.crtscene",
+		"scene6.crtscene",
+		"scene7.crtscene",
+		"scene8.crtscene",
 	};
 
+	if (!arguments.empty() && arguments[0] == "--benchmark")
+	{
+		BenchmarkSuite::Options options;
+		if (!BenchmarkSuite::ParseArguments(arguments, sceneFiles, options))
+			return 1;
+		return BenchmarkSuite(options).Run();
+	}
+
+	if (!arguments.empty() && arguments[0] == "--regression")
+	{
+		RegressionSuite::Options options;
+		if (!RegressionSuite::ParseArguments(arguments, sceneFiles, options))
+			return 1;
+		return RegressionSuite(options).Run();
+	}
+
+	if (!arguments.empty() && arguments[0] == "--parse-benchmark")
+	{
+		const bool useBundledScenes = arguments.size() == 1;
+		RunParseBenchmark(useBundledScenes ? sceneFiles : std::vector<std::string>(arguments.begin() + 1, arguments.end()), 20);
+		return 0;
+	}
+
+	if (!arguments.empty() && arguments[0] == "--traversal-benchmark")
+	{
+		RunTraversalBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", 192, 108, 5);
+		return 0;
+	}
+
+	if (!arguments.empty() && arguments[0] == "--simd-benchmark")
+	{
+		RunSimdBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", 5);
+		return 0;
+	}
+
+	if (!arguments.empty() && arguments[0] == "--camera-benchmark")
+	{
+		RunCameraBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", 5);
+		return 0;
+	}
+
+	if (!arguments.empty() && arguments[0] == "--coordinator")
+	{
+		RenderCoordinator::Options options;
+		if (!RenderCoordinator::ParseArguments(arguments, sceneFiles, options))
+			return 1;
+		return RenderCoordinator(options).Run();
+	}
+
+	// --distributed-test [--workers N] [scenes...] renders through a coordinator and N local workers, 3 by default
+	if (!arguments.empty() && arguments[0] == "--distributed-test")
+	{
+		const bool hasWorkers = arguments.size() > 2 && arguments[1] == "--workers";
+		const size_t first = hasWorkers ? 3 : 1;
+		uint32_t workerCount = 3;
+		if (hasWorkers && !ParseFlagNumber("--workers", arguments[2], "N", workerCount))
+			return 1;
+		return RunDistributedTest(arguments.size() > first ? std::vector<std::string>(arguments.begin() + first, arguments.end()) : sceneFiles,
+			std::max(1u, workerCount));
+	}
+
+	// --worker <host>:<port> of a coordinator
+	if (!arguments.empty() && arguments[0] == "--worker")
+		return RenderWorker::Run(arguments.size() > 1 ? arguments[1] : "127.0.0.1:5555");
+
+	if (!arguments.empty() && arguments[0] == "--server")
+	{
+		RenderServer::Options options;
+		if (!RenderServer::ParseArguments(arguments, options))
+			return 1;
+		return RenderServer(options).Run();
+	}
+
+	// --request [--socket PATH] <JSON request> [image.ppm] sends one request to a running --server
+	if (!arguments.empty() && arguments[0] == "--request")
+	{
+		const bool hasSocket = arguments.size() > 2 && arguments[1] == "--socket";
+		const size_t first = hasSocket ? 3 : 1;
+		if (arguments.size() <= first)
+			return 1;
+		std::string status, image;
+		if (!SendRenderRequest(hasSocket ? arguments[2] : RenderServer::Options{}.socketPath, arguments[first], status, image))
+		{
+			std::cout << "No render server\n";
+			return 1;
+		}
+		std::cout << status << '\n';
+		if (arguments.size() > first + 1 && !image.empty())
+			std::ofstream(arguments[first + 1], std::ios::out | std::ios::binary) << image;
+		return status.find("\"ok\":true") != std::string::npos ? 0 : 1;
+	}
+
+	// --scaling-benchmark [scene] [scale] [max threads]
+	if (!arguments.empty() && arguments[0] == "--scaling-benchmark")
+	{
+		const char* usage = "[scene] [scale] [max threads]";
+		float scale = 0.25f;
+		uint32_t maxThreads = 0;
+		if (!ParseScaleArgument(arguments, 2, usage, scale) || !ParseArgumentNumber(arguments, 3, usage, maxThreads))
+			return 1;
+		RunScalingBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", scale, maxThreads, 3);
+		return 0;
+	}
+
+	// --framebuffer-benchmark [width] [height] [max threads]
+	if (!arguments.empty() && arguments[0] == "--framebuffer-benchmark")
+	{
+		const char* usage = "[width] [height] [max threads]";
+		uint32_t width = 1920, height = 1080, maxThreads = 0;
+		if (!ParseArgumentNumber(arguments, 1, usage, width) || !ParseArgumentNumber(arguments, 2, usage, height)
+			|| !ParseArgumentNumber(arguments, 3, usage, maxThreads))
+			return 1;
+		if (width == 0 || height == 0)
+		{
+			std::cout << "Usage: --framebuffer-benchmark " << usage << '\n';
+			return 1;
+		}
+		RunFramebufferBenchmark(width, height, maxThreads, 5);
+		return 0;
+	}
+
+	// --bvh-benchmark [scene] [scale]
+	if (!arguments.empty() && arguments[0] == "--bvh-benchmark")
+	{
+		float scale = 0.1f;
+		if (!ParseScaleArgument(arguments, 2, "[scene] [scale]", scale))
+			return 1;
+		RunBvhBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", scale, 3);
+		return 0;
+	}
+
+	// --shadow-benchmark [scene] [scale]
+	if (!arguments.empty() && arguments[0] == "--shadow-benchmark")
+	{
+		float scale = 0.25f;
+		if (!ParseScaleArgument(arguments, 2, "[scene] [scale]", scale))
+			return 1;
+		RunShadowBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", scale, 3);
+		return 0;
+	}
+
+	// --shadow-map-benchmark [scene] [scale]
+	if (!arguments.empty() && arguments[0] == "--shadow-map-benchmark")
+	{
+		float scale = 0.25f;
+		if (!ParseScaleArgument(arguments, 2, "[scene] [scale]", scale))
+			return 1;
+		RunShadowMapBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", scale, 3);
+		return 0;
+	}
+
+	// --denoise-benchmark [scene] [scale] [samples] [reference samples] [aperture radius]
+	if (!arguments.empty() && arguments[0] == "--denoise-benchmark")
+	{
+		const char* usage = "[scene] [scale] [samples] [reference samples] [aperture radius]";
+		float scale = 0.25f, apertureRadius = 0.f;
+		uint32_t samples = 1, referenceSamples = 64;
+		if (!ParseScaleArgument(arguments, 2, usage, scale) || !ParseArgumentNumber(arguments, 3, usage, samples)
+			|| !ParseArgumentNumber(arguments, 4, usage, referenceSamples) || !ParseArgumentNumber(arguments, 5, usage, apertureRadius))
+			return 1;
+		RunDenoiseBenchmark(arguments.size() > 1 ? arguments[1] : "scene8.crtscene", scale, samples, referenceSamples, apertureRadius);
+		return 0;
+	}
+
+	Scene::LoadOptions loadOptions;
+	loadOptions.optimizeMeshes = std::find(arguments.begin(), arguments.end(), "--optimize-meshes") != arguments.end();
+
+	// --bvh none|full|quantized picks the acceleration structure, full by default
+	bool hasBvh = false;
+	const std::string bvhValue = FlagValue(arguments, "--bvh", hasBvh);
+	if (hasBvh && !ParseBvhLayout(bvhValue, loadOptions.bvhLayout))
+	{
+		std::cout << "Usage: --bvh none|full|quantized\n";
+		return 1;
+	}
+
+	// --heatmap [rays|steps|triangles|time] also writes the cost of every pixel, triangle tests by default
+	Renderer::HeatmapMetric heatmapMetric = Renderer::HeatmapMetric::NONE;
+	bool hasHeatmap = false;
+	const std::string heatmapValue = FlagValue(arguments, "--heatmap", hasHeatmap);
+	if (hasHeatmap)
+	{
+		heatmapMetric = Renderer::HeatmapMetric::TRIANGLE_TESTS;
+		if (!heatmapValue.empty())
+		{
+			heatmapMetric = Renderer::HeatmapMetric::NONE;
+			for (auto metric : { Renderer::HeatmapMetric::RAYS, Renderer::HeatmapMetric::TRAVERSAL_STEPS, Renderer::HeatmapMetric::TRIANGLE_TESTS, Renderer::HeatmapMetric::TIME })
+			{
+				if (heatmapValue == Renderer::HeatmapMetricName(metric))
+					heatmapMetric = metric;
+			}
+			if (heatmapMetric == Renderer::HeatmapMetric::NONE)
+			{
+				std::cout << "Usage: --heatmap [rays|steps|triangles|time]\n";
+				return 1;
+			}
+		}
+	}
+
+	// --samples N averages N primary rays per pixel, --denoise filters the image before it is written
+	bool hasSamples = false;
+	const std::string samplesValue = FlagValue(arguments, "--samples", hasSamples);
+	uint32_t samplesPerPixel = 1;
+	if (hasSamples && !ParseFlagNumber("--samples", samplesValue, "N", samplesPerPixel))
+		return 1;
+	const bool denoise = std::find(arguments.begin(), arguments.end(), "--denoise") != arguments.end();
+
+	// --shadow-maps N renders preview shadows from depth cube maps of N x N texels a face instead of shadow rays
+	bool hasShadowMaps = false;
+	const std::string shadowMapsValue = FlagValue(arguments, "--shadow-maps", hasShadowMaps);
+	uint32_t shadowMapResolution = hasShadowMaps ? 512 : 0;
+	if (!shadowMapsValue.empty() && !ParseFlagNumber("--shadow-maps", shadowMapsValue, "[N]", shadowMapResolution))
+		return 1;
+	if (shadowMapResolution > ShadowCubeMaps::kMaxResolution)
+	{
+		std::cout << "--shadow-maps takes at most " << ShadowCubeMaps::kMaxResolution << " texels a side\n";
+		return 1;
+	}
+
+	// --deadline MS gives every scene MS milliseconds and writes what got rendered in time; a --heatmap then shows
+	// the tiles finished at full resolution
+	bool hasDeadline = false;
+	const std::string deadlineValue = FlagValue(arguments, "--deadline", hasDeadline);
+	uint32_t deadlineMs = 0;
+	if (hasDeadline && !ParseFlagNumber("--deadline", deadlineValue, "MS", deadlineMs))
+		return 1;
+
+	// --trace file.json records scene loading, rendering and image writing as Chrome trace events
+	bool hasTrace = false;
+	std::string traceFileName = FlagValue(arguments, "--trace", hasTrace);
+	if (hasTrace)
+	{
+		if (traceFileName.empty())
+			traceFileName = "trace.json";
+		Tracer::Instance().Enable();
+		Tracer::Instance().SetThreadName("main");
+	}
+
+	// Constructed in place, an initializer list would copy every scene
+	std::vector<Scene> scenes;
+	scenes.reserve(sceneFiles.size());
+	for (const auto& sceneFile : sceneFiles)
+	{
+		try
+		{
+			scenes.emplace_back(sceneFile, loadOptions);
+		}
+		catch (const SceneLoadError& error)
+		{
+			std::cout << sceneFile << ": " << error.what() << '\n';
+			return 1;
+		}
+	}
+
 	for (auto& scene : scenes)
 	{
 		Renderer renderer(scene);
-		renderer.RenderImage();
+		renderer.SetHeatmapMetric(heatmapMetric);
+		renderer.SetSamplesPerPixel(samplesPerPixel);
+		renderer.SetDenoiser(denoise);
+		renderer.SetShadowMapResolution(shadowMapResolution);
+		if (!deadlineMs)
+		{
+			renderer.RenderImage();
+			continue;
+		}
+
+		Renderer::Job job;
+		job.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs);
+		job.onProgress = [&](const Renderer::Progress& progress)
+			{
+				std::cout << "\r" << scene.settings.sceneName << ": " << progress.tilesDone << "/" << progress.tileCount << " tiles, "
+					<< static_cast<int>(progress.remainingSeconds * 1000.0) << " ms left   " << std::flush;
+			};
+		const Renderer::JobResult result = renderer.Render(job);
+		std::cout << "\r" << scene.settings.sceneName << ": " << Renderer::StatusName(result.coverage.status) << " after " << static_cast<int>(result.coverage.seconds * 1000.0)
+			<< " ms, " << static_cast<int>(result.coverage.fullFraction * 100.0) << "% at full resolution, " << static_cast<int>(result.coverage.previewFraction * 100.0)
+			<< "% preview only            \n";
+		renderer.WriteToFile(result.image, renderer.GetView().settings);
+		if (result.coverage.tilesDone > 0)
+			renderer.WriteHeatmap();
+		else if (heatmapMetric != Renderer::HeatmapMetric::NONE)
+			std::cout << "  no tile got traced at full resolution, no heatmap\n";
 	}
 
+	if (!traceFileName.empty())
+		Tracer::Instance().Write(traceFileName);
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Memory mapping of a whole file. COPY_ON_WRITE gives a private, writable view: writes never reach the file,
+// and only the pages actually written get copied.
+class MappedFile
+{
+public:
+	enum Access
+	{
+		READ_ONLY,
+		COPY_ON_WRITE
+	};
+
+	MappedFile() = default;
+
+	explicit MappedFile(const std::string& fileName, Access access = Access::READ_ONLY)
+	{
+		const bool writable = access == Access::COPY_ON_WRITE;
+#ifdef _WIN32
+		fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (fileHandle == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+			return;
+
+		mappingHandle = CreateFileMappingA(fileHandle, nullptr, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+		if (mappingHandle == nullptr)
+			return;
+
+		void* view = MapViewOfFile(mappingHandle, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+		if (view == nullptr)
+			return;
+
+		data = static_cast<char*>(view);
+		size = static_cast<size_t>(fileSize.QuadPart);
+#else
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+		{
+			const int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+			void* view = mmap(nullptr, static_cast<size_t>(fileStat.st_size), protection, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED)
+			{
+				data = static_cast<char*>(view);
+				size = static_cast<size_t>(fileStat.st_size);
+			}
+		}
+		close(fd);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator =(const MappedFile&) = delete;
+
+	MappedFile(MappedFile&& other) noexcept
+	{
+		swap(other);
+	}
+
+	MappedFile& operator =(MappedFile&& other) noexcept
+	{
+		MappedFile(std::move(other)).swap(*this);
+		return (*this);
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (data != nullptr)
+			UnmapViewOfFile(data);
+		if (mappingHandle != nullptr)
+			CloseHandle(mappingHandle);
+		if (fileHandle != INVALID_HANDLE_VALUE)
+			CloseHandle(fileHandle);
+#else
+		if (data != nullptr)
+			munmap(data, size);
+#endif
+	}
+
+	bool IsOpen() const { return data != nullptr; }
+	const char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+	// Only valid for COPY_ON_WRITE mappings
+	char* MutableData() { return data; }
+
+	static size_t PageSize()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		return systemInfo.dwPageSize;
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	void swap(MappedFile& other) noexcept
+	{
+		std::swap(data, other.data);
+		std::swap(size, other.size);
+#ifdef _WIN32
+		std::swap(fileHandle, other.fileHandle);
+		std::swap(mappingHandle, other.mappingHandle);
+#endif
+	}
+
+private:
+	char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = nullptr;
+#endif
+};
+
+// 64-bit content hash (FNV-1a style, eight bytes per step). Used to detect stale caches, not for security.
+inline uint64_t HashBytes(const char* bytes, size_t size)
+{
+	constexpr uint64_t kPrime = 0x100000001b3ull;
+	uint64_t hash = 0xcbf29ce484222325ull ^ size;
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * kPrime;
+		hash ^= hash >> 32;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ static_cast<uint8_t>(bytes[i])) * kPrime;
+
+	return hash;
+}
@@ -1,10 +1,14 @@
 #pragma once
 
+#include "Simd.hpp"
+
 #include <cstdint>
 #include <numbers>
 #include <string>
 #include <cmath>
 #include <algorithm>
+#include <limits>
+#include <vector>
 
 constexpr float DegToRad(float degrees)
 {
@@ -200,99 +204,165 @@ struct Ray
 	}
 };
 
+// The far distance of a box is widened by this much, so rounding in the slab test never drops a triangle that
+// touches the box (Pharr et al., Physically Based Rendering, 3rd ed., 3.9.2)
+constexpr float kSlabFarScale = 1.f + 2.f * (3.f * 0.5f * std::numeric_limits<float>::epsilon()) / (1.f - 3.f * 0.5f * std::numeric_limits<float>::epsilon());
+
+// Up to kMaxRays rays as separate arrays of components, with the reciprocals of their directions, for testing many
+// rays against one box with the SIMD kernels. No component of a direction is zero, so the slab test never
+// multiplies zero by infinity.
+struct RayPacket
+{
+	static constexpr uint32_t kMaxRays = 64;
+
+	alignas(64) float originX[kMaxRays];
+	alignas(64) float originY[kMaxRays];
+	alignas(64) float originZ[kMaxRays];
+	alignas(64) float inverseDirectionX[kMaxRays];
+	alignas(64) float inverseDirectionY[kMaxRays];
+	alignas(64) float inverseDirectionZ[kMaxRays];
+	alignas(64) float maxT[kMaxRays];
+
+	void Set(uint32_t i, const Ray& ray)
+	{
+		// Components this small make a ray parallel to the slab for any box the scene can hold
+		auto inverse = [](float component) { return 1.f / (std::abs(component) < 1e-20f ? std::copysign(1e-20f, component) : component); };
+		originX[i] = ray.origin.x;
+		originY[i] = ray.origin.y;
+		originZ[i] = ray.origin.z;
+		inverseDirectionX[i] = inverse(ray.directionN.x);
+		inverseDirectionY[i] = inverse(ray.directionN.y);
+		inverseDirectionZ[i] = inverse(ray.directionN.z);
+		maxT[i] = ray.maxT;
+	}
+};
+
+// Rays as separate arrays of components, the layout the SIMD kernels read and write
+struct RayBatch
+{
+	std::vector<float> originX, originY, originZ;
+	std::vector<float> directionX, directionY, directionZ;
+
+	size_t Size() const { return originX.size(); }
+
+	void Resize(size_t count)
+	{
+		for (auto* components : { &originX, &originY, &originZ, &directionX, &directionY, &directionZ })
+			components->resize(count);
+	}
+
+	Ray Get(size_t i) const
+	{
+		return { { originX[i], originY[i], originZ[i] }, { directionX[i], directionY[i], directionZ[i] } };
+	}
+};
+
+// Everything known about the closest hit, built once the traversal is over
 struct HitInfo 
 {
 	bool hit = false;
 	float t = std::numeric_limits<float>::max();
 	Vector3 point;
-	Vector3 normal;
+	Vector3 normal;			// Geometric (face) normal
+	Vector3 shadingNormal;	// Interpolated vertex normal for smooth shaded materials, the face normal otherwise
 	float u;
 	float v;
 	uint32_t meshIndex;
 	uint32_t triangleIndex;
+	uint32_t materialIndex;
 };
 
-struct Vertex
+// Closest candidate found so far during traversal. Kept small, because it is rewritten for every closer hit.
+struct TraversalHit
 {
-	Vector3 position;
-	Vector3 normal;
+	static constexpr uint32_t kNoPrimitive = std::numeric_limits<uint32_t>::max();
+
+	float t = std::numeric_limits<float>::max();
+	float u;
+	float v;
+	uint32_t primitiveId = kNoPrimitive;
+
+	bool Hit() const { return primitiveId != kNoPrimitive; }
 };
 
-struct Triangle
+// Ray/triangle test against the corners a, b and c, accepting hits with t in [0, ray.maxT] and below tMax.
+// Writes only t and the barycentric coordinates u and v. The face normal is not stored with the mesh: the plane
+// and edge tests only need its direction, so the unnormalized cross product is used.
+inline bool IntersectTriangle(const Vector3& a, const Vector3& b, const Vector3& c, const Ray& ray, float tMax, float& tHit, float& uHit, float& vHit)
 {
-	Vertex v0;
-	Vertex v1;
-	Vertex v2;
-
-	Vector3 faceNormal;
+	const Vector3 crossABC = Cross(b - a, c - a);
+
+	float dirDotNorm = Dot(ray.directionN, crossABC);
+	//if (dirDotNorm >= 0.f)
+	//	return false;
+
+	float t = Dot(a - ray.origin, crossABC) / dirDotNorm;
+	if (t < 0.f || t > ray.maxT || !(t < tMax))
+		return false;
+
+	Vector3 p = ray(t);
+
+	Vector3 edge0 = b - a;
+	Vector3 edge1 = c - b;
+	Vector3 edge2 = a - c;
+	Vector3 C0 = p - a;
+	Vector3 C1 = p - b;
+	Vector3 C2 = p - c;
+
+	if (Dot(crossABC, Cross(edge0, C0)) < 0.f)
+		return false;
+	if (Dot(crossABC, Cross(edge1, C1)) < 0.f)
+		return false;
+	if (Dot(crossABC, Cross(edge2, C2)) < 0.f)
+		return false;
+
+	// Calculate the barycentric coordinates
+	float areaABC = Magnitude(crossABC); // Area of the whole triangle
+	float areaPBC = Magnitude(Cross(b - p, c - p)); // Area of the triangle PBC
+	float areaPCA = Magnitude(Cross(c - p, a - p)); // Area of the triangle PCA
+
+	tHit = t;
+	uHit = areaPBC / areaABC;
+	vHit = areaPCA / areaABC;
+	return true;
+}
 
-	Triangle(Vertex a, Vertex b, Vertex c)
-	{
-		v0 = a;
-		v1 = b;
-		v2 = c;
-		this->faceNormal = Normalize(Cross(v1.position - v0.position, v2.position - v0.position));
-	}
+// Octahedral unit vector encoding: the direction is projected onto the octahedron |x| + |y| + |z| = 1, the lower
+// half folded over the upper one, and the resulting x and y stored as two 16-bit snorms (about 0.003 degrees error).
+inline uint32_t EncodeOctahedral(const Vector3& n)
+{
+	const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (!(l1 > 0.f))
+		return 0; // Zero or NaN input, decodes to +Z
 
-	float Area() const
+	float px = n.x / l1;
+	float py = n.y / l1;
+	if (n.z < 0.f)
 	{
-		return Cross(v1.position - v0.position, v2.position - v0.position).Magnitude() * 0.5f;
+		const float foldedX = (1.f - std::abs(py)) * (px >= 0.f ? 1.f : -1.f);
+		const float foldedY = (1.f - std::abs(px)) * (py >= 0.f ? 1.f : -1.f);
+		px = foldedX;
+		py = foldedY;
 	}
 
-	Vector3 GetNormal(float u, float v) const
-	{
-		float w = 1.f - u - v;
-		return Normalize(v0.normal * u + v1.normal * v + v2.normal * w);
-	}
+	auto toSnorm16 = [](float f)
+		{
+			return static_cast<uint32_t>(static_cast<int32_t>(std::round(std::clamp(f, -1.f, 1.f) * 32767.f))) & 0xffffu;
+		};
+	return toSnorm16(px) | (toSnorm16(py) << 16);
+}
 
-	HitInfo Intersect(const Ray& ray) const
-	{
-		HitInfo info;
-
-		const Vector3& a = v0.position;
-		const Vector3& b = v1.position;
-		const Vector3& c = v2.position;
-
-		float dirDotNorm = Dot(ray.directionN, faceNormal);
-		//if (dirDotNorm >= 0.f)
-		//	return info;
-
-		float t = Dot(a - ray.origin, faceNormal) / dirDotNorm;
-		if (t < 0.f || t > ray.maxT)
-			return info;
-
-		Vector3 p = ray(t);
-
-		Vector3 edge0 = b - a;
-		Vector3 edge1 = c - b;
-		Vector3 edge2 = a - c;
-		Vector3 C0 = p - a;
-		Vector3 C1 = p - b;
-		Vector3 C2 = p - c;
-
-		if (Dot(faceNormal, Cross(edge0, C0)) < 0.f)
-			return info;
-		if (Dot(faceNormal, Cross(edge1, C1)) < 0.f)
-			return info;
-		if (Dot(faceNormal, Cross(edge2, C2)) < 0.f)
-			return info;
-
-		// Calculate the barycentric coordinates
-		float areaABC = Magnitude(Cross(b - a, c - a)); // Area of the whole triangle
-		float areaPBC = Magnitude(Cross(b - p, c - p)); // Area of the triangle PBC
-		float areaPCA = Magnitude(Cross(c - p, a - p)); // Area of the triangle PCA
-
-		info.u = areaPBC / areaABC;
-		info.v = areaPCA / areaABC;
-
-		info.hit = true;
-		info.t = t;
-		info.point = p;
-		info.normal = faceNormal;
-
-		return info;
-	}
-};
+inline Vector3 DecodeOctahedral(uint32_t encoded)
+{
+	const float px = static_cast<float>(static_cast<int16_t>(encoded & 0xffffu)) / 32767.f;
+	const float py = static_cast<float>(static_cast<int16_t>(encoded >> 16)) / 32767.f;
+
+	Vector3 n{ px, py, 1.f - std::abs(px) - std::abs(py) };
+	const float fold = std::max(-n.z, 0.f);
+	n.x += n.x >= 0.f ? -fold : fold;
+	n.y += n.y >= 0.f ? -fold : fold;
+	return Normalize(n);
+}
 
 struct Matrix4
 {
@@ -398,9 +468,26 @@ Point3 operator *(const Matrix4& H, const Point3& p)
 		H(2,0) * p.x + H(2,1) * p.y + H(2,2) * p.z + H(2,3));
 }
 
+// Column j of the product is the sum of the columns of A weighted by column j of B. The SSE version adds in the
+// same order as the scalar one, so both give identical results.
 Matrix4 operator*(const Matrix4& A, const Matrix4& B)
 {
 	Matrix4 result;
+#if SIMD_SSE2
+	const __m128 a0 = _mm_loadu_ps(&A(0, 0));
+	const __m128 a1 = _mm_loadu_ps(&A(0, 1));
+	const __m128 a2 = _mm_loadu_ps(&A(0, 2));
+	const __m128 a3 = _mm_loadu_ps(&A(0, 3));
+	for (int j = 0; j < 4; ++j)
+	{
+		__m128 column = _mm_setzero_ps();
+		column = _mm_add_ps(column, _mm_mul_ps(a0, _mm_set1_ps(B(0, j))));
+		column = _mm_add_ps(column, _mm_mul_ps(a1, _mm_set1_ps(B(1, j))));
+		column = _mm_add_ps(column, _mm_mul_ps(a2, _mm_set1_ps(B(2, j))));
+		column = _mm_add_ps(column, _mm_mul_ps(a3, _mm_set1_ps(B(3, j))));
+		_mm_storeu_ps(&result(0, j), column);
+	}
+#else
 	for (int i = 0; i < 4; ++i)
 	{
 		for (int j = 0; j < 4; ++j)
@@ -412,5 +499,6 @@ Matrix4 operator*(const Matrix4& A, const Matrix4& B)
 			}
 		}
 	}
+#endif
 	return result;
 }
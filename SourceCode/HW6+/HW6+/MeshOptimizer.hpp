@@ -0,0 +1,231 @@
+#pragma once
+
+#include "Math3D.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+struct MeshOptimizationStats
+{
+	size_t verticesBefore = 0;
+	size_t verticesAfter = 0;
+	size_t trianglesBefore = 0;
+	size_t trianglesAfter = 0;
+	size_t degenerateTriangles = 0;
+	size_t duplicateTriangles = 0;
+
+	MeshOptimizationStats& operator +=(const MeshOptimizationStats& other)
+	{
+		verticesBefore += other.verticesBefore;
+		verticesAfter += other.verticesAfter;
+		trianglesBefore += other.trianglesBefore;
+		trianglesAfter += other.trianglesAfter;
+		degenerateTriangles += other.degenerateTriangles;
+		duplicateTriangles += other.duplicateTriangles;
+		return (*this);
+	}
+
+	void Print(const std::string& sceneName) const
+	{
+		std::cout << sceneName << ": vertices " << verticesBefore << " -> " << verticesAfter
+			<< ", triangles " << trianglesBefore << " -> " << trianglesAfter
+			<< " (" << degenerateTriangles << " degenerate, " << duplicateTriangles << " duplicate removed)\n";
+	}
+};
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each of them
+inline uint32_t ExpandBits10(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// 30-bit Morton code of a point inside the unit cube
+inline uint32_t MortonCode(const Vector3& p)
+{
+	auto quantize = [](float f) { return static_cast<uint32_t>(std::clamp(f * 1024.f, 0.f, 1023.f)); };
+	return (ExpandBits10(quantize(p.x)) << 2) | (ExpandBits10(quantize(p.y)) << 1) | ExpandBits10(quantize(p.z));
+}
+
+// Load-time cleanup of an indexed triangle mesh, in place:
+//   1. vertices closer than weldTolerance are merged into the first one seen
+//   2. degenerate triangles (repeated vertex or zero area) and duplicates of an earlier triangle over the same
+//      three vertices in the same winding order are dropped; the same vertices wound the other way are a
+//      back-to-back face, which may be deliberate, and are kept
+//   3. triangles are sorted by the Morton code of their centroid and vertices renumbered in first-use order,
+//      so neighbouring triangles and their vertices end up close in memory
+inline MeshOptimizationStats OptimizeMesh(std::vector<Vector3>& vertices, std::vector<uint32_t>& indices, float weldTolerance)
+{
+	MeshOptimizationStats stats;
+	stats.verticesBefore = vertices.size();
+	stats.trianglesBefore = indices.size() / 3;
+
+	// Weld: every vertex looks for an earlier representative in its grid cell and in the neighbouring cells its
+	// tolerance sphere reaches into. Cells are four tolerances wide, so usually only one cell is searched.
+	const double cellSize = 4.0 * std::max(static_cast<double>(weldTolerance), 1e-9);
+	const double tolerance = weldTolerance;
+	const float toleranceSquared = weldTolerance * weldTolerance;
+	auto cellKey = [](int64_t x, int64_t y, int64_t z)
+		{
+			// Collisions only merge two chains; candidates are always checked by distance
+			return static_cast<uint64_t>(x) * 0x9e3779b97f4a7c15ull ^ static_cast<uint64_t>(y) * 0xc2b2ae3d27d4eb4full ^ static_cast<uint64_t>(z) * 0x165667b19e3779f9ull;
+		};
+
+	constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+	std::unordered_map<uint64_t, uint32_t> cellHead;
+	cellHead.reserve(vertices.size());
+	std::vector<uint32_t> nextInCell(vertices.size(), kNone);
+	std::vector<uint32_t> weldedIndex(vertices.size());
+
+	for (uint32_t i = 0; i < vertices.size(); ++i)
+	{
+		const Vector3& p = vertices[i];
+		int64_t cell[3];
+		int64_t lowOffset[3];
+		int64_t highOffset[3];
+		const float coordinates[3] = { p.x, p.y, p.z };
+		for (uint32_t axis = 0; axis < 3; ++axis)
+		{
+			const double scaled = std::clamp(coordinates[axis] / cellSize, -1e15, 1e15);
+			const double cellStart = std::floor(scaled);
+			cell[axis] = static_cast<int64_t>(cellStart);
+			lowOffset[axis] = (scaled - cellStart) * cellSize <= tolerance ? -1 : 0;
+			highOffset[axis] = (cellStart + 1.0 - scaled) * cellSize <= tolerance ? 1 : 0;
+		}
+
+		uint32_t representative = kNone;
+		for (int64_t dz = lowOffset[2]; dz <= highOffset[2] && representative == kNone; ++dz)
+		{
+			for (int64_t dy = lowOffset[1]; dy <= highOffset[1] && representative == kNone; ++dy)
+			{
+				for (int64_t dx = lowOffset[0]; dx <= highOffset[0] && representative == kNone; ++dx)
+				{
+					auto it = cellHead.find(cellKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+					for (uint32_t candidate = it == cellHead.end() ? kNone : it->second; candidate != kNone; candidate = nextInCell[candidate])
+					{
+						const Vector3 d = vertices[candidate] - p;
+						if (Dot(d, d) <= toleranceSquared)
+						{
+							representative = candidate;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		if (representative == kNone)
+		{
+			representative = i;
+			auto [it, inserted] = cellHead.try_emplace(cellKey(cell[0], cell[1], cell[2]), i);
+			if (!inserted)
+			{
+				nextInCell[i] = it->second;
+				it->second = i;
+			}
+		}
+		weldedIndex[i] = representative;
+	}
+
+	// Drop degenerate and duplicate triangles
+	struct TriangleKeyHash
+	{
+		size_t operator()(const std::array<uint32_t, 3>& key) const
+		{
+			return (static_cast<size_t>(key[0]) * 0x9e3779b97f4a7c15ull) ^ (static_cast<size_t>(key[1]) * 0xc2b2ae3d27d4eb4full) ^ key[2];
+		}
+	};
+	std::unordered_set<std::array<uint32_t, 3>, TriangleKeyHash> seenTriangles;
+	seenTriangles.reserve(indices.size() / 3);
+
+	std::vector<uint32_t> keptIndices;
+	keptIndices.reserve(indices.size());
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		const uint32_t i0 = weldedIndex[indices[i]];
+		const uint32_t i1 = weldedIndex[indices[i + 1]];
+		const uint32_t i2 = weldedIndex[indices[i + 2]];
+
+		const Vector3 e0 = vertices[i1] - vertices[i0];
+		const Vector3 e1 = vertices[i2] - vertices[i0];
+		// Twice the area, compared against float rounding noise of the edge lengths. Also rejects NaN.
+		const float doubleArea = Cross(e0, e1).Magnitude();
+		if (i0 == i1 || i1 == i2 || i2 == i0 || !(doubleArea > 1e-7f * (Dot(e0, e0) + Dot(e1, e1))))
+		{
+			++stats.degenerateTriangles;
+			continue;
+		}
+
+		// Rotated to start at the smallest index, which keeps the winding
+		std::array<uint32_t, 3> key{ i0, i1, i2 };
+		std::rotate(key.begin(), std::min_element(key.begin(), key.end()), key.end());
+		if (!seenTriangles.insert(key).second)
+		{
+			++stats.duplicateTriangles;
+			continue;
+		}
+
+		keptIndices.insert(keptIndices.end(), { i0, i1, i2 });
+	}
+
+	// Sort triangles along a Morton curve through their centroids
+	const size_t triangleCount = keptIndices.size() / 3;
+	Vector3 boundsMin{ std::numeric_limits<float>::max() };
+	Vector3 boundsMax{ std::numeric_limits<float>::lowest() };
+	std::vector<Vector3> centroids(triangleCount);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		const Vector3 c = (vertices[keptIndices[3 * t]] + vertices[keptIndices[3 * t + 1]] + vertices[keptIndices[3 * t + 2]]) / 3.f;
+		centroids[t] = c;
+		boundsMin = { std::min(boundsMin.x, c.x), std::min(boundsMin.y, c.y), std::min(boundsMin.z, c.z) };
+		boundsMax = { std::max(boundsMax.x, c.x), std::max(boundsMax.y, c.y), std::max(boundsMax.z, c.z) };
+	}
+
+	const Vector3 extent = boundsMax - boundsMin;
+	const Vector3 invExtent{
+		extent.x > 0.f ? 1.f / extent.x : 0.f,
+		extent.y > 0.f ? 1.f / extent.y : 0.f,
+		extent.z > 0.f ? 1.f / extent.z : 0.f
+	};
+	std::vector<std::pair<uint32_t, uint32_t>> order(triangleCount);
+	for (uint32_t t = 0; t < triangleCount; ++t)
+		order[t] = { MortonCode((centroids[t] - boundsMin) * invExtent), t };
+	std::sort(order.begin(), order.end());
+
+	// Emit triangles in Morton order, numbering vertices as they are first used. Unreferenced vertices vanish.
+	std::vector<uint32_t> newIndex(vertices.size(), kNone);
+	std::vector<Vector3> newVertices;
+	newVertices.reserve(vertices.size());
+	indices.resize(keptIndices.size());
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			const uint32_t oldIndex = keptIndices[3 * order[t].second + k];
+			if (newIndex[oldIndex] == kNone)
+			{
+				newIndex[oldIndex] = static_cast<uint32_t>(newVertices.size());
+				newVertices.push_back(vertices[oldIndex]);
+			}
+			indices[3 * t + k] = newIndex[oldIndex];
+		}
+	}
+	vertices = std::move(newVertices);
+
+	stats.verticesAfter = vertices.size();
+	stats.trianglesAfter = triangleCount;
+	return stats;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs task(i) for every i in [0, count) on up to hardware_concurrency() threads, the calling thread included.
+// Indices are handed out in chunks of grainSize through an atomic counter, so uneven work balances itself.
+template <typename Task>
+void ParallelFor(size_t count, size_t grainSize, const Task& task)
+{
+	grainSize = std::max<size_t>(grainSize, 1);
+	const size_t numChunks = (count + grainSize - 1) / grainSize;
+	const size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), numChunks);
+
+	if (numThreads <= 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+			task(i);
+		return;
+	}
+
+	std::atomic<size_t> nextIndex{ 0 };
+	auto worker = [&]()
+		{
+			for (;;)
+			{
+				const size_t begin = nextIndex.fetch_add(grainSize, std::memory_order_relaxed);
+				if (begin >= count)
+					break;
+				const size_t end = std::min(count, begin + grainSize);
+				for (size_t i = begin; i < end; ++i)
+					task(i);
+			}
+		};
+
+	std::vector<std::jthread> threads;
+	threads.reserve(numThreads - 1);
+	for (size_t i = 1; i < numThreads; ++i)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// Fixed set of threads for callers that run at the same time and should not each start hardware_concurrency()
+// threads of their own, like the requests of the render server. Every Run() call waits in a queue with its next
+// index; a pool thread takes one index of the call at the front and moves the call to the back, so concurrent calls
+// take turns index by index and a short call does not wait behind the whole of a long one.
+// Run() must not be called from a pool thread.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(uint32_t threadCount = 0)
+	{
+		threadCount = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+		threads.reserve(threadCount);
+		for (uint32_t i = 0; i < threadCount; ++i)
+			threads.emplace_back([this]() { work(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		batchAdded.notify_all();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	uint32_t GetThreadCount() const { return static_cast<uint32_t>(threads.size()); }
+
+	// Runs task(i) for every i in [0, count) on the pool and returns once all are done
+	template <typename Task>
+	void Run(size_t count, const Task& task)
+	{
+		if (count == 0)
+			return;
+
+		Batch batch{ [&task](size_t i) { task(i); }, count };
+		{
+			std::lock_guard lock(mutex);
+			batches.push_back(&batch);
+		}
+		batchAdded.notify_all();
+
+		std::unique_lock lock(mutex);
+		batchDone.wait(lock, [&] { return batch.finished == count; });
+	}
+
+private:
+	// The indices of one Run() call
+	struct Batch
+	{
+		std::function<void(size_t)> task;
+		size_t count = 0;
+		size_t next = 0;		// Next index to hand out
+		size_t finished = 0;	// Indices done
+	};
+
+	void work()
+	{
+		std::unique_lock lock(mutex);
+		for (;;)
+		{
+			batchAdded.wait(lock, [&] { return stopping || !batches.empty(); });
+			if (batches.empty())
+				return;
+
+			Batch* batch = batches.front();
+			batches.pop_front();
+			const size_t index = batch->next++;
+			if (batch->next < batch->count)
+				batches.push_back(batch);
+
+			lock.unlock();
+			batch->task(index);
+			lock.lock();
+
+			if (++batch->finished == batch->count)
+				batchDone.notify_all();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable batchAdded;
+	std::condition_variable batchDone;
+	std::deque<Batch*> batches;		// Calls with indices left to hand out, the next to take one in front
+	bool stopping = false;
+	std::vector<std::jthread> threads;	// Last, so the threads stop before the queue goes away
+};
@@ -0,0 +1,474 @@
+#pragma once
+
+#include "CommandLine.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+
+#include "rapidjson/document.h"
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Renders every scene and checks it against a reference image and a time budget kept in one directory:
+//   <references>/<scene>_render.ppm   - the expected image, at the scene's resolution times the budget scale
+//   <references>/budgets.json         - the scale, and the load and render time budget of every scene
+// A scene fails when more than a fraction of its pixels differ by more than the pixel tolerance in any channel,
+// when its PSNR drops below the threshold, or when loading or rendering takes longer than its budget plus the time
+// tolerance (and the time slack). The image of a failed scene is kept as <references>/<scene>_actual_render.ppm.
+// Budgets are the median of the runs and checks take the best, so the spread of the runs is headroom on top of the
+// tolerance. Times only mean something on the kind of machine that recorded them, so every budget keeps the thread
+// count and SIMD level it was measured with, and on another kind of machine only the image of the scene is checked.
+// The references and budgets of the bundled scenes are committed next to them, at the default scale. --update renders
+// the references and measures the budgets of the scenes given instead; the budgets of the other scenes in the file
+// are kept as long as they are at the same scale.
+class RegressionSuite
+{
+public:
+	struct Options
+	{
+		std::vector<std::string> sceneFiles;
+		std::string referenceDirectory = "references";
+		bool update = false;
+		float scale = 0.25f;				// Of the image resolution, only used by --update; checks use the one of the budgets
+		uint32_t repetitions = 5;			// Budgets are the median of this many runs, checks the best
+		uint32_t pixelTolerance = 2;		// Of one color channel, out of 255
+		double maxBadPixels = 0.0005;		// Fraction of pixels allowed above the pixel tolerance
+		double minPsnr = 40.0;				// dB
+		double timeTolerance = 0.25;		// Slowdown over the budget above which a scene fails
+		double timeSlack = 0.005;			// Seconds over the budget that always pass; phases this short are mostly noise
+	};
+
+	// Command line: --regression [--update] [--references DIR] [--scale S] [--repetitions N] [--pixel-tolerance N]
+	//               [--max-bad-pixels F] [--min-psnr DB] [--time-tolerance T] [--time-slack SECONDS] [scenes...]
+	static bool ParseArguments(const std::vector<std::string>& arguments, const std::vector<std::string>& defaultScenes, Options& options)
+	{
+		for (size_t i = 1; i < arguments.size(); ++i)
+		{
+			const std::string& argument = arguments[i];
+			const bool hasValue = i + 1 < arguments.size();
+			if (argument == "--update")
+				options.update = true;
+			else if (argument == "--references" && hasValue)
+				options.referenceDirectory = arguments[++i];
+			else if (argument == "--scale" && hasValue)
+			{
+				if (!ParseFlagNumber("--scale", arguments[++i], "S", options.scale))
+					return false;
+				if (!(options.scale > 0.f))
+				{
+					std::cout << "--scale must be above 0\n";
+					return false;
+				}
+			}
+			else if (argument == "--repetitions" && hasValue)
+			{
+				if (!ParseFlagNumber("--repetitions", arguments[++i], "N", options.repetitions))
+					return false;
+				options.repetitions = std::max(1u, options.repetitions);
+			}
+			else if (argument == "--pixel-tolerance" && hasValue)
+			{
+				if (!ParseFlagNumber("--pixel-tolerance", arguments[++i], "N", options.pixelTolerance))
+					return false;
+			}
+			else if (argument == "--max-bad-pixels" && hasValue)
+			{
+				if (!ParseFlagNumber("--max-bad-pixels", arguments[++i], "F", options.maxBadPixels))
+					return false;
+			}
+			else if (argument == "--min-psnr" && hasValue)
+			{
+				if (!ParseFlagNumber("--min-psnr", arguments[++i], "DB", options.minPsnr))
+					return false;
+			}
+			else if (argument == "--time-tolerance" && hasValue)
+			{
+				if (!ParseFlagNumber("--time-tolerance", arguments[++i], "T", options.timeTolerance))
+					return false;
+			}
+			else if (argument == "--time-slack" && hasValue)
+			{
+				if (!ParseFlagNumber("--time-slack", arguments[++i], "SECONDS", options.timeSlack))
+					return false;
+			}
+			else if (argument.starts_with("--"))
+			{
+				std::cout << "Unknown regression option: " << argument << '\n';
+				return false;
+			}
+			else
+				options.sceneFiles.push_back(argument);
+		}
+		if (options.sceneFiles.empty())
+			options.sceneFiles = defaultScenes;
+		return true;
+	}
+
+	explicit RegressionSuite(const Options& options) : options(options) {}
+
+	// Returns the exit code: 1 if any scene failed or the references are missing
+	int Run()
+	{
+		std::vector<SceneBudget> budgets;
+		if (options.update)
+			keepOtherBudgets(budgets);
+		else if (!readBudgets(budgets))
+			return 1;
+
+		std::error_code error;
+		std::filesystem::create_directories(options.referenceDirectory, error);
+
+		uint32_t failures = 0;
+		for (const auto& sceneFile : options.sceneFiles)
+		{
+			const std::string name = std::filesystem::path(sceneFile).stem().string();
+			const auto budget = std::find_if(budgets.begin(), budgets.end(), [&](const SceneBudget& b) { return b.name == name; });
+			if (options.update)
+			{
+				if (budget != budgets.end())
+					*budget = updateScene(sceneFile, name);
+				else
+					budgets.push_back(updateScene(sceneFile, name));
+				continue;
+			}
+
+			if (budget == budgets.end())
+			{
+				std::cout << name << ": no budget in " << budgetsFileName() << ", run --regression --update\n";
+				++failures;
+				continue;
+			}
+			failures += !checkScene(sceneFile, *budget);
+		}
+
+		if (options.update)
+		{
+			writeBudgets(budgets);
+			return 0;
+		}
+		std::cout << failures << " of " << options.sceneFiles.size() << " scene(s) failed\n";
+		return failures > 0 ? 1 : 0;
+	}
+
+protected:
+	struct SceneBudget
+	{
+		std::string name;
+		double loadSeconds = 0.0;
+		double renderSeconds = 0.0;
+		uint32_t threads = std::thread::hardware_concurrency();
+		std::string simdLevel = SimdLevelName(ActiveSimdKernels().level);
+
+		bool IsFromThisMachine() const
+		{
+			return threads == std::thread::hardware_concurrency() && simdLevel == SimdLevelName(ActiveSimdKernels().level);
+		}
+	};
+
+	struct ImageDifference
+	{
+		uint32_t maxError = 0;		// Largest difference of one channel
+		size_t badPixels = 0;		// Pixels with a channel off by more than the pixel tolerance
+		double psnr = std::numeric_limits<double>::infinity();
+	};
+
+	// The median of the runs for a budget, the best one for a check
+	template <typename Task>
+	double measure(const Task& task) const
+	{
+		std::vector<double> seconds;
+		for (uint32_t i = 0; i < options.repetitions; ++i)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			task();
+			const auto end = std::chrono::steady_clock::now();
+			seconds.push_back(std::chrono::duration<double>(end - start).count());
+		}
+		std::sort(seconds.begin(), seconds.end());
+		return options.update ? seconds[seconds.size() / 2] : seconds.front();
+	}
+
+	// Loads the scene without the cache, so the loader itself is timed, and renders it at the given scale.
+	// useImage(renderer, image) gets the last image, while the renderer can still write it.
+	template <typename UseImage>
+	void renderScene(const std::string& sceneFile, float imageScale, SceneBudget& times, const UseImage& useImage) const
+	{
+		times.loadSeconds = measure([&]() { Scene scene(sceneFile, { .useCache = false }); });
+
+		Scene scene(sceneFile, { .useCache = false });
+		scene.settings.imageSettings.width = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.width * imageScale));
+		scene.settings.imageSettings.height = std::max(1u, static_cast<uint32_t>(scene.settings.imageSettings.height * imageScale));
+		Renderer renderer(scene);
+		Image image(1, 1);
+		times.renderSeconds = measure([&]() { image = renderer.Render(); });
+		useImage(renderer, image);
+	}
+
+	// As <references>/<name>_render.ppm, through the renderer so the references are exactly what it writes
+	void writeImage(Renderer& renderer, const Image& image, const std::string& name) const
+	{
+		Scene::Settings settings{};
+		settings.sceneName = std::filesystem::path(options.referenceDirectory).append(name).string();
+		renderer.WriteToFile(image, settings);
+	}
+
+	SceneBudget updateScene(const std::string& sceneFile, const std::string& name)
+	{
+		SceneBudget budget{ name };
+		renderScene(sceneFile, options.scale, budget, [&](Renderer& renderer, const Image& image)
+			{
+				writeImage(renderer, image, name);
+				std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(3)
+					<< " reference " << image.GetWidth() << 'x' << image.GetHeight()
+					<< ", load " << budget.loadSeconds << " s, render " << budget.renderSeconds << " s\n";
+			});
+		return budget;
+	}
+
+	bool checkScene(const std::string& sceneFile, const SceneBudget& budget)
+	{
+		Image reference(1, 1);
+		if (!readImage(referenceName(budget.name) + ".ppm", reference))
+		{
+			std::cout << budget.name << ": no reference image " << referenceName(budget.name) << ".ppm\n";
+			return false;
+		}
+
+		SceneBudget times{ budget.name };
+		bool passed = true;
+		renderScene(sceneFile, budgetScale, times, [&](Renderer& renderer, const Image& image)
+			{
+				std::cout << std::left << std::setw(12) << budget.name << std::right << std::fixed;
+				passed = checkImage(image, reference);
+				if (!passed)
+					writeImage(renderer, image, budget.name + "_actual");
+			});
+
+		auto checkTime = [&](const char* phase, double seconds, double budgetSeconds)
+			{
+				if (!budget.IsFromThisMachine())
+				{
+					std::cout << ", " << phase << ' ' << std::setprecision(3) << seconds << " s";
+					return;
+				}
+				const double ratio = budgetSeconds > 0.0 ? seconds / budgetSeconds : 1.0;
+				const bool timePassed = ratio <= 1.0 + options.timeTolerance || seconds - budgetSeconds <= options.timeSlack;
+				std::cout << ", " << phase << ' ' << std::setprecision(3) << seconds << " s (" << std::setprecision(2) << ratio << "x)"
+					<< (timePassed ? "" : "   TIME");
+				passed &= timePassed;
+			};
+		checkTime("load", times.loadSeconds, budget.loadSeconds);
+		checkTime("render", times.renderSeconds, budget.renderSeconds);
+		std::cout << '\n';
+		return passed;
+	}
+
+	// Prints the image part of the scene's line
+	bool checkImage(const Image& image, const Image& reference) const
+	{
+		if (image.GetWidth() != reference.GetWidth() || image.GetHeight() != reference.GetHeight())
+		{
+			std::cout << " image " << image.GetWidth() << 'x' << image.GetHeight() << " but reference "
+				<< reference.GetWidth() << 'x' << reference.GetHeight() << "   QUALITY";
+			return false;
+		}
+
+		const ImageDifference difference = compareImages(image, reference);
+		const double badFraction = static_cast<double>(difference.badPixels) / (size_t(image.GetWidth()) * image.GetHeight());
+		const bool passed = badFraction <= options.maxBadPixels && difference.psnr >= options.minPsnr;
+		std::cout << " max error " << std::setw(3) << difference.maxError << ", bad pixels " << std::setw(6) << difference.badPixels
+			<< ", PSNR " << std::setprecision(1) << std::setw(6) << difference.psnr << " dB" << (passed ? "" : "   QUALITY");
+		return passed;
+	}
+
+	ImageDifference compareImages(const Image& image, const Image& reference) const
+	{
+		ImageDifference difference;
+		double squaredError = 0.0;
+		for (uint32_t row = 0; row < image.GetHeight(); ++row)
+		{
+			for (uint32_t column = 0; column < image.GetWidth(); ++column)
+			{
+				const RGB& a = image.GetPixel(column, row);
+				const RGB& b = reference.GetPixel(column, row);
+				uint32_t pixelError = 0;
+				for (auto channel : { &RGB::r, &RGB::g, &RGB::b })
+				{
+					const int error = std::abs(static_cast<int>(a.*channel) - static_cast<int>(b.*channel));
+					pixelError = std::max(pixelError, static_cast<uint32_t>(error));
+					squaredError += double(error) * error;
+				}
+				difference.maxError = std::max(difference.maxError, pixelError);
+				difference.badPixels += pixelError > options.pixelTolerance;
+			}
+		}
+
+		const double meanSquaredError = squaredError / (3.0 * image.GetWidth() * image.GetHeight());
+		if (meanSquaredError > 0.0)
+			difference.psnr = 10.0 * std::log10(255.0 * 255.0 / meanSquaredError);
+		return difference;
+	}
+
+	// Reads the plain (P3) PPM files written by PPMWriter
+	static bool readImage(const std::string& fileName, Image& image)
+	{
+		std::ifstream ifs(fileName);
+		std::string magic;
+		uint32_t width = 0, height = 0, maxColor = 0;
+		if (!ifs.is_open() || !(ifs >> magic >> width >> height >> maxColor) || magic != "P3" || maxColor != 255 || width == 0 || height == 0)
+			return false;
+
+		image = Image(width, height);
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			for (uint32_t column = 0; column < width; ++column)
+			{
+				uint32_t r, g, b;
+				if (!(ifs >> r >> g >> b))
+					return false;
+				image.SetPixel(column, row, { static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b) });
+			}
+		}
+		return true;
+	}
+
+	std::string referenceName(const std::string& name) const
+	{
+		return std::filesystem::path(options.referenceDirectory).append(name + "_render").string();
+	}
+
+	std::string budgetsFileName() const
+	{
+		return std::filesystem::path(options.referenceDirectory).append("budgets.json").string();
+	}
+
+	enum class BudgetsStatus
+	{
+		OK,
+		MISSING,
+		INVALID,
+	};
+
+	// Reads the budgets file into budgets and budgetScale
+	BudgetsStatus loadBudgets(std::vector<SceneBudget>& budgets)
+	{
+		using namespace rapidjson;
+		std::ifstream ifs(budgetsFileName());
+		if (!ifs.is_open())
+			return BudgetsStatus::MISSING;
+		std::stringstream text;
+		text << ifs.rdbuf();
+
+		Document doc;
+		doc.Parse(text.str().c_str());
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("scale") || !doc["scale"].IsNumber()
+			|| !doc.HasMember("scenes") || !doc["scenes"].IsArray())
+			return BudgetsStatus::INVALID;
+
+		budgetScale = doc["scale"].GetFloat();
+		for (const auto& entry : doc["scenes"].GetArray())
+		{
+			if (!entry.HasMember("name") || !entry["name"].IsString() || !entry.HasMember("load_seconds") || !entry["load_seconds"].IsNumber()
+				|| !entry.HasMember("render_seconds") || !entry["render_seconds"].IsNumber() || !entry.HasMember("threads") || !entry["threads"].IsUint()
+				|| !entry.HasMember("simd_level") || !entry["simd_level"].IsString())
+				continue;
+			budgets.push_back({ entry["name"].GetString(), entry["load_seconds"].GetDouble(), entry["render_seconds"].GetDouble(),
+				entry["threads"].GetUint(), entry["simd_level"].GetString() });
+		}
+		return BudgetsStatus::OK;
+	}
+
+	bool readBudgets(std::vector<SceneBudget>& budgets)
+	{
+		switch (loadBudgets(budgets))
+		{
+		case BudgetsStatus::MISSING:
+			std::cout << "No references in " << options.referenceDirectory << ", run --regression --update first\n";
+			return false;
+		case BudgetsStatus::INVALID:
+			std::cout << "Invalid budgets " << budgetsFileName() << '\n';
+			return false;
+		case BudgetsStatus::OK:
+			break;
+		}
+
+		std::cout << "Regression against " << options.referenceDirectory << ": scenes at " << budgetScale << "x resolution, pixel tolerance "
+			<< options.pixelTolerance << " on at most " << options.maxBadPixels * 100.0 << "% of the pixels, PSNR >= " << options.minPsnr
+			<< " dB, time tolerance " << options.timeTolerance * 100.0 << "%\n";
+		const auto otherMachine = std::count_if(budgets.begin(), budgets.end(), [](const SceneBudget& budget) { return !budget.IsFromThisMachine(); });
+		if (otherMachine > 0)
+			std::cout << otherMachine << " budget(s) were measured with another thread count or SIMD level than " << std::thread::hardware_concurrency()
+				<< " and " << SimdLevelName(ActiveSimdKernels().level) << ", their times are not checked\n";
+		return true;
+	}
+
+	// Before an update: the budgets already in the file, which the scenes updated replace. Budgets at another scale
+	// than the update's are dropped, as their references no longer match the file's scale.
+	void keepOtherBudgets(std::vector<SceneBudget>& budgets)
+	{
+		if (loadBudgets(budgets) != BudgetsStatus::OK)
+		{
+			budgets.clear();
+			return;
+		}
+		if (budgetScale != options.scale && !budgets.empty())
+		{
+			std::cout << "Dropping the " << budgets.size() << " budget(s) at " << budgetScale << "x resolution in " << budgetsFileName() << '\n';
+			budgets.clear();
+		}
+
+	}
+
+	void writeBudgets(const std::vector<SceneBudget>& budgets) const
+	{
+		using namespace rapidjson;
+		StringBuffer buffer;
+		PrettyWriter<StringBuffer> writer(buffer);
+		writer.StartObject();
+		writer.Key("version");
+		writer.Uint(2);
+		writer.Key("scale");
+		writer.Double(options.scale);
+		writer.Key("scenes");
+		writer.StartArray();
+		for (const auto& budget : budgets)
+		{
+			writer.StartObject();
+			writer.Key("name");
+			writer.String(budget.name.c_str());
+			writer.Key("load_seconds");
+			writer.Double(budget.loadSeconds);
+			writer.Key("render_seconds");
+			writer.Double(budget.renderSeconds);
+			writer.Key("threads");
+			writer.Uint(budget.threads);
+			writer.Key("simd_level");
+			writer.String(budget.simdLevel.c_str());
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.EndObject();
+
+		std::ofstream ofs(budgetsFileName(), std::ios::out | std::ios::trunc);
+		if (!ofs.is_open())
+		{
+			std::cout << "Failed to write " << budgetsFileName() << '\n';
+			return;
+		}
+		ofs << buffer.GetString() << '\n';
+		std::cout << "References written to " << options.referenceDirectory << '\n';
+	}
+
+	Options options;
+	float budgetScale = 1.f;
+};
@@ -0,0 +1,530 @@
+#pragma once
+
+#include "CommandLine.hpp"
+#include "DistributedRender.hpp"
+#include "MappedFile.hpp"
+#include "Parallel.hpp"
+#include "Renderer.hpp"
+#include "Scene.hpp"
+#include "Socket.hpp"
+
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Loaded scenes, least recently used first out. Scenes are keyed by the hash of their file, so an edited file is
+// loaded again and copies of one file share an entry. A scene is loaded once even when several requests ask for it
+// at the same time; an evicted scene lives on until the last request rendering it is done.
+class SceneCache
+{
+public:
+	explicit SceneCache(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+	// nullptr when the file cannot be read. hit tells whether the scene was cached already. Throws what the Scene
+	// constructor throws, SceneLoadError for a file that is not a valid scene; the failed load is not cached, so
+	// the next request for the file tries again.
+	std::shared_ptr<const Scene> Get(const std::string& fileName, bool& hit)
+	{
+		uint64_t hash;
+		{
+			const MappedFile file(fileName);
+			if (!file.IsOpen())
+				return nullptr;
+			hash = HashBytes(file.Data(), file.Size());
+		}
+
+		std::promise<std::shared_ptr<const Scene>> loaded;
+		std::shared_future<std::shared_ptr<const Scene>> scene;
+		uint64_t id = 0;
+		{
+			std::lock_guard lock(mutex);
+			const auto it = index.find(hash);
+			hit = it != index.end();
+			if (hit)
+			{
+				entries.splice(entries.begin(), entries, it->second);
+				scene = it->second->scene;
+			}
+			else
+			{
+				scene = loaded.get_future().share();
+				id = nextId++;
+				entries.push_front({ hash, id, scene });
+				index[hash] = entries.begin();
+				if (entries.size() > capacity)
+				{
+					index.erase(entries.back().hash);
+					entries.pop_back();
+				}
+			}
+		}
+
+		if (!hit)
+		{
+			try
+			{
+				loaded.set_value(std::make_shared<const Scene>(fileName));
+			}
+			catch (...)
+			{
+				// Requests already waiting for this load get the error as well
+				loaded.set_exception(std::current_exception());
+				std::lock_guard lock(mutex);
+				const auto it = index.find(hash);
+				if (it != index.end() && it->second->id == id)
+				{
+					entries.erase(it->second);
+					index.erase(it);
+				}
+			}
+		}
+		return scene.get();
+	}
+
+private:
+	struct Entry
+	{
+		uint64_t hash;
+		uint64_t id;	// Tells a new entry for the same file from an evicted one
+		std::shared_future<std::shared_ptr<const Scene>> scene;
+	};
+
+	size_t capacity;
+	std::mutex mutex;
+	std::list<Entry> entries;	// Most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+	uint64_t nextId = 0;
+};
+
+// Long-lived renderer on a local socket, for clients that send many small renders of the same scenes. Every
+// connection may send any number of requests, one after the other; connections are served concurrently and their
+// renders share one thread pool. Clients can only name .crtscene files under the scene root directory. A request
+// is a JSON object, everything but the scene optional:
+//   { "scene": "scene2.crtscene",
+//     "width": 320, "height": 180,
+//     "camera": { "matrix": [9 numbers], "position": [x, y, z], "projection": "pinhole", "orthographic_height": 2,
+//                 "aperture_radius": 0.1, "focus_distance": 5 },
+//     "lights": [ { "intensity": 1000, "position": [x, y, z] } ],
+//     "deadline_ms": 50 }
+// with the keys of the .crtscene format; the lights replace those of the scene. The deadline counts from the
+// arrival of the request, scene loading included; a render that runs out of time answers with what it has, see
+// Renderer::Render(job). The messages are those of render_protocol: REQUEST carries the JSON text, RESPONSE a
+// uint32_t size, a JSON status of that size and then the image as PPM text, as Renderer::WriteToFile() writes it.
+// Images are limited to what fits in one message, kMaxImagePixels, which is about 22 million pixels.
+// The status is
+//   { "ok": true, "width", "height", "cache_hit", "load_ms", "render_ms",
+//     "status": "complete" | "deadline", "coverage", "preview_coverage" }   (fractions of the rows)
+// or { "ok": false, "error": "..." }
+class RenderServer
+{
+public:
+	struct Options
+	{
+		std::string socketPath = "crt_render.sock";
+		std::string sceneRoot = ".";	// Scene paths of requests are relative to it and may not leave it
+		size_t cacheSize = 8;			// Scenes kept loaded
+		uint32_t threadCount = 0;		// Of the pool, 0 for hardware_concurrency()
+		uint32_t deadlineMs = 0;		// For requests without a deadline of their own, 0 for none
+	};
+
+	// Command line: --server [--socket PATH] [--scene-root DIR] [--cache-size N] [--threads N] [--deadline MS]
+	static bool ParseArguments(const std::vector<std::string>& arguments, Options& options)
+	{
+		for (size_t i = 1; i < arguments.size(); ++i)
+		{
+			const std::string& argument = arguments[i];
+			const bool hasValue = i + 1 < arguments.size();
+			if (argument == "--socket" && hasValue)
+				options.socketPath = arguments[++i];
+			else if (argument == "--scene-root" && hasValue)
+				options.sceneRoot = arguments[++i];
+			else if (argument == "--cache-size" && hasValue)
+			{
+				if (!ParseFlagNumber("--cache-size", arguments[++i], "N", options.cacheSize))
+					return false;
+				options.cacheSize = std::max<size_t>(1, options.cacheSize);
+			}
+			else if (argument == "--threads" && hasValue)
+			{
+				if (!ParseFlagNumber("--threads", arguments[++i], "N", options.threadCount))
+					return false;
+			}
+			else if (argument == "--deadline" && hasValue)
+			{
+				if (!ParseFlagNumber("--deadline", arguments[++i], "MS", options.deadlineMs))
+					return false;
+			}
+			else
+			{
+				std::cout << "Unknown server option: " << argument << '\n';
+				return false;
+			}
+		}
+		return true;
+	}
+
+	explicit RenderServer(const Options& options) : options(options), pool(options.threadCount), scenes(options.cacheSize) {}
+
+	// Serves until the process is stopped. Returns the exit code if the socket cannot be opened.
+	int Run()
+	{
+		std::error_code error;
+		sceneRoot = std::filesystem::canonical(options.sceneRoot, error);
+		if (error || !std::filesystem::is_directory(sceneRoot))
+		{
+			std::cout << "No scene root directory " << options.sceneRoot << '\n';
+			return 1;
+		}
+
+		const Socket listener = Socket::ListenLocal(options.socketPath);
+		if (!listener.IsOpen())
+		{
+			std::cout << "Failed to listen on " << options.socketPath << '\n';
+			return 1;
+		}
+		std::cout << "Render server on " << options.socketPath << ", scenes from " << sceneRoot.string() << ", " << pool.GetThreadCount() << " threads, "
+			<< options.cacheSize << " cached scenes" << std::endl;
+
+		std::list<Connection> connections;
+		for (;;)
+		{
+			std::erase_if(connections, [](const Connection& connection) { return connection.finished->load(); });
+
+			Socket socket = listener.Accept(1000);
+			if (!socket.IsOpen())
+				continue;
+			Connection& connection = connections.emplace_back();
+			connection.finished = std::make_shared<std::atomic<bool>>(false);
+			connection.thread = std::jthread([this, socket = std::move(socket), finished = connection.finished]() mutable
+				{
+					serve(socket);
+					finished->store(true);
+				});
+		}
+	}
+
+protected:
+	struct Connection
+	{
+		std::shared_ptr<std::atomic<bool>> finished;
+		std::jthread thread;
+	};
+
+	void serve(Socket& socket)
+	{
+		using namespace render_protocol;
+		MessageType type;
+		std::vector<char> payload;
+		while (ReadMessage(socket, type, payload) && type == MessageType::REQUEST)
+		{
+			// Nothing may leave the connection's thread, which would end the server
+			std::string image;
+			std::string status;
+			try
+			{
+				status = render(std::string(payload.begin(), payload.end()), image);
+			}
+			catch (const std::exception& error)
+			{
+				image.clear();
+				status = errorStatus(error.what());
+			}
+			if (sizeof(uint32_t) + status.size() + image.size() > kMaxPayload)
+			{
+				image.clear();
+				status = errorStatus("the reply is too large");
+			}
+			const uint32_t statusSize = static_cast<uint32_t>(status.size());
+			std::string response(reinterpret_cast<const char*>(&statusSize), sizeof(statusSize));
+			response += status;
+			response += image;
+			if (!WriteMessage(socket, MessageType::RESPONSE, response.data(), response.size()))
+				break;
+		}
+	}
+
+	// Returns the status and fills image on success
+	std::string render(const std::string& request, std::string& image)
+	{
+		using namespace rapidjson;
+		Document doc;
+		doc.Parse(request.c_str());
+		if (doc.HasParseError() || !doc.IsObject())
+			return errorStatus("the request is not a JSON object");
+		const auto sceneIt = doc.FindMember("scene");
+		if (sceneIt == doc.MemberEnd() || !sceneIt->value.IsString())
+			return errorStatus("no scene");
+
+		const auto loadStart = std::chrono::steady_clock::now();
+		Renderer::Job job;
+		if (options.deadlineMs)
+			job.deadline = loadStart + std::chrono::milliseconds(options.deadlineMs);
+		const auto deadlineIt = doc.FindMember("deadline_ms");
+		if (deadlineIt != doc.MemberEnd())
+		{
+			if (!deadlineIt->value.IsNumber() || deadlineIt->value.GetDouble() <= 0.0 || deadlineIt->value.GetDouble() > kMaxDeadlineMs)
+				return errorStatus("invalid deadline_ms");
+			job.deadline = loadStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(deadlineIt->value.GetDouble()));
+		}
+
+		const std::string sceneName = sceneIt->value.GetString();
+		std::string sceneFile;
+		if (!resolveScenePath(sceneName, sceneFile))
+			return errorStatus("no scene " + sceneName + " under the scene root");
+		bool hit = false;
+		std::shared_ptr<const Scene> scene;
+		try
+		{
+			scene = scenes.Get(sceneFile, hit);
+		}
+		catch (const SceneLoadError& error)
+		{
+			return errorStatus("cannot load " + sceneName + ": " + error.what());
+		}
+		if (!scene)
+			return errorStatus("cannot read " + sceneName);
+		const auto loadEnd = std::chrono::steady_clock::now();
+
+		Renderer renderer(*scene);
+		Renderer::View view = renderer.GetView();
+		std::string error;
+		if (!applyOverrides(doc, view, error))
+			return errorStatus(error);
+		renderer.SetView(std::move(view));
+		renderer.SetThreadPool(&pool);
+		job.preview = job.deadline != Renderer::Job{}.deadline;	// Only worth its time when the render may be cut short
+		const Renderer::JobResult result = renderer.Render(job);
+		const auto renderEnd = std::chrono::steady_clock::now();
+		image = Renderer::EncodeImage(result.image);
+
+		StringBuffer buffer;
+		Writer<StringBuffer> writer(buffer);
+		writer.StartObject();
+		writer.Key("ok");
+		writer.Bool(true);
+		writer.Key("width");
+		writer.Uint(result.image.GetWidth());
+		writer.Key("height");
+		writer.Uint(result.image.GetHeight());
+		writer.Key("cache_hit");
+		writer.Bool(hit);
+		writer.Key("load_ms");
+		writer.Double(std::chrono::duration<double, std::milli>(loadEnd - loadStart).count());
+		writer.Key("render_ms");
+		writer.Double(std::chrono::duration<double, std::milli>(renderEnd - loadEnd).count());
+		writer.Key("status");
+		writer.String(Renderer::StatusName(result.coverage.status));
+		writer.Key("coverage");
+		writer.Double(result.coverage.fullFraction);
+		writer.Key("preview_coverage");
+		writer.Double(result.coverage.previewFraction);
+		writer.EndObject();
+		return buffer.GetString();
+	}
+
+	// Canonical path of a scene file the client asked for: a .crtscene regular file under the scene root, where
+	// relative paths start. The client is another process, so it gets nothing else, symbolic links included.
+	bool resolveScenePath(const std::string& requested, std::string& sceneFile) const
+	{
+		std::error_code error;
+		const std::filesystem::path path = std::filesystem::canonical(sceneRoot / std::filesystem::path(requested), error);
+		if (error || !std::filesystem::is_regular_file(path, error) || path.extension() != ".crtscene")
+			return false;
+		const auto [rootEnd, pathEnd] = std::mismatch(sceneRoot.begin(), sceneRoot.end(), path.begin(), path.end());
+		if (rootEnd != sceneRoot.end())
+			return false;
+		sceneFile = path.string();
+		return true;
+	}
+
+	// The request comes from another process, so, like its scene path, it is checked rather than trusted
+	static bool applyOverrides(const rapidjson::Value& request, Renderer::View& view, std::string& error)
+	{
+		using namespace rapidjson;
+		auto readFloats = [](const Value& object, const char* name, float* values, SizeType count)
+			{
+				const auto it = object.FindMember(name);
+				if (it == object.MemberEnd())
+					return true;
+				if (!it->value.IsArray() || it->value.Size() != count)
+					return false;
+				for (SizeType i = 0; i < count; ++i)
+				{
+					if (!it->value[i].IsNumber())
+						return false;
+					values[i] = it->value[i].GetFloat();
+				}
+				return true;
+			};
+
+		for (const char* name : { "width", "height" })
+		{
+			const auto it = request.FindMember(name);
+			if (it == request.MemberEnd())
+				continue;
+			if (!it->value.IsUint() || it->value.GetUint() == 0 || it->value.GetUint() > kMaxImageSize)
+			{
+				error = std::string("invalid ") + name;
+				return false;
+			}
+			(name[0] == 'w' ? view.settings.imageSettings.width : view.settings.imageSettings.height) = it->value.GetUint();
+		}
+
+		// Also for the size of the scene file: the image goes back as PPM text in one message
+		const Scene::ImageSettings& imageSettings = view.settings.imageSettings;
+		if (imageSettings.width == 0 || imageSettings.height == 0 || imageSettings.width > kMaxImageSize || imageSettings.height > kMaxImageSize)
+		{
+			error = "invalid image size";
+			return false;
+		}
+		if (uint64_t(imageSettings.width) * imageSettings.height > kMaxImagePixels)
+		{
+			error = "the image is too large for a reply: at most " + std::to_string(kMaxImagePixels) + " pixels";
+			return false;
+		}
+
+		const auto cameraIt = request.FindMember("camera");
+		if (cameraIt != request.MemberEnd())
+		{
+			const Value& camera = cameraIt->value;
+			float matrix[9], position[3];
+			const bool hasMatrix = camera.IsObject() && camera.HasMember("matrix");
+			const bool hasPosition = camera.IsObject() && camera.HasMember("position");
+			if (!camera.IsObject() || !readFloats(camera, "matrix", matrix, 9) || !readFloats(camera, "position", position, 3))
+			{
+				error = "invalid camera";
+				return false;
+			}
+
+			// Like the scene files: rotation from the matrix, translation from the position
+			Matrix4 rotation = Matrix4::Identity();
+			Vector3 translation = view.camera.GetPosition();
+			for (uint32_t i = 0; i < 3; ++i)
+			{
+				for (uint32_t j = 0; j < 3; ++j)
+					rotation(i, j) = hasMatrix ? matrix[i + 3 * j] : view.camera.transform(i, j);
+			}
+			if (hasPosition)
+				translation = Vector3(position[0], position[1], position[2]);
+			view.camera.transform = MakeTranslation(translation) * rotation;
+
+			const auto projectionIt = camera.FindMember("projection");
+			if (projectionIt != camera.MemberEnd())
+			{
+				const std::string projection = projectionIt->value.IsString() ? projectionIt->value.GetString() : "";
+				if (projection == "pinhole")
+					view.camera.projection = Camera::Projection::PINHOLE;
+				else if (projection == "orthographic")
+					view.camera.projection = Camera::Projection::ORTHOGRAPHIC;
+				else if (projection == "thin_lens")
+					view.camera.projection = Camera::Projection::THIN_LENS;
+				else
+				{
+					error = "invalid camera projection";
+					return false;
+				}
+			}
+			if (!readFloat(camera, "orthographic_height", view.camera.orthographicHeight) || !readFloat(camera, "aperture_radius", view.camera.apertureRadius)
+				|| !readFloat(camera, "focus_distance", view.camera.focusDistance))
+			{
+				error = "invalid camera parameter";
+				return false;
+			}
+		}
+
+		const auto lightsIt = request.FindMember("lights");
+		if (lightsIt != request.MemberEnd())
+		{
+			if (!lightsIt->value.IsArray())
+			{
+				error = "invalid lights";
+				return false;
+			}
+			view.lights.clear();
+			for (const auto& lightValue : lightsIt->value.GetArray())
+			{
+				float position[3];
+				Light light{};
+				if (!lightValue.IsObject() || !lightValue.HasMember("intensity") || !lightValue["intensity"].IsNumber()
+					|| !lightValue.HasMember("position") || !readFloats(lightValue, "position", position, 3))
+				{
+					error = "invalid light";
+					return false;
+				}
+				light.intensity = lightValue["intensity"].GetFloat() * 0.1f; // Scaled like the lights of the scene files
+				light.position = Vector3(position[0], position[1], position[2]);
+				view.lights.push_back(light);
+			}
+		}
+		return true;
+	}
+
+	// Leaves value alone when the member is missing; false when it is not a number
+	static bool readFloat(const rapidjson::Value& object, const char* name, float& value)
+	{
+		const auto it = object.FindMember(name);
+		if (it == object.MemberEnd())
+			return true;
+		if (!it->value.IsNumber())
+			return false;
+		value = it->value.GetFloat();
+		return true;
+	}
+
+	static std::string errorStatus(const std::string& message)
+	{
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		writer.StartObject();
+		writer.Key("ok");
+		writer.Bool(false);
+		writer.Key("error");
+		writer.String(message.c_str());
+		writer.EndObject();
+		return buffer.GetString();
+	}
+
+	static constexpr uint32_t kMaxImageSize = 16384;
+	// Pixels whose PPM text, at most 12 bytes a pixel ("255 255 255\t") and a newline a row, fits in a RESPONSE along
+	// with the status
+	static constexpr uint64_t kMaxImagePixels = (render_protocol::kMaxPayload - kMaxImageSize - 64 * 1024) / 12;
+	static constexpr double kMaxDeadlineMs = 24.0 * 3600.0 * 1000.0;
+
+	Options options;
+	std::filesystem::path sceneRoot;	// Canonical
+	ThreadPool pool;
+	SceneCache scenes;
+};
+
+// Sends one request to a render server; returns false if the server could not be reached
+inline bool SendRenderRequest(const std::string& socketPath, const std::string& request, std::string& status, std::string& image)
+{
+	using namespace render_protocol;
+	Socket socket = Socket::ConnectLocal(socketPath);
+	MessageType type;
+	std::vector<char> payload;
+	uint32_t statusSize = 0;
+	if (!WriteMessage(socket, MessageType::REQUEST, request.data(), request.size()) || !ReadMessage(socket, type, payload)
+		|| type != MessageType::RESPONSE || payload.size() < sizeof(statusSize))
+		return false;
+
+	std::memcpy(&statusSize, payload.data(), sizeof(statusSize));
+	if (payload.size() < sizeof(statusSize) + statusSize)
+		return false;
+	status.assign(payload.data() + sizeof(statusSize), statusSize);
+	image.assign(payload.data() + sizeof(statusSize) + statusSize, payload.data() + payload.size());
+	return true;
+}
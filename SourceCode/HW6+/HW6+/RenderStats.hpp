@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// Build with RENDER_STATS defined to 0 to compile every counter out; the counting functions are then empty
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+
+constexpr bool kRenderStatsEnabled = RENDER_STATS != 0;
+
+// Where the rays of a frame went. Every render thread counts into its own copy (ThreadRenderStats()), and the
+// renderer merges the copies once the frame is done.
+struct RenderStats
+{
+	uint64_t primaryRays = 0;
+	uint64_t shadowRays = 0;
+	uint64_t reflectionRays = 0;
+	uint64_t refractionRays = 0;
+	uint64_t triangleTests = 0;
+	uint64_t boxTests = 0;
+	uint64_t hits = 0;			// Rays that hit something: closest hits found and shadow rays blocked
+	uint32_t maxDepth = 0;		// Deepest recursion of TraceRay(), 0 for primary rays only
+
+	uint64_t TotalRays() const { return primaryRays + shadowRays + reflectionRays + refractionRays; }
+
+	void Merge(const RenderStats& other)
+	{
+		primaryRays += other.primaryRays;
+		shadowRays += other.shadowRays;
+		reflectionRays += other.reflectionRays;
+		refractionRays += other.refractionRays;
+		triangleTests += other.triangleTests;
+		boxTests += other.boxTests;
+		hits += other.hits;
+		maxDepth = std::max(maxDepth, other.maxDepth);
+	}
+
+	void Print(const std::string& title, double seconds) const
+	{
+		const std::ios_base::fmtflags flags = std::cout.flags();
+		const std::streamsize precision = std::cout.precision();
+		const uint64_t totalRays = TotalRays();
+		std::cout << title << ": " << totalRays << " rays";
+		if (seconds > 0.0)
+			std::cout << " in " << std::fixed << std::setprecision(3) << seconds << " s (" << std::setprecision(2) << totalRays / seconds / 1e6 << " Mrays/s)";
+		std::cout << '\n'
+			<< "  primary " << primaryRays << ", shadow " << shadowRays << ", reflection " << reflectionRays << ", refraction " << refractionRays << '\n'
+			<< "  triangle tests " << triangleTests << " (" << std::setprecision(1) << (totalRays ? static_cast<double>(triangleTests) / totalRays : 0.0) << " per ray)"
+			<< ", box tests " << boxTests << ", hits " << hits << ", max depth " << maxDepth << '\n';
+		std::cout.flags(flags);
+		std::cout.precision(precision);
+	}
+};
+
+inline RenderStats& ThreadRenderStats()
+{
+	static thread_local RenderStats stats;
+	return stats;
+}
+
+// Adds count to one counter of the calling thread
+inline void CountRenderStat(uint64_t RenderStats::* counter, uint64_t count = 1)
+{
+	if constexpr (kRenderStatsEnabled)
+		ThreadRenderStats().*counter += count;
+}
+
+inline void RecordRenderDepth(uint32_t depth)
+{
+	if constexpr (kRenderStatsEnabled)
+		ThreadRenderStats().maxDepth = std::max(ThreadRenderStats().maxDepth, depth);
+}
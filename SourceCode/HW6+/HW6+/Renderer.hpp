@@ -1,152 +1,813 @@
 #pragma once
 
+#include "CameraRays.hpp"
+#include "Denoiser.hpp"
 #include "Math3D.hpp"
+#include "Parallel.hpp"
 #include "PPMWriter.hpp"
+#include "RenderStats.hpp"
 #include "Scene.hpp"
+#include "ShadowMaps.hpp"
+#include "Trace.hpp"
 #include <thread>
 #include <mutex>
 #include <barrier>
 #include <utility>
-
+#include <array>
+#include <chrono>
+#include <functional>
+#include <stop_token>
+#include <algorithm>
+
+// Framebuffer stored in tiles of kTileSize x kTileSize pixels, row of tiles after row of tiles. A tile is three
+// whole cache lines, so threads that render whole tiles never write to the same line; in a row-major buffer the
+// threads rendering neighbouring bands would share the lines where the bands meet. Tiles at the right and bottom
+// edges are padded. Readers that want the pixels in scanline order, such as the image encoders, use ToScanlines().
 class Image
 {
 public:
-    Image(uint32_t width, uint32_t height) : width(width), height(height)
+    static constexpr uint32_t kTileSize = 8;
+
+    Image(uint32_t width, uint32_t height) : width(width), height(height), tilesPerRow((width + kTileSize - 1) / kTileSize)
     {
-        pixels.resize(width * height);
+        tiles.resize(size_t(tilesPerRow) * ((height + kTileSize - 1) / kTileSize));
     }
 
     void SetPixel(uint32_t x, uint32_t y, const RGB& color)
     {
-        pixels[y * width + x] = color;
+        tiles[tileIndex(x, y)].pixels[pixelIndex(x, y)] = color;
     }
 
     const RGB& GetPixel(uint32_t x, uint32_t y) const
     {
-        return pixels[y * width + x];
+        return tiles[tileIndex(x, y)].pixels[pixelIndex(x, y)];
     }
 
     uint32_t GetWidth() const { return width; }
     uint32_t GetHeight() const { return height; }
 
+    // The pixels row by row, copied a tile row at a time
+    std::vector<RGB> ToScanlines() const
+    {
+        std::vector<RGB> scanlines(size_t(width) * height);
+        for (uint32_t tileY = 0; tileY < height; tileY += kTileSize)
+        {
+            for (uint32_t tileX = 0; tileX < width; tileX += kTileSize)
+            {
+                const Tile& tile = tiles[tileIndex(tileX, tileY)];
+                const uint32_t columns = std::min(kTileSize, width - tileX);
+                for (uint32_t y = 0; y < std::min(kTileSize, height - tileY); ++y)
+                    std::copy_n(tile.pixels + y * kTileSize, columns, scanlines.begin() + size_t(tileY + y) * width + tileX);
+            }
+        }
+        return scanlines;
+    }
+
 private:
+    struct alignas(64) Tile
+    {
+        RGB pixels[kTileSize * kTileSize];
+    };
+    static_assert(sizeof(Tile) % 64 == 0, "tiles must not share cache lines");
+
+    size_t tileIndex(uint32_t x, uint32_t y) const
+    {
+        return size_t(y / kTileSize) * tilesPerRow + x / kTileSize;
+    }
+
+    static uint32_t pixelIndex(uint32_t x, uint32_t y)
+    {
+        return (y % kTileSize) * kTileSize + x % kTileSize;
+    }
+
     uint32_t width, height;
-    std::vector<RGB> pixels;
+    uint32_t tilesPerRow;
+    std::vector<Tile> tiles;
 };
 
 class Renderer
 {
 public:
-    Renderer(Scene& scene) : scene(scene) {}
+    // Per pixel cost shown by the heatmap
+    enum class HeatmapMetric
+    {
+        NONE,
+        RAYS,               // Rays traced for the pixel, secondary and shadow rays included
+        TRAVERSAL_STEPS,    // Box and triangle tests
+        TRIANGLE_TESTS,
+        TIME                // Nanoseconds spent on the pixel
+    };
+
+    static const char* HeatmapMetricName(HeatmapMetric metric)
+    {
+        switch (metric)
+        {
+        case HeatmapMetric::RAYS: return "rays";
+        case HeatmapMetric::TRAVERSAL_STEPS: return "steps";
+        case HeatmapMetric::TRIANGLE_TESTS: return "triangles";
+        case HeatmapMetric::TIME: return "time";
+        default: return "none";
+        }
+    }
+
+    // What a render may change without touching the scene's geometry and materials
+    struct View
+    {
+        Camera camera;
+        std::vector<Light> lights;
+        Scene::Settings settings;
+    };
+
+    // Where a Render(job) is
+    struct Progress
+    {
+        uint32_t tilesDone;         // At full resolution
+        uint32_t tileCount;
+        double elapsedSeconds;
+        double remainingSeconds;    // From the mean time of the tiles done so far
+    };
+
+    // Bounds on a Render(job). The render threads check them before every tile of tileRows rows, so a render stops
+    // within one tile per thread of the request; the denoiser still runs on a finished image.
+    struct Job
+    {
+        std::stop_token stopToken;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        std::function<void(const Progress&)> onProgress;    // After every tile, one call at a time, from the render threads
+        bool preview = true;    // Trace one pixel of every 16 x 16, then of every 4 x 4 pixels first, so a render
+                                // stopped early still has every pixel
+    };
+
+    // How much of the image a Render(job) traced before it stopped
+    struct Coverage
+    {
+        enum class Status
+        {
+            COMPLETE,
+            CANCELLED,
+            DEADLINE
+        };
+
+        enum TileLevel : uint8_t
+        {
+            NOT_TRACED,
+            COARSE_PREVIEW,     // One pixel of every 16 x 16
+            PREVIEW,            // One pixel of every 4 x 4
+            FULL
+        };
+
+        Status status = Status::COMPLETE;
+        uint32_t tileRows = 0;              // Tile i is rows [i * tileRows, (i + 1) * tileRows) of the image
+        std::vector<uint8_t> tileLevels;    // TileLevel of every tile
+        uint32_t tilesDone = 0;             // At full resolution
+        double fullFraction = 0.0;          // Of the pixels, traced at full resolution
+        double previewFraction = 0.0;       // Of the pixels, only covered by one of the previews
+        double seconds = 0.0;
+    };
+
+    struct JobResult
+    {
+        Image image;
+        Coverage coverage;
+    };
+
+    static const char* StatusName(Coverage::Status status)
+    {
+        switch (status)
+        {
+        case Coverage::Status::CANCELLED: return "cancelled";
+        case Coverage::Status::DEADLINE: return "deadline";
+        default: return "complete";
+        }
+    }
+
+    // With specialize off, every scene goes through the variant with all features, as a baseline for benchmarks.
+    // The renderer only reads the scene, so several renderers can share one; the view starts as the scene's.
+    Renderer(const Scene& scene, bool specialize = true)
+        : scene(scene), specialize(specialize), view{ scene.camera, scene.lights, scene.settings } {}
+
+    const View& GetView() const { return view; }
+    void SetView(View newView) { view = std::move(newView); }
 
     void RenderImage()
     {
-        Scene::Settings sceneSettings = scene.settings;
+        const auto start = std::chrono::steady_clock::now();
+        const Image image = Render();
+        const auto end = std::chrono::steady_clock::now();
+        if constexpr (kRenderStatsEnabled)
+            stats.Print(view.settings.sceneName, std::chrono::duration<double>(end - start).count());
+        WriteToFile(image, view.settings);
+        WriteHeatmap();
+    }
+
+    // Render() also records the cost of every pixel, and RenderImage() writes it next to the image with
+    // WriteHeatmap(). The counting metrics need the render statistics; without them TIME is used.
+    void SetHeatmapMetric(HeatmapMetric metric)
+    {
+        if (!kRenderStatsEnabled && metric != HeatmapMetric::NONE && metric != HeatmapMetric::TIME)
+        {
+            std::cout << "Built without RENDER_STATS, the heatmap shows time instead\n";
+            metric = HeatmapMetric::TIME;
+        }
+        heatmapMetric = metric;
+    }
+
+    // Cost of every pixel of the last Render(), row by row; empty without a heatmap metric
+    const std::vector<float>& GetPixelCosts() const { return pixelCosts; }
+
+    // Writes the costs of the last Render() as <scene>_heatmap_<metric>.ppm, mapped to a black - blue - cyan - green -
+    // yellow - red - white ramp; nothing without a heatmap metric or after a RenderRegion(). The top of the ramp is the 99th percentile, so a
+    // few extreme pixels do not leave the rest of the map dark. After a Render(job) that stopped early, only the
+    // tiles traced at full resolution have costs, the rest is black.
+    void WriteHeatmap()
+    {
+        const uint32_t imageWidth = view.settings.imageSettings.width;
+        const uint32_t imageHeight = view.settings.imageSettings.height;
+        if (pixelCosts.empty() || pixelCosts.size() != size_t(imageWidth) * imageHeight)
+            return;
+
+        std::vector<float> sorted = pixelCosts;
+        const size_t percentile = (sorted.size() - 1) * 99 / 100;
+        std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+        const float top = std::max(sorted[percentile], 1e-6f);
+
+        static const Vector3 ramp[] = {
+            { 0.f, 0.f, 0.f }, { 0.f, 0.f, 1.f }, { 0.f, 1.f, 1.f }, { 0.f, 1.f, 0.f }, { 1.f, 1.f, 0.f }, { 1.f, 0.f, 0.f }, { 1.f, 1.f, 1.f }
+        };
+        constexpr size_t segments = std::size(ramp) - 1;
+
+        Image heatmap(imageWidth, imageHeight);
+        for (uint32_t rowIdx = 0; rowIdx < imageHeight; ++rowIdx)
+        {
+            for (uint32_t colIdx = 0; colIdx < imageWidth; ++colIdx)
+            {
+                const float value = std::clamp(pixelCosts[size_t(rowIdx) * imageWidth + colIdx] / top, 0.f, 1.f) * segments;
+                const size_t segment = std::min(static_cast<size_t>(value), segments - 1);
+                const float t = value - segment;
+                heatmap.SetPixel(colIdx, rowIdx, (ramp[segment] * (1.f - t) + ramp[segment + 1] * t).ToRGB());
+            }
+        }
+
+        const std::string fileName = view.settings.sceneName + "_heatmap_" + HeatmapMetricName(heatmapMetric);
+        writeImage(heatmap, fileName);
+        std::cout << "  heatmap " << fileName << ".ppm: white at " << top << (heatmapMetric == HeatmapMetric::TIME ? " ns" : "") << " per pixel\n";
+    }
+
+    // Counters of the last Render(), all zero when built with RENDER_STATS 0
+    const RenderStats& GetStats() const { return stats; }
+
+    // Primary rays averaged per pixel; 1 traces the pixel centers only
+    void SetSamplesPerPixel(uint32_t samples) { samplesPerPixel = std::max(samples, 1u); }
+
+    // Render() collects the normal, depth and albedo of the first hit of every pixel along with its radiance and
+    // runs the denoiser over them before the radiance becomes 8 bit color. RenderRegion() only filters within its
+    // region, so the pixels near region borders differ from the denoised full image.
+    void SetDenoiser(bool enabled, const Denoiser::Options& options = {})
+    {
+        denoise = enabled;
+        denoiserOptions = options;
+    }
+
+    // Time the denoiser took in the last Render()
+    double GetDenoiseSeconds() const { return denoiseSeconds; }
+
+    // Threads of Render(), 0 for hardware_concurrency()
+    void SetThreadCount(uint32_t count) { threadCount = count; }
+
+    // On, Render() tests the shadow rays of a strip of rows after tracing its pixels: the rays toward each light
+    // go in packets of neighbouring pixels that cross the hierarchy together. Off, every shading point tests its
+    // own shadow rays as it is shaded. The heatmap always does the latter, to charge every pixel its own rays.
+    void SetShadowBatching(bool enabled) { batchShadows = enabled; }
+
+    // Preview shadows: with a resolution above 0, the shadow rays are replaced by lookups into depth cube maps of
+    // that many texels a side per face, built for the lights of the view by the first render that needs them.
+    // Shadow edges move by up to a texel or two and thin occluders may let light through; reflection and refraction
+    // are traced as always. 0 goes back to exact shadows; resolutions above ShadowCubeMaps::kMaxResolution are
+    // clamped to it.
+    void SetShadowMapResolution(uint32_t resolution) { shadowMapResolution = resolution; }
+
+    // The maps of the last render with preview shadows, empty if none has been rendered
+    const ShadowCubeMaps& GetShadowMaps() const { return shadowMaps; }
+
+    // How long the render that last built the maps spent on it, 0 if none has
+    double GetShadowMapBuildSeconds() const { return shadowMapBuildSeconds; }
+
+    // Renders on the threads of pool instead of threads of its own, nullptr to go back to those
+    void SetThreadPool(ThreadPool* pool) { threadPool = pool; }
+
+    // Time every thread of the last Render() spent on its rows; the rest of the frame it waited for the others.
+    // Empty when rendering on a thread pool.
+    const std::vector<double>& GetThreadBusySeconds() const { return threadBusySeconds; }
+
+    // Traces the image without writing it
+    Image Render()
+    {
+        return RenderRegion(0, 0, view.settings.imageSettings.width, view.settings.imageSettings.height);
+    }
+
+    // Render() that can be cancelled and given a deadline. A stopped render returns the best image it has: tiles
+    // at full resolution, the finest preview elsewhere, black where not even the coarse preview got traced.
+    JobResult Render(const Job& job)
+    {
+        Coverage coverage;
+        Image image = renderRegion(0, 0, view.settings.imageSettings.width, view.settings.imageSettings.height, &job, &coverage);
+        return { std::move(image), std::move(coverage) };
+    }
+
+    // Traces the pixels of one rectangle of the image; the result is that rectangle only, with the same pixels
+    // Render() gives it
+    Image RenderRegion(uint32_t firstColumn, uint32_t firstRow, uint32_t regionWidth, uint32_t regionHeight)
+    {
+        return renderRegion(firstColumn, firstRow, regionWidth, regionHeight, nullptr, nullptr);
+    }
+
+
+    // The image as WriteToFile() writes it, for sending it elsewhere
+    static std::string EncodeImage(const Image& image)
+    {
+        std::string text = "P3\n" + std::to_string(image.GetWidth()) + " " + std::to_string(image.GetHeight()) + "\n" + std::to_string(maxColorComponent) + "\n";
+        text.reserve(text.size() + size_t(image.GetWidth()) * image.GetHeight() * 12);
+        const std::vector<RGB> pixels = image.ToScanlines();
+        for (uint32_t rowIdx = 0; rowIdx < image.GetHeight(); ++rowIdx)
+        {
+            for (uint32_t colIdx = 0; colIdx < image.GetWidth(); ++colIdx)
+            {
+                text += pixels[size_t(rowIdx) * image.GetWidth() + colIdx].ToString();
+                text += '\t';
+            }
+            text += '\n';
+        }
+        return text;
+    }
+
+    void WriteToFile(const Image& image, const Scene::Settings& sceneSettings)
+    {
+        TraceScope trace("write image", [&] { return sceneSettings.sceneName + "_render"; });
+        writeImage(image, sceneSettings.sceneName + "_render");
+    }
+
+protected:
+
+    // Shadow ray that TraceRay() left for later, with the light it adds to its pixel if nothing blocks it
+    struct DeferredShadowRay
+    {
+        Vector3 origin;
+        Vector3 direction;
+        float distance;
+        uint32_t pixel;             // Within the strip being rendered
+        Vector3 contribution;
+        bool primary;               // From the surface a primary ray hit
+    };
+
+    // Deferred shadow rays of a strip of rows, one list per light; pixel is the one being traced
+    struct ShadowQueue
+    {
+        uint32_t pixel = 0;
+        std::vector<std::vector<DeferredShadowRay>> lights;
+    };
+
+    // GetPixel() of one set of features
+    using PixelFunction = Vector3 (Renderer::*)(const Ray&, PixelGuide*, ShadowQueue*);
+
+    static constexpr std::array<std::pair<uint32_t, Coverage::TileLevel>, 2> kPreviewPasses{ { { 16, Coverage::COARSE_PREVIEW }, { 4, Coverage::PREVIEW } } };
+
+    // Render() and RenderRegion(), or Render(job) when job is given
+    Image renderRegion(uint32_t firstColumn, uint32_t firstRow, uint32_t regionWidth, uint32_t regionHeight, const Job* job, Coverage* coverage)
+    {
+        TraceScope trace("render", [&] { return view.settings.sceneName; });
+        Scene::Settings sceneSettings = view.settings;
 
         const uint32_t imageWidth = sceneSettings.imageSettings.width;
         const uint32_t imageHeight = sceneSettings.imageSettings.height;
+        assert(firstColumn + regionWidth <= imageWidth && firstRow + regionHeight <= imageHeight);
+
+        Image image(regionWidth, regionHeight);
+        const PrimaryRayGenerator rayGenerator(view.camera, imageWidth, imageHeight);
+        const uint32_t features = (scene.GetFeatures() & ~Scene::HAS_MULTIPLE_LIGHTS) | (view.lights.size() > 1 ? uint32_t(Scene::HAS_MULTIPLE_LIGHTS) : 0);
+        const PixelFunction getPixel = selectPixelFunction(specialize ? features : Scene::ALL_FEATURES);
 
-        Image image(imageWidth, imageHeight);
+        if (shadowMapResolution > 0 && !shadowMaps.Matches(view.lights, shadowMapResolution))
+        {
+            const auto buildStart = std::chrono::steady_clock::now();
+            shadowMaps = ShadowCubeMaps::Build(scene, view.lights, shadowMapResolution);
+            shadowMapBuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+        }
+
+        stats = {};
+#if RENDER_STATS
+        std::mutex statsMutex;
+#endif
+        const bool measureCost = heatmapMetric != HeatmapMetric::NONE;
+        pixelCosts.assign(measureCost ? size_t(regionWidth) * regionHeight : 0, 0.f);
+        FeatureBuffers featureBuffers;
+        if (denoise)
+            featureBuffers.Resize(regionWidth, regionHeight);
 
         auto renderTask = [&](uint32_t startRow, uint32_t endRow)
             {
-                for (uint32_t rowIdx = startRow; rowIdx < endRow; ++rowIdx)
+                if constexpr (kRenderStatsEnabled)
+                    ThreadRenderStats() = {};
+                RayBatch rays;
+                std::vector<Vector3> radiance;
+                std::vector<float> squaredLuminance;
+                std::vector<PixelGuide> guides;
+                std::vector<Vector3> sampleRadiance;
+                ShadowQueue shadowQueue;
+                ShadowPacket packet;
+                ShadowQueue* shadows = batchShadows && !measureCost && shadowMapResolution == 0 ? &shadowQueue : nullptr;
+                shadowQueue.lights.resize(view.lights.size());
+                for (uint32_t tileRow = startRow; tileRow < endRow; tileRow += tileRows)
                 {
-                    float y = static_cast<float>(rowIdx) + 0.5f; // To pixel center
-                    y /= imageHeight; // To NDC
-                    y = 1.f - (2.f * y); // To screen space
-                    for (uint32_t colIdx = 0; colIdx < imageWidth; ++colIdx)
+                    const uint32_t rowCount = std::min(tileRows, endRow - tileRow);
+                    TraceScope tileTrace("render tile", [&] { return "rows " + std::to_string(firstRow + tileRow) + "-" + std::to_string(firstRow + tileRow + rowCount - 1); });
+                    const size_t tilePixels = size_t(rowCount) * regionWidth;
+                    radiance.assign(tilePixels, Vector3(0.f));
+                    squaredLuminance.assign(denoise ? tilePixels : 0, 0.f);
+                    guides.assign(denoise ? tilePixels : 0, PixelGuide{ Vector3(0.f), 0.f, Vector3(0.f) });
+                    sampleRadiance.resize(tilePixels);
+                    for (uint32_t sample = 0; sample < samplesPerPixel; ++sample)
                     {
-                        float x = static_cast<float>(colIdx) + 0.5f; // To pixel center
-                        x /= imageWidth; // To NDC
-                        x = 2.f * x - 1.f; // To screen space
-                        x *= static_cast<float>(imageWidth) / imageHeight; // Consider aspect ratio
-
-                        RGB color = GetPixel(x, y);
+                        rayGenerator.GenerateTile(firstColumn, firstRow + tileRow, regionWidth, rowCount, rays, sample);
+                        for (size_t pixel = 0; pixel < tilePixels; ++pixel)
+                        {
+                            const Ray ray = rays.Get(pixel);
+                            PixelGuide guide;
+                            PixelGuide* sampleGuide = denoise ? &guide : nullptr;
+                            shadowQueue.pixel = static_cast<uint32_t>(pixel);
+                            sampleRadiance[pixel] = measureCost
+                                ? measurePixel(getPixel, ray, sampleGuide, pixelCosts[size_t(tileRow) * regionWidth + pixel])
+                                : (this->*getPixel)(ray, sampleGuide, shadows);
+                            if (denoise)
+                            {
+                                guides[pixel].normal += guide.normal;
+                                guides[pixel].depth += guide.depth;
+                                guides[pixel].albedo += guide.albedo;
+                            }
+                        }
+                        if (shadows)
+                            resolveShadows(shadowQueue, regionWidth, sampleRadiance, packet);
+
+                        for (size_t pixel = 0; pixel < tilePixels; ++pixel)
+                        {
+                            const Vector3& L = sampleRadiance[pixel];
+                            radiance[pixel] += L;
+                            if (denoise)
+                            {
+                                const float luminance = simd_scalar::Luminance(L.x, L.y, L.z);
+                                squaredLuminance[pixel] += luminance * luminance;
+                            }
+                        }
+                    }
 
-                        image.SetPixel(colIdx, rowIdx, color);
+                    const float sampleWeight = 1.f / samplesPerPixel;
+                    for (uint32_t rowIdx = 0; rowIdx < rowCount; ++rowIdx)
+                    {
+                        for (uint32_t colIdx = 0; colIdx < regionWidth; ++colIdx)
+                        {
+                            const size_t pixel = size_t(rowIdx) * regionWidth + colIdx;
+                            const Vector3 L = samplesPerPixel > 1 ? radiance[pixel] * sampleWeight : radiance[pixel];
+                            if (denoise)
+                            {
+                                // Variance of the mean of the samples; the denoiser estimates it for single samples
+                                float variance = -1.f;
+                                if (samplesPerPixel > 1)
+                                {
+                                    const float meanLuminance = simd_scalar::Luminance(L.x, L.y, L.z);
+                                    variance = std::max(squaredLuminance[pixel] * sampleWeight - meanLuminance * meanLuminance, 0.f) / (samplesPerPixel - 1);
+                                }
+                                const PixelGuide& guide = guides[pixel];
+                                featureBuffers.Set(colIdx, tileRow + rowIdx, L, { guide.normal * sampleWeight, guide.depth * sampleWeight, guide.albedo * sampleWeight }, variance);
+                            }
+                            else
+                            {
+                                image.SetPixel(colIdx, tileRow + rowIdx, L.ToRGB());
+                            }
+                        }
                     }
                 }
+
+#if RENDER_STATS
+                std::lock_guard lock(statsMutex);
+                stats.Merge(ThreadRenderStats());
+#endif
             };
 
-        uint32_t numThreads = std::thread::hardware_concurrency();
+        if (job)
+        {
+            threadBusySeconds.clear();
+            renderJob(*job, *coverage, rayGenerator, getPixel, regionWidth, regionHeight, firstColumn, firstRow, image, renderTask);
+            if (coverage->status == Coverage::Status::COMPLETE)
+            {
+                denoiseImage(featureBuffers, image);
+            }
+            else if (denoise)
+            {
+                // A partial render is not denoised; its finished tiles keep their radiance as it is
+                for (uint32_t rowIdx = 0; rowIdx < regionHeight; ++rowIdx)
+                {
+                    if (coverage->tileLevels[rowIdx / tileRows] != Coverage::FULL)
+                        continue;
+                    for (uint32_t colIdx = 0; colIdx < regionWidth; ++colIdx)
+                        image.SetPixel(colIdx, rowIdx, featureBuffers.GetRadiance(colIdx, rowIdx).ToRGB());
+                }
+            }
+            return image;
+        }
+
+        // On a shared pool the strips are handed out one at a time, taking turns with the strips of concurrent renders
+        if (threadPool)
+        {
+            threadBusySeconds.clear();
+            threadPool->Run((regionHeight + tileRows - 1) / tileRows, [&](size_t strip)
+                {
+                    const uint32_t startRow = static_cast<uint32_t>(strip) * tileRows;
+                    renderTask(startRow, std::min(startRow + tileRows, regionHeight));
+                });
+            denoiseImage(featureBuffers, image);
+            return image;
+        }
+
+        const uint32_t numThreads = std::clamp(threadCount ? threadCount : std::thread::hardware_concurrency(), 1u, std::max(regionHeight, 1u));
         std::vector<std::jthread> threads;
-        uint32_t rowsPerThread = imageHeight / numThreads;
+        threadBusySeconds.assign(numThreads, 0.0);
 
+        // Bands start on a row of image tiles, so no two threads write the same tile
+        auto bandStart = [&](uint32_t i) { return static_cast<uint32_t>(uint64_t(i) * regionHeight / numThreads) / Image::kTileSize * Image::kTileSize; };
         for (uint32_t i = 0; i < numThreads; ++i)
         {
-            uint32_t startRow = i * rowsPerThread;
-            uint32_t endRow = (i == numThreads - 1) ? imageHeight : startRow + rowsPerThread;
-            threads.emplace_back([&, startRow, endRow]()
+            uint32_t startRow = bandStart(i);
+            uint32_t endRow = (i == numThreads - 1) ? regionHeight : bandStart(i + 1);
+            threads.emplace_back([&, i, startRow, endRow]()
                 {
+                    if (Tracer::Instance().IsEnabled())
+                        Tracer::Instance().SetThreadName("render thread " + std::to_string(i));
+                    const auto start = std::chrono::steady_clock::now();
                     renderTask(startRow, endRow);
+                    threadBusySeconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
                 });
         }
 
         for (auto& thread : threads)
             thread.join();
 
-        WriteToFile(image, sceneSettings);
+        denoiseImage(featureBuffers, image);
+        return image;
     }
 
-protected:
+    // The tiles of a Render(job), handed out one at a time, after the preview passes if the job asks for them.
+    // renderTask(startRow, endRow) renders the rows of a tile at full resolution.
+    template <typename RenderTask>
+    void renderJob(const Job& job, Coverage& coverage, const PrimaryRayGenerator& rayGenerator, PixelFunction getPixel, uint32_t regionWidth, uint32_t regionHeight,
+        uint32_t firstColumn, uint32_t firstRow, Image& image, const RenderTask& renderTask)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const uint32_t tileCount = (regionHeight + tileRows - 1) / tileRows;
+        coverage = {};
+        coverage.tileRows = tileRows;
+        coverage.tileLevels.assign(tileCount, Coverage::NOT_TRACED);
+
+        std::atomic<bool> stopped{ false };
+        auto shouldStop = [&]()
+            {
+                if (stopped.load(std::memory_order_relaxed))
+                    return true;
+                if (!job.stopToken.stop_requested() && std::chrono::steady_clock::now() < job.deadline)
+                    return false;
+                stopped.store(true, std::memory_order_relaxed);
+                return true;
+            };
 
-    void WriteToFile(const Image& image, const Scene::Settings& sceneSettings)
+        auto runTiles = [&](const auto& task)
+            {
+                if (threadPool)
+                {
+                    threadPool->Run(tileCount, task);
+                    return;
+                }
+                const uint32_t numThreads = std::clamp(threadCount ? threadCount : std::thread::hardware_concurrency(), 1u, std::max(tileCount, 1u));
+                std::atomic<size_t> nextTile{ 0 };
+                std::vector<std::jthread> threads;
+                for (uint32_t i = 0; i < numThreads; ++i)
+                {
+                    threads.emplace_back([&]()
+                        {
+                            for (size_t tile = nextTile.fetch_add(1); tile < tileCount; tile = nextTile.fetch_add(1))
+                                task(tile);
+                        });
+                }
+            };
+
+        for (const auto& [block, level] : kPreviewPasses)
+        {
+            if (!job.preview)
+                break;
+            TraceScope trace("render preview", [&, block = block] { return std::to_string(block) + "x" + std::to_string(block); });
+            runTiles([&, block = block, level = level](size_t tile)
+                {
+                    if (shouldStop())
+                        return;
+                    const uint32_t startRow = static_cast<uint32_t>(tile) * tileRows;
+                    const uint32_t endRow = std::min(startRow + tileRows, regionHeight);
+                    for (uint32_t blockRow = startRow; blockRow < endRow; blockRow += block)
+                    {
+                        const uint32_t blockHeight = std::min(block, endRow - blockRow);
+                        for (uint32_t blockColumn = 0; blockColumn < regionWidth; blockColumn += block)
+                        {
+                            const uint32_t blockWidth = std::min(block, regionWidth - blockColumn);
+                            const Ray ray = rayGenerator.GenerateRay(firstColumn + blockColumn + blockWidth / 2, firstRow + blockRow + blockHeight / 2);
+                            const RGB color = (this->*getPixel)(ray, nullptr, nullptr).ToRGB();
+                            for (uint32_t rowIdx = blockRow; rowIdx < blockRow + blockHeight; ++rowIdx)
+                            {
+                                for (uint32_t colIdx = blockColumn; colIdx < blockColumn + blockWidth; ++colIdx)
+                                    image.SetPixel(colIdx, rowIdx, color);
+                            }
+                        }
+                    }
+                    coverage.tileLevels[tile] = level;
+                });
+        }
+
+        const auto fullStart = std::chrono::steady_clock::now();
+        std::mutex progressMutex;
+        runTiles([&](size_t tile)
+            {
+                if (shouldStop())
+                    return;
+                const uint32_t startRow = static_cast<uint32_t>(tile) * tileRows;
+                renderTask(startRow, std::min(startRow + tileRows, regionHeight));
+                coverage.tileLevels[tile] = Coverage::FULL;
+
+                std::lock_guard lock(progressMutex);
+                const uint32_t tilesDone = ++coverage.tilesDone;
+                if (job.onProgress)
+                {
+                    const auto now = std::chrono::steady_clock::now();
+                    const double fullSeconds = std::chrono::duration<double>(now - fullStart).count();
+                    job.onProgress({ tilesDone, tileCount, std::chrono::duration<double>(now - start).count(), fullSeconds / tilesDone * (tileCount - tilesDone) });
+                }
+            });
+
+        size_t fullRows = 0, previewRows = 0;
+        for (uint32_t tile = 0; tile < tileCount; ++tile)
+        {
+            const uint32_t rows = std::min(tileRows, regionHeight - tile * tileRows);
+            fullRows += coverage.tileLevels[tile] == Coverage::FULL ? rows : 0;
+            previewRows += coverage.tileLevels[tile] == Coverage::COARSE_PREVIEW || coverage.tileLevels[tile] == Coverage::PREVIEW ? rows : 0;
+        }
+        coverage.fullFraction = regionHeight ? static_cast<double>(fullRows) / regionHeight : 1.0;
+        coverage.previewFraction = regionHeight ? static_cast<double>(previewRows) / regionHeight : 0.0;
+        if (coverage.tilesDone < tileCount)
+            coverage.status = job.stopToken.stop_requested() ? Coverage::Status::CANCELLED : Coverage::Status::DEADLINE;
+        coverage.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Filters the features of a denoised render and turns them into the colors of image
+    void denoiseImage(FeatureBuffers& featureBuffers, Image& image)
+    {
+        denoiseSeconds = 0.0;
+        if (!denoise)
+            return;
+
+        const auto start = std::chrono::steady_clock::now();
+        Denoiser(denoiserOptions).Denoise(featureBuffers);
+        for (uint32_t rowIdx = 0; rowIdx < image.GetHeight(); ++rowIdx)
+        {
+            for (uint32_t colIdx = 0; colIdx < image.GetWidth(); ++colIdx)
+                image.SetPixel(colIdx, rowIdx, featureBuffers.GetRadiance(colIdx, rowIdx).ToRGB());
+        }
+        denoiseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void writeImage(const Image& image, const std::string& fileName)
     {
         const auto imageWidth = image.GetWidth();
         const auto imageHeight = image.GetHeight();
-        PPMWriter writer(sceneSettings.sceneName + "_render", imageWidth, imageHeight, maxColorComponent);
+        PPMWriter writer(fileName, imageWidth, imageHeight, maxColorComponent);
 
+        const std::vector<RGB> pixels = image.ToScanlines();
         for (uint32_t rowIdx = 0; rowIdx < imageHeight; ++rowIdx)
         {
             for (uint32_t colIdx = 0; colIdx < imageWidth; ++colIdx)
             {
-                writer << image.GetPixel(colIdx, rowIdx).ToString() << "\t";
+                writer << pixels[size_t(rowIdx) * imageWidth + colIdx].ToString() << "\t";
             }
             writer << "\n";
         }
     }
 
-    Vector3 TraceRay(const Ray& ray, uint32_t depth = 0)
+    // Tests the shadow rays TraceRay() deferred for a strip of rows regionWidth pixels wide and adds the light of
+    // those nothing blocks to radiance. The rays toward each light are grouped by blocks of kShadowBlockSize x
+    // kShadowBlockSize pixels, those from primary hits apart from the rest, and go in packets of up to
+    // ShadowPacket::kMaxRays rays. Leaves the lists of the queue empty.
+    void resolveShadows(ShadowQueue& queue, uint32_t regionWidth, std::vector<Vector3>& radiance, ShadowPacket& packet) const
     {
+        const uint32_t blocksPerRow = (regionWidth + kShadowBlockSize - 1) / kShadowBlockSize;
+        auto groupOf = [&](const DeferredShadowRay& shadowRay)
+            {
+                const uint32_t row = shadowRay.pixel / regionWidth, column = shadowRay.pixel % regionWidth;
+                return ((row / kShadowBlockSize) * blocksPerRow + column / kShadowBlockSize) * 2 + (shadowRay.primary ? 0 : 1);
+            };
+
+        for (size_t lightIdx = 0; lightIdx < queue.lights.size(); ++lightIdx)
+        {
+            std::vector<DeferredShadowRay>& shadowRays = queue.lights[lightIdx];
+            std::stable_sort(shadowRays.begin(), shadowRays.end(), [&](const DeferredShadowRay& a, const DeferredShadowRay& b) { return groupOf(a) < groupOf(b); });
+            CountRenderStat(&RenderStats::shadowRays, shadowRays.size());
+
+            for (size_t first = 0; first < shadowRays.size();)
+            {
+                const uint32_t group = groupOf(shadowRays[first]);
+                size_t end = first;
+                packet.count = 0;
+                packet.target = view.lights[lightIdx].position;
+                for (; end < shadowRays.size() && packet.count < ShadowPacket::kMaxRays && groupOf(shadowRays[end]) == group; ++end)
+                    packet.Add(shadowRays[end].origin, shadowRays[end].direction, shadowRays[end].distance);
+                packet.Finish();
+
+                const uint64_t blocked = scene.AnyHitPacket(packet);
+                for (size_t i = first; i < end; ++i)
+                {
+                    if (!((blocked >> (i - first)) & 1))
+                        radiance[shadowRays[i].pixel] += shadowRays[i].contribution;
+                }
+                first = end;
+            }
+            shadowRays.clear();
+        }
+    }
+
+    // kFeatures is a set of Scene::Features; branches for materials the scene does not have are compiled out.
+    // rayCounter is the statistic the ray counts towards. guide, if given, receives the first surface the ray sees.
+    // With shadows, the shadow rays go to the queue instead of being traced, along with the light they would add
+    // to the pixel: what the surface reflects toward the ray, times throughput, the weight of the ray in the pixel.
+    // Preview shadows take the place of both.
+    template <uint32_t kFeatures>
+    Vector3 TraceRay(const Ray& ray, uint32_t depth = 0, uint64_t RenderStats::* rayCounter = &RenderStats::primaryRays, PixelGuide* guide = nullptr,
+        ShadowQueue* shadows = nullptr, const Vector3& throughput = Vector3(1.f))
+    {
+        constexpr bool kReflective = (kFeatures & Scene::HAS_REFLECTIVE) != 0;
+        constexpr bool kRefractive = (kFeatures & Scene::HAS_REFRACTIVE) != 0;
+        constexpr bool kMultipleLights = (kFeatures & Scene::HAS_MULTIPLE_LIGHTS) != 0;
+
         Vector3 L{ 0.f };
         if (depth > maxDepth)
             return L;
 
-        HitInfo hitInfo = scene.ClosestHit(ray);
+        RecordRenderDepth(depth);
+        CountRenderStat(rayCounter);
+
+        HitInfo hitInfo = scene.ClosestHit<kFeatures>(ray);
         if (hitInfo.hit)
         {
-            const auto& mesh = scene.meshes[hitInfo.meshIndex];
-            const auto& material = scene.materials[mesh.materialIndex];
-            Vector3 normal = hitInfo.normal;
-            if (material.smoothShading)
-            {
-                const auto& triangle = mesh.triangles[hitInfo.triangleIndex];
-                normal = triangle.GetNormal(hitInfo.u, hitInfo.v);
-            }
+            const auto& material = scene.materials[hitInfo.materialIndex];
+            Vector3 normal = hitInfo.shadingNormal;
+            if (guide)
+                *guide = { normal, hitInfo.t, material.albedo };
 
             Vector3 offsetOrigin = OffsetRayOrigin(hitInfo.point, hitInfo.normal);
-            if (material.type == Material::Type::DIFFUSE || material.type == Material::Type::CONSTANT)
+            // Without reflective and refractive materials every material is diffuse or constant
+            if (!(kReflective || kRefractive) || material.type == Material::Type::DIFFUSE || material.type == Material::Type::CONSTANT)
             {
-                for (const auto& light : scene.lights)
+                const size_t lightCount = kMultipleLights ? view.lights.size() : std::min<size_t>(view.lights.size(), 1);
+                for (size_t lightIdx = 0; lightIdx < lightCount; ++lightIdx)
                 {
+                    const auto& light = view.lights[lightIdx];
                     Vector3 dirToLight = Normalize(light.position - offsetOrigin);
                     float distanceToLight = (light.position - offsetOrigin).Magnitude();
+                    if (shadowMapResolution > 0)
+                    {
+                        const float visibility = shadowMaps.Visibility(static_cast<uint32_t>(lightIdx), hitInfo.point, hitInfo.normal);
+                        float attenuation = 1.0f / (distanceToLight * distanceToLight);
+                        L += material.albedo * (std::max(0.f, Dot(normal, dirToLight)) * visibility) * attenuation * light.intensity;
+                        continue;
+                    }
+                    if (shadows)
+                    {
+                        // A light behind the surface adds nothing, blocked or not
+                        const float cosine = Dot(normal, dirToLight);
+                        if (cosine > 0.f)
+                        {
+                            const Vector3 contribution = throughput * (material.albedo * cosine * (1.0f / (distanceToLight * distanceToLight)) * light.intensity);
+                            shadows->lights[lightIdx].push_back({ offsetOrigin, dirToLight, distanceToLight, shadows->pixel, contribution, depth == 0 });
+                        }
+                        continue;
+                    }
                     Ray shadowRay{ offsetOrigin, dirToLight, distanceToLight};
-                    if (!scene.AnyHit(shadowRay))
+                    CountRenderStat(&RenderStats::shadowRays);
+                    if (!scene.AnyHit<kFeatures>(shadowRay))
                     {
                         float attenuation = 1.0f / (distanceToLight * distanceToLight);
                         L += material.albedo * std::max(0.f, Dot(normal, dirToLight)) * attenuation * light.intensity;
                     }
                 }
             }
-            if (material.type == Material::Type::REFLECTIVE)
+            if (kReflective && material.type == Material::Type::REFLECTIVE)
             {
                 Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
                 Ray reflectionRay{ offsetOrigin,  reflectionDir };
-                L += material.albedo * TraceRay(reflectionRay, depth + 1);
+                L += material.albedo * TraceRay<kFeatures>(reflectionRay, depth + 1, &RenderStats::reflectionRays, nullptr, shadows, throughput * material.albedo);
             }
-            else if (material.type == Material::Type::REFRACTIVE)
+            else if (kRefractive && material.type == Material::Type::REFRACTIVE)
             {
                 float eta = material.ior;
                 Vector3 wi = -ray.directionN;
@@ -166,7 +827,7 @@ protected:
                     // Total internal reflection case
                     Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
                     Ray reflectionRay{ offsetOrigin,  reflectionDir };
-                    L += TraceRay(reflectionRay, depth + 1);
+                    L += TraceRay<kFeatures>(reflectionRay, depth + 1, &RenderStats::reflectionRays, nullptr, shadows, throughput);
                 }
                 else
                 {
@@ -174,14 +835,13 @@ protected:
                     Vector3 wt = -wi / eta + (cosThetaI / eta - cosThetaT) * normal;
                     Vector3 offsetOriginRefraction = OffsetRayOrigin(hitInfo.point, flipOrientation ? hitInfo.normal : -hitInfo.normal);
                     Ray refractionRay{ offsetOriginRefraction, wt };
-                    Vector3 refractionL = TraceRay(refractionRay, depth + 1);
+                    float fresnel = 0.5f * std::pow(1.f + Dot(ray.directionN, normal), 5);
+                    Vector3 refractionL = TraceRay<kFeatures>(refractionRay, depth + 1, &RenderStats::refractionRays, nullptr, shadows, throughput * (1.f - fresnel));
 
                     Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
                     Vector3 offsetOriginReflection = OffsetRayOrigin(hitInfo.point, flipOrientation ? -hitInfo.normal : hitInfo.normal);
                     Ray reflectionRay{ offsetOriginReflection,  reflectionDir };
-                    Vector3 reflectionL = TraceRay(reflectionRay, depth + 1);
-
-                    float fresnel = 0.5f * std::pow(1.f + Dot(ray.directionN, normal), 5);
+                    Vector3 reflectionL = TraceRay<kFeatures>(reflectionRay, depth + 1, &RenderStats::reflectionRays, nullptr, shadows, throughput * fresnel);
 
                     L += fresnel * reflectionL + (1.f - fresnel) * refractionL;
 
@@ -190,32 +850,79 @@ protected:
         }
         else
         {
-            L += scene.settings.backgroundColor;
+            L += view.settings.backgroundColor;
         }
 
         return L;
     }
 
-    RGB GetPixel(float x, float y)
+    // Radiance of one primary ray
+    template <uint32_t kFeatures>
+    Vector3 GetPixel(const Ray& ray, PixelGuide* guide, ShadowQueue* shadows)
     {
-        Vector3 origin = scene.camera.GetPosition();
-        Vector3 forward = scene.camera.GetLookDirection();
+        return TraceRay<kFeatures>(ray, 0, &RenderStats::primaryRays, guide, shadows);
+    }
 
-        // Assume up vector is Y axis in camera space and right vector is X axis in camera space
-        Vector3 up = Normalize(scene.camera.transform * Vector3(0.f, 1.f, 0.f));
-        Vector3 right = Cross(forward, up);
+    // GetPixel() for every set of features, indexed by the set
+    template <uint32_t... kFeatures>
+    static constexpr std::array<PixelFunction, sizeof...(kFeatures)> makePixelFunctions(std::integer_sequence<uint32_t, kFeatures...>)
+    {
+        return { &Renderer::GetPixel<kFeatures>... };
+    }
 
-        // Calculate direction to pixel in camera space
-        Vector3 direction = Normalize(forward + right * x + up * y);
+    static PixelFunction selectPixelFunction(uint32_t features)
+    {
+        static constexpr auto pixelFunctions = makePixelFunctions(std::make_integer_sequence<uint32_t, Scene::ALL_FEATURES + 1>());
+        return pixelFunctions[features];
+    }
 
-        Ray ray{ origin, direction };
-        const uint32_t maxTraceDepth = 2;
+    // Adds the cost of the ray to cost, so the samples of a pixel sum up
+    Vector3 measurePixel(PixelFunction getPixel, const Ray& ray, PixelGuide* guide, float& cost)
+    {
+        const RenderStats before = kRenderStatsEnabled ? ThreadRenderStats() : RenderStats{};
+        const auto start = std::chrono::steady_clock::now();
+        const Vector3 color = (this->*getPixel)(ray, guide, nullptr);
+        const auto end = std::chrono::steady_clock::now();
+        const RenderStats& after = ThreadRenderStats();
 
-        Vector3 throughput{ 1.f };
-        Vector3 L = TraceRay(ray);
-        return L.ToRGB();
+        switch (heatmapMetric)
+        {
+        case HeatmapMetric::RAYS:
+            cost += static_cast<float>(after.TotalRays() - before.TotalRays());
+            break;
+        case HeatmapMetric::TRAVERSAL_STEPS:
+            cost += static_cast<float>(after.boxTests + after.triangleTests - before.boxTests - before.triangleTests);
+            break;
+        case HeatmapMetric::TRIANGLE_TESTS:
+            cost += static_cast<float>(after.triangleTests - before.triangleTests);
+            break;
+        default:
+            cost += static_cast<float>(std::chrono::duration<double, std::nano>(end - start).count());
+            break;
+        }
+        return color;
     }
+
     static constexpr uint32_t maxDepth = 10;
+    static constexpr uint32_t tileRows = 16; // Rows of primary rays generated at once
+    static_assert(tileRows % Image::kTileSize == 0, "a strip of rows must cover whole image tiles");
+    static constexpr uint32_t kShadowBlockSize = 8;  // Pixels on a side of the blocks whose shadow rays share packets
     static constexpr uint32_t maxColorComponent = 255;
-    Scene& scene;
+    const Scene& scene;
+    bool specialize;
+    RenderStats stats;
+    HeatmapMetric heatmapMetric = HeatmapMetric::NONE;
+    std::vector<float> pixelCosts;
+    View view;
+    uint32_t samplesPerPixel = 1;
+    bool denoise = false;
+    bool batchShadows = true;
+    uint32_t shadowMapResolution = 0;
+    ShadowCubeMaps shadowMaps;
+    double shadowMapBuildSeconds = 0.0;
+    Denoiser::Options denoiserOptions;
+    double denoiseSeconds = 0.0;
+    uint32_t threadCount = 0;
+    ThreadPool* threadPool = nullptr;
+    std::vector<double> threadBusySeconds;
 };
\ No newline at end of file
@@ -1,21 +1,58 @@
 #pragma once
 
 #include "Math3D.hpp"
+#include "Bvh.hpp"
 #include "Camera.hpp"
+#include "Geometry.hpp"
+#include "MappedFile.hpp"
+#include "Parallel.hpp"
+#include "RenderStats.hpp"
+#include "SimdKernels.hpp"
+#include "Trace.hpp"
+#include "MeshOptimizer.hpp"
 
 #define RAPIDJSON_NOMEMBERITERATORCLASS
 #include "rapidjson/document.h"
-#include "rapidjson/istreamwrapper.h"
+#include "rapidjson/error/en.h"
+#include "rapidjson/reader.h"
 
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <span>
+#include <memory>
 #include <map>
+#include <stdexcept>
+#include <atomic>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
+// Thrown by the Scene constructor when the file cannot be read or is not a valid scene
+class SceneLoadError : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Helper functions, throwing SceneLoadError on malformed arrays
+void checkNumbers(const rapidjson::Value::ConstArray& arr, const char* what)
+{
+	for (const auto& value : arr)
+	{
+		if (!value.IsNumber())
+			throw SceneLoadError(std::string(what) + " hold something other than numbers");
+	}
+}
 
-// Helper functions
 Vector3 loadVector(const rapidjson::Value::ConstArray& arr)
 {
-	assert(arr.Size() == 3);
+	if (arr.Size() != 3)
+		throw SceneLoadError("a vector does not have 3 components");
+	checkNumbers(arr, "vectors");
 	return Vector3{
 		static_cast<float>(arr[0].GetDouble()),
 		static_cast<float>(arr[1].GetDouble()),
@@ -25,7 +62,9 @@ Vector3 loadVector(const rapidjson::Value::ConstArray& arr)
 
 Matrix4 loadMatrix(const rapidjson::Value::ConstArray& arr) 
 {
-	assert(arr.Size() == 9);
+	if (arr.Size() != 9)
+		throw SceneLoadError("a matrix does not have 9 elements");
+	checkNumbers(arr, "matrices");
 	Matrix4 result = Matrix4::Identity();
 	for(uint32_t i = 0; i < 3; i++)
 	{
@@ -37,7 +76,9 @@ Matrix4 loadMatrix(const rapidjson::Value::ConstArray& arr)
 
 std::vector<Vector3> loadVertices(const rapidjson::Value::ConstArray& arr) 
 {
-	assert(arr.Size() % 3 == 0);
+	if (arr.Size() % 3 != 0)
+		throw SceneLoadError("the vertex coordinates are not a multiple of 3");
+	checkNumbers(arr, "vertices");
 	std::vector<Vector3> result;
 	result.reserve(arr.Size() / 3);
 	for(uint32_t i = 0; i < arr.Size(); i += 3) {
@@ -54,14 +95,67 @@ std::vector<Vector3> loadVertices(const rapidjson::Value::ConstArray& arr)
 
 std::vector<uint32_t> loadIndices(const rapidjson::Value::ConstArray& arr) 
 {
-	assert(arr.Size() % 3 == 0);
+	if (arr.Size() % 3 != 0)
+		throw SceneLoadError("the triangle indices are not a multiple of 3");
 	std::vector<uint32_t> result;
 	result.reserve(arr.Size() / 3);
 	for(uint32_t i = 0; i < arr.Size(); ++i)
-		result.emplace_back(arr[i].GetInt());
+	{
+		if (!arr[i].IsUint())
+			throw SceneLoadError("a triangle index is not a whole number");
+		result.emplace_back(arr[i].GetUint());
+	}
 	return result;
 }
 
+// Null-terminated, writable text of a scene file, as needed for in-situ parsing. A private (copy-on-write)
+// mapping is both as long as the file does not end exactly on a page boundary, because the rest of the last
+// page reads as zeros. Otherwise the file is read into a buffer. In-situ parsing only writes back unescaped
+// strings, so barely any mapped pages get copied.
+class JsonText
+{
+public:
+	explicit JsonText(const std::string& fileName)
+		: mapping(fileName, MappedFile::Access::COPY_ON_WRITE)
+	{
+		if (mapping.IsOpen() && mapping.Size() % MappedFile::PageSize() != 0)
+			return;
+
+		mapping = MappedFile{};
+		std::ifstream ifs(fileName, std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+			throw SceneLoadError("cannot open the file");
+		buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+		buffer.push_back('\0');
+	}
+
+	char* Data() { return mapping.IsOpen() ? mapping.MutableData() : buffer.data(); }
+	size_t Size() const { return mapping.IsOpen() ? mapping.Size() : buffer.size() - 1; }
+
+private:
+	MappedFile mapping;
+	std::vector<char> buffer;
+};
+
+// Preallocated memory for the DOM of one scene file. Values are bump-allocated from the arena (overflow goes to
+// extra pool chunks) and everything is released at once when the arena goes out of scope.
+class JsonArena
+{
+public:
+	// Roughly one 16-byte value per eight bytes of text
+	static size_t CapacityFor(size_t textSize) { return std::max<size_t>(textSize * 2, 64 * 1024); }
+
+	explicit JsonArena(size_t capacity)
+		: buffer(new char[capacity]), allocator(buffer.get(), capacity)
+	{}
+
+	rapidjson::MemoryPoolAllocator<>& Allocator() { return allocator; }
+
+private:
+	std::unique_ptr<char[]> buffer;
+	rapidjson::MemoryPoolAllocator<> allocator;
+};
+
 struct Light
 {
 	float intensity;
@@ -84,21 +178,14 @@ struct Material
 	bool smoothShading;
 };
 
-class Mesh
-{
-public:
-	std::vector<Triangle> triangles;
-	uint32_t materialIndex;
-};
-
 class Scene
 {
 public:
 
 	struct ImageSettings
 	{
-		uint32_t width;
-		uint32_t height;
+		uint32_t width = 0;
+		uint32_t height = 0;
 	};
 	struct Settings
 	{
@@ -108,49 +195,242 @@ public:
 	};
 
 
-	Scene(const std::string& fileName)
+	// What the materials and lights of a scene need from the renderer. TraceRay(), ClosestHit() and AnyHit() are
+	// instantiated for every combination; a variant without a feature leaves out its branches entirely.
+	enum Features : uint32_t
 	{
-		parseSceneFile(fileName);
-	}
+		HAS_REFLECTIVE = 1 << 0,
+		HAS_REFRACTIVE = 1 << 1,
+		HAS_SMOOTH_SHADING = 1 << 2,	// A smooth shaded material on a mesh with vertex normals
+		HAS_MULTIPLE_LIGHTS = 1 << 3,
+		ALL_FEATURES = (1 << 4) - 1
+	};
 
-	HitInfo ClosestHit(const Ray& ray) const
+	enum LoaderType
 	{
-		HitInfo hitInfo;
-		for (uint32_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+		DOM,	// Builds a rapidjson::Document first, then walks it
+		SAX		// Streams numbers straight into the mesh buffers
+	};
+
+	struct LoadOptions
+	{
+		LoaderType loader = LoaderType::SAX;
+		// Read the .crtbin next to the .crtscene file when its content hash and options match, (re)write it otherwise
+		bool useCache = true;
+		// Run OptimizeMesh() on every mesh before its normals are computed
+		bool optimizeMeshes = false;
+		float weldTolerance = 1e-5f;
+		// Built after loading, from the cache or not, so it does not change the .crtbin
+		BvhLayout bvhLayout = BvhLayout::FULL;
+	};
+
+	Scene(const std::string& fileName) : Scene(fileName, LoadOptions{}) {}
+
+	Scene(const std::string& fileName, const LoadOptions& options)
+	{
+		TraceScope trace("load scene", [&] { return fileName; });
+		const std::string cacheFileName = std::filesystem::path(fileName).replace_extension(kCacheExtensionStr).string();
+		uint64_t sourceHash = 0;
+		if (options.useCache)
 		{
-			const auto& mesh = meshes[meshIndex];
-			for (uint32_t triangleIndex = 0; triangleIndex < mesh.triangles.size(); ++triangleIndex)
+			MappedFile source(fileName);
+			if (source.IsOpen())
 			{
-				const auto& triangle = mesh.triangles[triangleIndex];
-				HitInfo currHitInfo = triangle.Intersect(ray);
-				if (currHitInfo.hit && currHitInfo.t < hitInfo.t)
-				{
-					currHitInfo.meshIndex = meshIndex;
-					currHitInfo.triangleIndex = triangleIndex;
-					hitInfo = std::move(currHitInfo);
-				}
+				TraceScope hashTrace("hash scene file");
+				sourceHash = HashBytes(source.Data(), source.Size());
+			}
+			if (source.IsOpen() && loadCache(cacheFileName, sourceHash, options))
+			{
+				settings.sceneName = fileName;
+				if (options.optimizeMeshes)
+					optimizationStats.Print(fileName + " (cached)");
+				bvh = Bvh::Build(meshes, geometry, options.bvhLayout);
+				return;
 			}
 		}
-		return hitInfo;
+
+		// The file text and the DOM arena are released as soon as parsing returns, before the meshes are built
+		if (options.loader == LoaderType::SAX)
+			parseSceneFileSax(fileName);
+		else
+			parseSceneFile(fileName);
+		validateMeshes();
+		buildMeshes(options);
+
+		if (options.useCache)
+			saveCache(cacheFileName, sourceHash, options);
+		bvh = Bvh::Build(meshes, geometry, options.bvhLayout);
 	}
 
-	bool AnyHit(const Ray& ray) const
+	// Features of the meshes' materials and of the lights of this scene
+	uint32_t GetFeatures() const
 	{
+		uint32_t features = lights.size() > 1 ? uint32_t(HAS_MULTIPLE_LIGHTS) : 0;
 		for (const auto& mesh : meshes)
 		{
 			const auto& material = materials[mesh.materialIndex];
-			if (material.type == Material::Type::REFRACTIVE)
-				continue;
-			return std::any_of(mesh.triangles.begin(), mesh.triangles.end(), [&ray](const Triangle& triangle)
+			if (material.type == Material::Type::REFLECTIVE)
+				features |= HAS_REFLECTIVE;
+			else if (material.type == Material::Type::REFRACTIVE)
+				features |= HAS_REFRACTIVE;
+			if (material.smoothShading && mesh.HasNormals())
+				features |= HAS_SMOOTH_SHADING;
+		}
+		return features;
+	}
+
+	template <uint32_t kFeatures = ALL_FEATURES>
+	HitInfo ClosestHit(const Ray& ray) const
+	{
+		return MakeHitInfo<kFeatures>(ray, ClosestTraversalHit(ray));
+	}
+
+	// The closest hit search itself: only t, u, v and the scene-wide triangle ID of the best candidate
+	TraversalHit ClosestTraversalHit(const Ray& ray) const
+	{
+		const SimdKernels& kernels = ActiveSimdKernels();
+		TraversalHit closest;
+		uint64_t triangleTests = 0;
+		auto testTriangles = [&](const Mesh& mesh, uint32_t first, uint32_t count)
+			{
+				const uint32_t offset = first - mesh.firstTriangle;
+				if (mesh.wideIndices)
+					kernels.closestHit32(geometry.Positions(mesh), geometry.Indices<uint32_t>(mesh) + 3 * size_t(offset), count, first, ray, closest);
+				else
+					kernels.closestHit16(geometry.Positions(mesh), geometry.Indices<uint16_t>(mesh) + 3 * size_t(offset), count, first, ray, closest);
+				triangleTests += count;
+			};
+
+		if (bvh.IsBuilt())
+		{
+			bvh.Traverse(ray, closest.t, [&](uint32_t first, uint32_t count)
 				{
-					HitInfo hitInfo = triangle.Intersect(ray);
-					return hitInfo.hit;
+					testTriangles(meshes[MeshOfTriangle(first)], first, count);
+					return false;
 				});
 		}
+		else
+		{
+			for (const auto& mesh : meshes)
+				testTriangles(mesh, mesh.firstTriangle, mesh.triangleCount);
+		}
+		CountRenderStat(&RenderStats::triangleTests, triangleTests);
+		CountRenderStat(&RenderStats::hits, closest.Hit());
+		return closest;
+	}
+
+	// Expands the result of the search into the full hit record: point, face and shading normal, material
+	template <uint32_t kFeatures = ALL_FEATURES>
+	HitInfo MakeHitInfo(const Ray& ray, const TraversalHit& closest) const
+	{
+		HitInfo hitInfo;
+		if (!closest.Hit())
+			return hitInfo;
+
+		hitInfo.hit = true;
+		hitInfo.t = closest.t;
+		hitInfo.u = closest.u;
+		hitInfo.v = closest.v;
+		hitInfo.point = ray(closest.t);
+		hitInfo.meshIndex = MeshOfTriangle(closest.primitiveId);
+
+		const Mesh& mesh = meshes[hitInfo.meshIndex];
+		hitInfo.triangleIndex = closest.primitiveId - mesh.firstTriangle;
+		hitInfo.materialIndex = mesh.materialIndex;
+		hitInfo.normal = geometry.GetFaceNormal(mesh, hitInfo.triangleIndex);
+		hitInfo.shadingNormal = (kFeatures & HAS_SMOOTH_SHADING) && materials[mesh.materialIndex].smoothShading && mesh.HasNormals()
+			? geometry.GetNormal(mesh, hitInfo.triangleIndex, hitInfo.u, hitInfo.v)
+			: hitInfo.normal;
+		return hitInfo;
+	}
+
+	// Refractive meshes do not cast shadows. The statistics count the mesh, or the leaf, that blocks the ray in
+	// full, although the search stops at its first hit triangle.
+	template <uint32_t kFeatures = ALL_FEATURES>
+	bool AnyHit(const Ray& ray) const
+	{
+		const SimdKernels& kernels = ActiveSimdKernels();
+		uint64_t triangleTests = 0;
+		bool hit = false;
+		auto testTriangles = [&](const Mesh& mesh, uint32_t first, uint32_t count)
+			{
+				if ((kFeatures & HAS_REFRACTIVE) && materials[mesh.materialIndex].type == Material::Type::REFRACTIVE)
+					return false;
+				const uint32_t offset = first - mesh.firstTriangle;
+				triangleTests += count;
+				hit = mesh.wideIndices
+					? kernels.anyHit32(geometry.Positions(mesh), geometry.Indices<uint32_t>(mesh) + 3 * size_t(offset), count, ray)
+					: kernels.anyHit16(geometry.Positions(mesh), geometry.Indices<uint16_t>(mesh) + 3 * size_t(offset), count, ray);
+				return hit;
+			};
+
+		if (bvh.IsBuilt())
+		{
+			const float tMax = std::numeric_limits<float>::infinity();
+			bvh.Traverse(ray, tMax, [&](uint32_t first, uint32_t count) { return testTriangles(meshes[MeshOfTriangle(first)], first, count); });
+		}
+		else
+		{
+			for (const auto& mesh : meshes)
+			{
+				if (testTriangles(mesh, mesh.firstTriangle, mesh.triangleCount))
+					break;
+			}
+		}
+		CountRenderStat(&RenderStats::triangleTests, triangleTests);
+		CountRenderStat(&RenderStats::hits, hit);
+		return hit;
+	}
+
+	// AnyHit() for every ray of a finished packet, as a mask of the blocked rays. With a hierarchy the rays are traced
+	// together, sharing the nodes they skip; without one, one by one.
+	template <uint32_t kFeatures = ALL_FEATURES>
+	uint64_t AnyHitPacket(const ShadowPacket& packet) const
+	{
+		uint64_t blocked = 0;
+		if (!bvh.IsBuilt())
+		{
+			for (uint32_t i = 0; i < packet.count; ++i)
+				blocked |= uint64_t(AnyHit<kFeatures>(packet.rays[i])) << i;
+			return blocked;
+		}
+
+		const SimdKernels& kernels = ActiveSimdKernels();
+		uint64_t triangleTests = 0;
+		blocked = bvh.TraversePacket(packet, [&](uint32_t first, uint32_t count, uint64_t rays)
+			{
+				const Mesh& mesh = meshes[MeshOfTriangle(first)];
+				if ((kFeatures & HAS_REFRACTIVE) && materials[mesh.materialIndex].type == Material::Type::REFRACTIVE)
+					return uint64_t(0);
+				const uint32_t offset = first - mesh.firstTriangle;
+				uint64_t leafBlocked = 0;
+				for (; rays != 0; rays &= rays - 1)
+				{
+					const uint32_t ray = static_cast<uint32_t>(std::countr_zero(rays));
+					triangleTests += count;
+					const bool hit = mesh.wideIndices
+						? kernels.anyHit32(geometry.Positions(mesh), geometry.Indices<uint32_t>(mesh) + 3 * size_t(offset), count, packet.rays[ray])
+						: kernels.anyHit16(geometry.Positions(mesh), geometry.Indices<uint16_t>(mesh) + 3 * size_t(offset), count, packet.rays[ray]);
+					leafBlocked |= uint64_t(hit) << ray;
+				}
+				return leafBlocked;
+			});
+		CountRenderStat(&RenderStats::triangleTests, triangleTests);
+		CountRenderStat(&RenderStats::hits, std::popcount(blocked));
+		return blocked;
+	}
+
+	// Index of the mesh owning the triangle with the given scene-wide ID
+	uint32_t MeshOfTriangle(uint32_t triangleId) const
+	{
+		auto it = std::upper_bound(meshes.begin(), meshes.end(), triangleId, [](uint32_t id, const Mesh& mesh) { return id < mesh.firstTriangle; });
+		return static_cast<uint32_t>(it - meshes.begin()) - 1;
 	}
 
 	Camera camera;
 	std::vector<Mesh> meshes;
+	GeometryArena geometry;
+	Bvh bvh;
 	std::vector<Material> materials;
 	std::vector<Light> lights;
 	Settings settings;
@@ -164,6 +444,13 @@ protected:
 	inline static const std::string kImageHeightStr{ "height" };
 	inline static const std::string kCameraStr{ "camera" };
 	inline static const std::string kMatrixStr{ "matrix" };
+	inline static const std::string kProjectionStr{ "projection" };
+	inline static const std::string kProjectionPinholeStr{ "pinhole" };
+	inline static const std::string kProjectionOrthographicStr{ "orthographic" };
+	inline static const std::string kProjectionThinLensStr{ "thin_lens" };
+	inline static const std::string kOrthographicHeightStr{ "orthographic_height" };
+	inline static const std::string kApertureRadiusStr{ "aperture_radius" };
+	inline static const std::string kFocusDistanceStr{ "focus_distance" };
 	inline static const std::string kLightsStr{ "lights" };
 	inline static const std::string kIntensityStr{ "intensity" };
 	inline static const std::string kPositionStr{ "position" };
@@ -180,6 +467,7 @@ protected:
 	inline static const std::string kIorStr{ "ior" };
 	inline static const std::string kSmoothShadingStr{ "smooth_shading" };
 	inline static const std::string kMaterialIndexStr{ "material_index" };
+	inline static const std::string kCacheExtensionStr{ ".crtbin" };
 
 	const std::map<std::string, Material::Type> materialTypeMap = {
 		{ kTypeConstantStr, Material::Type::CONSTANT},
@@ -187,178 +475,911 @@ protected:
 		{ kTypeReflectiveStr, Material::Type::REFLECTIVE},
 		{ kTypeRefractiveStr, Material::Type::REFRACTIVE},
 	};
+
+	const std::map<std::string, Camera::Projection> projectionMap = {
+		{ kProjectionPinholeStr, Camera::Projection::PINHOLE},
+		{ kProjectionOrthographicStr, Camera::Projection::ORTHOGRAPHIC},
+		{ kProjectionThinLensStr, Camera::Projection::THIN_LENS},
+	};
+
+	// Streaming (SAX) scene reader. Numbers are written straight into the per-object vertex and index
+	// buffers, so no intermediate rapidjson::Document is ever built.
+	class SaxHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, SaxHandler>
+	{
+	public:
+		SaxHandler(Scene& scene) : scene(scene) {}
+
+		bool Null() { return true; }
+
+		bool Bool(bool b)
+		{
+			if (context.back() == Context::MATERIAL && key == kSmoothShadingStr)
+				material.smoothShading = b;
+			return true;
+		}
+
+		bool Int(int i) { return Number(static_cast<double>(i)); }
+		bool Int64(int64_t i) { return Number(static_cast<double>(i)); }
+		bool Uint64(uint64_t i) { return Number(static_cast<double>(i)); }
+		bool Double(double d) { return Number(d); }
+
+		bool Uint(unsigned u)
+		{
+			if (context.back() == Context::TRIANGLES)
+			{
+				indices.push_back(u);
+				return true;
+			}
+			return Number(static_cast<double>(u));
+		}
+
+		bool String(const char* str, rapidjson::SizeType length, bool)
+		{
+			if (context.back() == Context::MATERIAL && key == kTypeStr)
+			{
+				auto it = scene.materialTypeMap.find(std::string(str, length));
+				if (it == scene.materialTypeMap.end())
+					return fail("unknown material type");
+				material.type = it->second;
+			}
+			else if (context.back() == Context::CAMERA && key == kProjectionStr)
+			{
+				auto it = scene.projectionMap.find(std::string(str, length));
+				if (it == scene.projectionMap.end())
+					return fail("unknown camera projection");
+				scene.camera.projection = it->second;
+			}
+			return true;
+		}
+
+		bool Key(const char* str, rapidjson::SizeType length, bool)
+		{
+			key.assign(str, length);
+			return true;
+		}
+
+		bool StartObject()
+		{
+			const Context parent = context.back();
+			Context child = Context::UNKNOWN;
+			if (parent == Context::NONE)
+			{
+				child = Context::ROOT;
+				foundScene = true;
+			}
+			else if (parent == Context::ROOT && key == kSceneSettingsStr)
+				child = Context::SETTINGS;
+			else if (parent == Context::ROOT && key == kCameraStr)
+				child = Context::CAMERA;
+			else if (parent == Context::SETTINGS && key == kImageSettingsStr)
+				child = Context::IMAGE_SETTINGS;
+			else if (parent == Context::LIGHTS)
+			{
+				child = Context::LIGHT;
+				light = Light{};
+			}
+			else if (parent == Context::MATERIALS)
+			{
+				child = Context::MATERIAL;
+				material = Material{};
+			}
+			else if (parent == Context::OBJECTS)
+			{
+				child = Context::OBJECT;
+				materialIndex = 0;
+			}
+			context.push_back(child);
+			return true;
+		}
+
+		bool EndObject(rapidjson::SizeType)
+		{
+			switch (context.back())
+			{
+			case Context::CAMERA:
+				scene.camera.transform = MakeTranslation(cameraPosition) * cameraRotation;
+				break;
+			case Context::LIGHT:
+				scene.lights.push_back(light);
+				break;
+			case Context::MATERIAL:
+				scene.materials.push_back(material);
+				break;
+			case Context::OBJECT:
+				if (vertexComponentCount != 0)
+					return fail("the vertex coordinates are not a multiple of 3");
+				scene.addMesh(std::move(vertices), std::move(indices), materialIndex);
+				vertices = {};
+				indices = {};
+				break;
+			default:
+				break;
+			}
+			context.pop_back();
+			return true;
+		}
+
+		bool StartArray()
+		{
+			const Context parent = context.back();
+			if (parent == Context::NONE)
+				return fail(kNotAnObject);
+			Context child = Context::UNKNOWN;
+			if (parent == Context::ROOT && key == kLightsStr)
+				child = Context::LIGHTS;
+			else if (parent == Context::ROOT && key == kMaterialsStr)
+				child = Context::MATERIALS;
+			else if (parent == Context::ROOT && key == kObjectsStr)
+				child = Context::OBJECTS;
+			else if (parent == Context::OBJECT && key == kVerticesStr)
+				child = Context::VERTICES;
+			else if (parent == Context::OBJECT && key == kTrianglesStr)
+				child = Context::TRIANGLES;
+			else if (parent == Context::SETTINGS || parent == Context::CAMERA || parent == Context::LIGHT || parent == Context::MATERIAL)
+			{
+				child = Context::NUMBERS;
+				numberCount = 0;
+			}
+			context.push_back(child);
+			return true;
+		}
+
+		bool EndArray(rapidjson::SizeType)
+		{
+			const Context current = context.back();
+			context.pop_back();
+			if (current != Context::NUMBERS)
+				return true;
+
+			const Context parent = context.back();
+			if (parent == Context::SETTINGS && key == kBackgroundColorStr)
+				return numbersToVector(scene.settings.backgroundColor);
+			else if (parent == Context::CAMERA && key == kPositionStr)
+				return numbersToVector(cameraPosition);
+			else if (parent == Context::CAMERA && key == kMatrixStr)
+			{
+				if (numberCount != 9)
+					return fail("a matrix does not have 9 elements");
+				for (uint32_t i = 0; i < 3; i++)
+				{
+					for (uint32_t j = 0; j < 3; j++)
+						cameraRotation(i, j) = numbers[i + 3 * j];
+				}
+			}
+			else if (parent == Context::LIGHT && key == kPositionStr)
+				return numbersToVector(light.position);
+			else if (parent == Context::MATERIAL && key == kAlbedoStr)
+				return numbersToVector(material.albedo);
+			return true;
+		}
+
+		// Why the handler stopped the parse, empty if it did not
+		const std::string& GetError() const { return error; }
+
+		// Whether the document was an object, as a scene has to be
+		bool FoundScene() const { return foundScene; }
+
+		static constexpr const char* kNotAnObject = "the scene is not a JSON object";
+
+	private:
+		enum class Context
+		{
+			NONE,
+			ROOT,
+			SETTINGS,
+			IMAGE_SETTINGS,
+			CAMERA,
+			LIGHTS,
+			LIGHT,
+			MATERIALS,
+			MATERIAL,
+			OBJECTS,
+			OBJECT,
+			VERTICES,
+			TRIANGLES,
+			NUMBERS,	// Small fixed-size array (vector, matrix) of the enclosing object
+			UNKNOWN
+		};
+
+		bool Number(double value)
+		{
+			switch (context.back())
+			{
+			case Context::VERTICES:
+				vertexComponents[vertexComponentCount++] = static_cast<float>(value);
+				if (vertexComponentCount == 3)
+				{
+					vertices.emplace_back(vertexComponents[0], vertexComponents[1], vertexComponents[2]);
+					vertexComponentCount = 0;
+				}
+				break;
+			case Context::TRIANGLES:
+				// Whole non-negative numbers come in through Uint()
+				return fail("a triangle index is not a whole number");
+			case Context::NUMBERS:
+				if (numberCount == std::size(numbers))
+					return fail("too many numbers in an array");
+				numbers[numberCount++] = static_cast<float>(value);
+				break;
+			case Context::IMAGE_SETTINGS:
+				if ((key == kImageWidthStr || key == kImageHeightStr) && !(value >= 0.0 && value <= std::numeric_limits<uint32_t>::max()))
+					return fail("invalid image size");
+				if (key == kImageWidthStr)
+					scene.settings.imageSettings.width = static_cast<uint32_t>(value);
+				else if (key == kImageHeightStr)
+					scene.settings.imageSettings.height = static_cast<uint32_t>(value);
+				break;
+			case Context::CAMERA:
+				if (key == kOrthographicHeightStr)
+					scene.camera.orthographicHeight = static_cast<float>(value);
+				else if (key == kApertureRadiusStr)
+					scene.camera.apertureRadius = static_cast<float>(value);
+				else if (key == kFocusDistanceStr)
+					scene.camera.focusDistance = static_cast<float>(value);
+				break;
+			case Context::LIGHT:
+				if (key == kIntensityStr)
+					light.intensity = static_cast<float>(value) * 0.1f; // lights seems to be too bright
+				break;
+			case Context::MATERIAL:
+				if (key == kIorStr)
+					material.ior = static_cast<float>(value);
+				break;
+			case Context::OBJECT:
+				if (key == kMaterialIndexStr)
+				{
+					if (!(value >= 0.0 && value <= std::numeric_limits<uint32_t>::max()))
+						return fail("invalid material index");
+					materialIndex = static_cast<uint32_t>(value);
+				}
+				break;
+			default:
+				break;
+			}
+			return true;
+		}
+
+		bool numbersToVector(Vector3& vector)
+		{
+			if (numberCount != 3)
+				return fail("a vector does not have 3 components");
+			vector = Vector3{ numbers[0], numbers[1], numbers[2] };
+			return true;
+		}
+
+		// Stops the parse
+		bool fail(const char* message)
+		{
+			error = message;
+			return false;
+		}
+
+		Scene& scene;
+		std::vector<Context> context{ Context::NONE };
+		std::string key;
+		std::string error;
+		bool foundScene = false;
+
+		float numbers[9];
+		uint32_t numberCount = 0;
+
+		Light light;
+		Material material;
+		Matrix4 cameraRotation = Matrix4::Identity();
+		Vector3 cameraPosition{ 0.f };
+
+		std::vector<Vector3> vertices;
+		std::vector<uint32_t> indices;
+		float vertexComponents[3];
+		uint32_t vertexComponentCount = 0;
+		uint32_t materialIndex = 0;
+	};
 	
 	void parseSceneFile(const std::string& fileName)
 	{
 		using namespace rapidjson;
-		Document doc = getJsonDocument(fileName);
+		TraceScope trace("parse scene (DOM)", [&] { return fileName; });
+		JsonText text(fileName);
+		JsonArena arena(JsonArena::CapacityFor(text.Size()));
+		Document doc(&arena.Allocator());
+		doc.ParseInsitu(text.Data());
+
+		if (doc.HasParseError())
+			throw SceneLoadError(std::string(GetParseError_En(doc.GetParseError())) + " (offset " + std::to_string(doc.GetErrorOffset()) + ")");
+		if (!doc.IsObject())
+			throw SceneLoadError("the scene is not a JSON object");
+
 		settings.sceneName = fileName;
 
-		const Value& settingsVal = doc.FindMember(kSceneSettingsStr.c_str())->value;
-		if (!settingsVal.IsNull() && settingsVal.IsObject())
+		// Member of an object, nullptr when it is missing
+		auto find = [](const Value& object, const std::string& name) -> const Value*
+			{
+				const auto it = object.FindMember(name.c_str());
+				return it != object.MemberEnd() ? &it->value : nullptr;
+			};
+		// Member that has to be there, of the type isType accepts
+		auto require = [&](const Value& object, const std::string& name, bool (Value::*isType)() const) -> const Value&
+			{
+				const Value* value = find(object, name);
+				if (!value || !(value->*isType)())
+					throw SceneLoadError("\"" + name + "\" is missing or of the wrong type");
+				return *value;
+			};
+
+		const Value* settingsVal = find(doc, kSceneSettingsStr);
+		if (settingsVal && settingsVal->IsObject())
 		{
-			const Value& bgColorVal = settingsVal.FindMember(kBackgroundColorStr.c_str())->value;
-			assert(!bgColorVal.IsNull() && bgColorVal.IsArray());
-			settings.backgroundColor = loadVector(bgColorVal.GetArray());
+			settings.backgroundColor = loadVector(require(*settingsVal, kBackgroundColorStr, &Value::IsArray).GetArray());
 
-			const Value& imageSettingsVal = settingsVal.FindMember(kImageSettingsStr.c_str())->value;
-			if (!imageSettingsVal.IsNull() && imageSettingsVal.IsObject())
+			const Value* imageSettingsVal = find(*settingsVal, kImageSettingsStr);
+			if (imageSettingsVal && imageSettingsVal->IsObject())
 			{
-				const Value& imageWidthVal = imageSettingsVal.FindMember(kImageWidthStr.c_str())->value;
-				const Value& imageHeightVal = imageSettingsVal.FindMember(kImageHeightStr.c_str())->value;
-				assert(!imageWidthVal.IsNull() && imageWidthVal.IsInt() && !imageHeightVal.IsNull() && imageHeightVal.IsInt());
-				settings.imageSettings.width = imageWidthVal.GetInt();
-				settings.imageSettings.height = imageHeightVal.GetInt();
+				settings.imageSettings.width = require(*imageSettingsVal, kImageWidthStr, &Value::IsUint).GetUint();
+				settings.imageSettings.height = require(*imageSettingsVal, kImageHeightStr, &Value::IsUint).GetUint();
 			}
 		}
 
-		const Value& cameraVal = doc.FindMember(kCameraStr.c_str())->value;
-		if (!cameraVal.IsNull() && cameraVal.IsObject())
+		const Value* cameraVal = find(doc, kCameraStr);
+		if (cameraVal && cameraVal->IsObject())
 		{
-			const Value& matrixVal = cameraVal.FindMember(kMatrixStr.c_str())->value;
-			assert(!matrixVal.IsNull() && matrixVal.IsArray());
-			Matrix4 rotation = loadMatrix(matrixVal.GetArray());
-
-			const Value& positionVal = cameraVal.FindMember(kPositionStr.c_str())->value;
-			assert(!positionVal.IsNull() && positionVal.IsArray());
-			Matrix4 translation = MakeTranslation(loadVector(positionVal.GetArray()));
+			Matrix4 rotation = loadMatrix(require(*cameraVal, kMatrixStr, &Value::IsArray).GetArray());
+			Matrix4 translation = MakeTranslation(loadVector(require(*cameraVal, kPositionStr, &Value::IsArray).GetArray()));
 
 			camera.transform =  translation * rotation;
+
+			// The projection and its parameters are optional, the default is the pinhole camera
+			if (find(*cameraVal, kProjectionStr))
+			{
+				const auto projectionIt = projectionMap.find(require(*cameraVal, kProjectionStr, &Value::IsString).GetString());
+				if (projectionIt == projectionMap.end())
+					throw SceneLoadError("unknown camera projection");
+				camera.projection = projectionIt->second;
+			}
+			auto loadOptionalFloat = [&](const std::string& name, float& value)
+				{
+					if (find(*cameraVal, name))
+						value = require(*cameraVal, name, &Value::IsNumber).GetFloat();
+				};
+			loadOptionalFloat(kOrthographicHeightStr, camera.orthographicHeight);
+			loadOptionalFloat(kApertureRadiusStr, camera.apertureRadius);
+			loadOptionalFloat(kFocusDistanceStr, camera.focusDistance);
 		}
 
-		const Value& lightsValue = doc.FindMember(kLightsStr.c_str())->value;
-		if (!lightsValue.IsNull() && lightsValue.IsArray())
+		const Value* lightsValue = find(doc, kLightsStr);
+		if (lightsValue && lightsValue->IsArray())
 		{
-			for (Value::ConstValueIterator it = lightsValue.Begin(); it != lightsValue.End(); ++it)
+			for (const Value& lightValue : lightsValue->GetArray())
 			{
+				if (!lightValue.IsObject())
+					throw SceneLoadError("a light is not an object");
 				Light light;
-				const Value& intensityValue = it->FindMember(kIntensityStr.c_str())->value;
-				assert(!intensityValue.IsNull() && intensityValue.IsInt());
-				light.intensity = static_cast<float>(intensityValue.GetInt()) * 0.1f; // lights seems to be too bright
-
-				const Value& positionVal = it->FindMember(kPositionStr.c_str())->value;
-				assert(!positionVal.IsNull() && positionVal.IsArray());
-				light.position = loadVector(positionVal.GetArray());
+				light.intensity = static_cast<float>(require(lightValue, kIntensityStr, &Value::IsInt).GetInt()) * 0.1f; // lights seems to be too bright
+				light.position = loadVector(require(lightValue, kPositionStr, &Value::IsArray).GetArray());
 
 				lights.push_back(light);
 			}
 		}
 
-		const Value& materialsValue = doc.FindMember(kMaterialsStr.c_str())->value;
-		if (!materialsValue.IsNull() && materialsValue.IsArray())
+		const Value* materialsValue = find(doc, kMaterialsStr);
+		if (materialsValue && materialsValue->IsArray())
 		{
-			for (Value::ConstValueIterator it = materialsValue.Begin(); it != materialsValue.End(); ++it)
+			for (const Value& materialValue : materialsValue->GetArray())
 			{
-				Material material;
+				if (!materialValue.IsObject())
+					throw SceneLoadError("a material is not an object");
+				Material material{};
 
-				const Value& typeValue = it->FindMember(kTypeStr.c_str())->value;
-				assert(!typeValue.IsNull() && typeValue.IsString());
-				const auto typeStr = std::string(typeValue.GetString());
-				material.type = materialTypeMap.at(typeStr);
+				const auto typeIt = materialTypeMap.find(require(materialValue, kTypeStr, &Value::IsString).GetString());
+				if (typeIt == materialTypeMap.end())
+					throw SceneLoadError("unknown material type");
+				material.type = typeIt->second;
+				// A refractive material without an index of refraction keeps the default, as with the SAX parser
 				if (material.type == Material::Type::REFRACTIVE)
 				{
-					const Value& iorVal = it->FindMember(kIorStr.c_str())->value;
-					assert(!iorVal.IsNull() && iorVal.IsFloat());
-					material.ior = iorVal.GetFloat();
-
-				} else {
-					const Value& albedoVal = it->FindMember(kAlbedoStr.c_str())->value;
-					assert(!albedoVal.IsNull() && albedoVal.IsArray());
-					material.albedo = loadVector(albedoVal.GetArray());
+					if (find(materialValue, kIorStr))
+						material.ior = require(materialValue, kIorStr, &Value::IsNumber).GetFloat();
 				}
+				else
+					material.albedo = loadVector(require(materialValue, kAlbedoStr, &Value::IsArray).GetArray());
 
-				const Value& smoothShadingVal = it->FindMember(kSmoothShadingStr.c_str())->value;
-				assert(!smoothShadingVal.IsNull() && smoothShadingVal.IsBool());
-				material.smoothShading = smoothShadingVal.GetBool();
+				material.smoothShading = require(materialValue, kSmoothShadingStr, &Value::IsBool).GetBool();
 
 				materials.push_back(material);
 			}
 		}
 
-		const Value& objectsValue = doc.FindMember(kObjectsStr.c_str())->value;
-		if(!objectsValue.IsNull() && objectsValue.IsArray()) 
+		const Value* objectsValue = find(doc, kObjectsStr);
+		if (objectsValue && objectsValue->IsArray())
 		{
-			for(Value::ConstValueIterator it = objectsValue.Begin(); it != objectsValue.End(); ++it)
+			// The document is only read from here on, so objects can be loaded concurrently. Their errors are
+			// collected and the first one thrown once all are done, as none may leave a worker thread.
+			pendingMeshes.resize(objectsValue->Size());
+			std::vector<std::string> objectErrors(objectsValue->Size());
+			ParallelFor(objectsValue->Size(), 1, [&](size_t objectIndex)
+				{
+					try
+					{
+						const Value& objectValue = (*objectsValue)[static_cast<SizeType>(objectIndex)];
+						if (!objectValue.IsObject())
+							throw SceneLoadError("not an object");
+						MeshData& data = pendingMeshes[objectIndex];
+						data.vertices = loadVertices(require(objectValue, kVerticesStr, &Value::IsArray).GetArray());
+						data.indices = loadIndices(require(objectValue, kTrianglesStr, &Value::IsArray).GetArray());
+						data.materialIndex = require(objectValue, kMaterialIndexStr, &Value::IsUint).GetUint();
+					}
+					catch (const SceneLoadError& error)
+					{
+						objectErrors[objectIndex] = error.what();
+					}
+				});
+			for (size_t i = 0; i < objectErrors.size(); ++i)
 			{
-				Mesh mesh;
+				if (!objectErrors[i].empty())
+					throw SceneLoadError("object " + std::to_string(i) + ": " + objectErrors[i]);
+			}
+		}
+	}
 
-				const Value& verticesValue = it->FindMember(kVerticesStr.c_str())->value;
-				assert(!verticesValue.IsNull() && verticesValue.IsArray());
-				std::vector<Vector3> vertices = loadVertices(verticesValue.GetArray());
+	void parseSceneFileSax(const std::string& fileName)
+	{
+		using namespace rapidjson;
+		TraceScope trace("parse scene (SAX)", [&] { return fileName; });
+		settings.sceneName = fileName;
 
-				const Value& trianglesValue = it->FindMember(kTrianglesStr.c_str())->value;
-				assert(!trianglesValue.IsNull() && trianglesValue.IsArray());
-				std::vector<uint32_t> indices = loadIndices(trianglesValue.GetArray());
+		JsonText text(fileName);
+		InsituStringStream stream(text.Data());
+		SaxHandler handler(*this);
+		Reader reader;
+		ParseResult result = reader.Parse<kParseInsituFlag>(stream, handler);
 
-				// Compute vertex normals
-				std::vector<Vector3> vertexNormals(vertices.size(), { 0.0f, 0.0f, 0.0f });
-				for (uint32_t i = 0; i < indices.size(); i += 3)
-				{
-					const auto& i0 = indices[i];
-					const auto& i1 = indices[i + 1];
-					const auto& i2 = indices[i + 2];
-					const auto& v0 = vertices[i0];
-					const auto& v1 = vertices[i1];
-					const auto& v2 = vertices[i2];
-					Vector3 faceNormal = Normalize(Cross(v1 - v0, v2 - v0));
-
-					vertexNormals[i0] += faceNormal;
-					vertexNormals[i1] += faceNormal;
-					vertexNormals[i2] += faceNormal;
-				}
-				// Normalize
-				for (uint32_t i = 0; i < vertexNormals.size(); ++i)
-					vertexNormals[i] = Normalize(vertexNormals[i]);
+		if (result.IsError())
+		{
+			const std::string message = handler.GetError().empty() ? GetParseError_En(result.Code()) : handler.GetError();
+			throw SceneLoadError(message + " (offset " + std::to_string(result.Offset()) + ")");
+		}
+		if (!handler.FoundScene())
+			throw SceneLoadError(SaxHandler::kNotAnObject);
+	}
 
+	// Geometry of one object as read from the file, waiting for buildMeshes()
+	struct MeshData
+	{
+		std::vector<Vector3> vertices;
+		std::vector<uint32_t> indices;
+		std::vector<uint32_t> normals;	// Octahedral encoded, filled in by buildMeshes() for smooth shaded meshes
+		uint32_t materialIndex = 0;
+	};
 
-				mesh.triangles.reserve(indices.size() / 3);
-				for (uint32_t i = 0; i < indices.size(); i += 3)
+	// Meshes with at least this many triangles are processed by all threads at once instead of one thread per mesh
+	static constexpr size_t kParallelMeshTriangles = 1 << 16;
+	static constexpr size_t kParallelGrainSize = 4096;
+
+	void addMesh(std::vector<Vector3>&& vertices, std::vector<uint32_t>&& indices, uint32_t materialIndex)
+	{
+		pendingMeshes.push_back({ std::move(vertices), std::move(indices), {}, materialIndex });
+	}
+
+	// What the parsed meshes refer to, checked once for both parsers
+	void validateMeshes() const
+	{
+		for (size_t i = 0; i < pendingMeshes.size(); ++i)
+		{
+			const MeshData& data = pendingMeshes[i];
+			const char* error = nullptr;
+			if (data.indices.size() % 3 != 0)
+				error = "the triangle indices are not a multiple of 3";
+			else if (data.materialIndex >= materials.size())
+				error = "the material index is out of range";
+			else if (std::any_of(data.indices.begin(), data.indices.end(), [&](uint32_t index) { return index >= data.vertices.size(); }))
+				error = "a triangle index is out of range";
+			if (error)
+				throw SceneLoadError("object " + std::to_string(i) + ": " + error);
+		}
+	}
+
+	// Optimizes the pending meshes and computes their vertex normals where the material needs them, then packs
+	// everything into the geometry arena
+	void buildMeshes(const LoadOptions& options)
+	{
+		TraceScope trace("build meshes");
+		std::vector<MeshOptimizationStats> meshOptimizationStats(pendingMeshes.size());
+
+		auto processMesh = [&](size_t pendingIndex, bool parallel)
+			{
+				MeshData& data = pendingMeshes[pendingIndex];
+				auto meshDetail = [&] { return "mesh " + std::to_string(pendingIndex) + ", " + std::to_string(data.indices.size() / 3) + " triangles"; };
+				if (options.optimizeMeshes)
+				{
+					TraceScope optimizeTrace("optimize mesh", meshDetail);
+					meshOptimizationStats[pendingIndex] = OptimizeMesh(data.vertices, data.indices, options.weldTolerance);
+				}
+				if (isSmoothShaded(data.materialIndex))
 				{
-					const auto& i0 = indices[i];
-					const auto& i1 = indices[i + 1];
-					const auto& i2 = indices[i + 2];
-					const auto& v0 = vertices[i0];
-					const auto& v1 = vertices[i1];
-					const auto& v2 = vertices[i2];
-					const auto& n0 = vertexNormals[i0];
-					const auto& n1 = vertexNormals[i1];
-					const auto& n2 = vertexNormals[i2];
-					mesh.triangles.emplace_back(
-						Vertex{v0, n0},
-						Vertex{v1, n1},
-						Vertex{v2, n2}
-					);
+					TraceScope normalsTrace("compute normals", meshDetail);
+					data.normals = encodeVertexNormals(data.vertices, data.indices, parallel);
 				}
+			};
+
+		std::vector<size_t> smallMeshes;
+		std::vector<size_t> largeMeshes;
+		for (size_t i = 0; i < pendingMeshes.size(); ++i)
+		{
+			if (pendingMeshes[i].indices.size() / 3 >= kParallelMeshTriangles)
+				largeMeshes.push_back(i);
+			else
+				smallMeshes.push_back(i);
+		}
+
+		ParallelFor(smallMeshes.size(), 1, [&](size_t i) { processMesh(smallMeshes[i], false); });
+		for (size_t i : largeMeshes)
+			processMesh(i, true);
+
+		if (options.optimizeMeshes)
+		{
+			optimizationStats = {};
+			for (const auto& stats : meshOptimizationStats)
+				optimizationStats += stats;
+			optimizationStats.Print(settings.sceneName);
+		}
+
+		packMeshes();
+	}
+
+	// Lays the pending meshes out one after another in a single arena and releases their buffers
+	void packMeshes()
+	{
+		TraceScope trace("pack meshes");
+		GeometryArena::Counts counts;
+		uint64_t triangleCount = 0;
+		meshes.resize(pendingMeshes.size());
+		for (size_t i = 0; i < pendingMeshes.size(); ++i)
+		{
+			const MeshData& data = pendingMeshes[i];
+			Mesh& mesh = meshes[i];
+			mesh.materialIndex = data.materialIndex;
+			mesh.firstTriangle = static_cast<uint32_t>(triangleCount);
+			mesh.triangleCount = static_cast<uint32_t>(data.indices.size() / 3);
+			mesh.firstVertex = static_cast<uint32_t>(counts.vertexCount);
+			mesh.vertexCount = static_cast<uint32_t>(data.vertices.size());
+			mesh.wideIndices = data.vertices.size() > GeometryArena::kMaxNarrowVertices;
+			mesh.firstIndex = mesh.wideIndices ? counts.index32Count : counts.index16Count;
+			if (!data.normals.empty())
+			{
+				mesh.firstNormal = static_cast<uint32_t>(counts.normalCount);
+				counts.normalCount += data.normals.size();
+			}
+
+			triangleCount += mesh.triangleCount;
+			counts.vertexCount += data.vertices.size();
+			(mesh.wideIndices ? counts.index32Count : counts.index16Count) += 3 * size_t(mesh.triangleCount);
+		}
+		if (triangleCount > std::numeric_limits<uint32_t>::max() || counts.vertexCount > std::numeric_limits<uint32_t>::max())
+			throw SceneLoadError("more than 2^32 triangles or vertices");
+
+		geometry = GeometryArena(counts);
+		ParallelFor(meshes.size(), 1, [&](size_t i)
+			{
+				MeshData& data = pendingMeshes[i];
+				const Mesh& mesh = meshes[i];
+				std::copy(data.vertices.begin(), data.vertices.end(), geometry.Positions() + mesh.firstVertex);
+				std::copy(data.normals.begin(), data.normals.end(), geometry.Normals() + (mesh.HasNormals() ? mesh.firstNormal : 0));
+				const size_t indexCount = 3 * size_t(mesh.triangleCount);
+				if (mesh.wideIndices)
+					std::copy_n(data.indices.begin(), indexCount, geometry.Indices32() + mesh.firstIndex);
+				else
+					std::transform(data.indices.begin(), data.indices.begin() + indexCount, geometry.Indices16() + mesh.firstIndex, [](uint32_t index) { return static_cast<uint16_t>(index); });
+				data = MeshData{};
+			});
+
+		pendingMeshes.clear();
+		pendingMeshes.shrink_to_fit();
+	}
 
-				const Value& materialIndexValue = it->FindMember(kMaterialIndexStr.c_str())->value;
-				assert(!materialIndexValue.IsNull() && materialIndexValue.IsInt());
-				mesh.materialIndex = materialIndexValue.GetInt();
+	bool isSmoothShaded(uint32_t materialIndex) const
+	{
+		return materialIndex < materials.size() && materials[materialIndex].smoothShading;
+	}
+
+	static std::vector<uint32_t> encodeVertexNormals(std::span<const Vector3> vertices, std::span<const uint32_t> indices, bool parallel)
+	{
+		const std::vector<Vector3> vertexNormals = computeVertexNormals(vertices, indices, parallel);
+		std::vector<uint32_t> normals(vertexNormals.size());
+		auto encode = [&](size_t i) { normals[i] = EncodeOctahedral(vertexNormals[i]); };
+		if (parallel)
+			ParallelFor(vertexNormals.size(), kParallelGrainSize, encode);
+		else
+		{
+			for (size_t i = 0; i < vertexNormals.size(); ++i)
+				encode(i);
+		}
+		return normals;
+	}
+
+	static std::vector<Vector3> computeVertexNormals(std::span<const Vector3> vertices, std::span<const uint32_t> indices, bool parallel)
+	{
+		std::vector<Vector3> vertexNormals(vertices.size(), { 0.0f, 0.0f, 0.0f });
+		if (!parallel)
+		{
+			for (uint32_t i = 0; i < indices.size(); i += 3)
+			{
+				const auto& i0 = indices[i];
+				const auto& i1 = indices[i + 1];
+				const auto& i2 = indices[i + 2];
+				const auto& v0 = vertices[i0];
+				const auto& v1 = vertices[i1];
+				const auto& v2 = vertices[i2];
+				Vector3 faceNormal = Normalize(Cross(v1 - v0, v2 - v0));
 
-				meshes.push_back(mesh);
+				vertexNormals[i0] += faceNormal;
+				vertexNormals[i1] += faceNormal;
+				vertexNormals[i2] += faceNormal;
 			}
+			// Normalize
+			for (uint32_t i = 0; i < vertexNormals.size(); ++i)
+				vertexNormals[i] = Normalize(vertexNormals[i]);
+
+			return vertexNormals;
 		}
 
+		// Face normals are computed in parallel, then each vertex gathers the normals of its faces through a
+		// vertex -> face adjacency list. No two threads write the same vertex, and faces are listed in index
+		// order, so the sums come out bit-identical to the serial loop above.
+		const size_t triangleCount = indices.size() / 3;
+		std::vector<Vector3> faceNormals(triangleCount);
+		ParallelFor(triangleCount, kParallelGrainSize, [&](size_t t)
+			{
+				const auto& v0 = vertices[indices[3 * t]];
+				const auto& v1 = vertices[indices[3 * t + 1]];
+				const auto& v2 = vertices[indices[3 * t + 2]];
+				faceNormals[t] = Normalize(Cross(v1 - v0, v2 - v0));
+			});
+
+		std::vector<uint32_t> faceOffsets(vertices.size() + 1, 0);
+		for (uint32_t index : indices)
+			++faceOffsets[index + 1];
+		for (size_t i = 0; i < vertices.size(); ++i)
+			faceOffsets[i + 1] += faceOffsets[i];
+
+		std::vector<uint32_t> adjacentFaces(indices.size());
+		std::vector<uint32_t> fillPosition(faceOffsets.begin(), faceOffsets.end() - 1);
+		for (uint32_t i = 0; i < indices.size(); ++i)
+			adjacentFaces[fillPosition[indices[i]]++] = i / 3;
+
+		ParallelFor(vertices.size(), kParallelGrainSize, [&](size_t i)
+			{
+				Vector3 normal{ 0.f };
+				for (uint32_t k = faceOffsets[i]; k < faceOffsets[i + 1]; ++k)
+					normal += faceNormals[adjacentFaces[k]];
+				vertexNormals[i] = Normalize(normal);
+			});
+
+		return vertexNormals;
 	}
 
-	rapidjson::Document getJsonDocument(const std::string& fileName)
+	// Binary scene cache (.crtbin). The file is the header followed by 16-byte aligned flat arrays of lights,
+	// materials and meshes, then the geometry arena as is, on a 64-byte boundary. It is only ever read back by the
+	// same build, so the structs are stored in their in-memory layout and guarded by kCacheVersion.
+	static constexpr char kCacheMagic[8] = { 'C', 'R', 'T', 'B', 'I', 'N', '\0', '\0' };
+	static constexpr uint32_t kCacheVersion = 6;
+
+	struct CacheHeader
 	{
-		using namespace rapidjson;
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t lightCount;
+		uint32_t materialCount;
+		uint32_t meshCount;
+		uint32_t optimizeMeshes;
+		float weldTolerance;
+		uint64_t sourceHash;
+		GeometryArena::Counts geometryCounts;
+		MeshOptimizationStats optimizationStats;	// So a load from the cache reports what the optimize pass did
+		Vector3 backgroundColor;
+		Camera camera;
+	};
 
-		std::ifstream ifs(fileName);
-		assert(ifs.is_open());
+	struct CacheLayout
+	{
+		size_t lightsOffset;
+		size_t materialsOffset;
+		size_t meshesOffset;
+		size_t geometryOffset;
+		size_t totalSize;
+	};
 
-		IStreamWrapper isw(ifs);
-		Document doc;
-		doc.ParseStream(isw);
+	static CacheLayout computeCacheLayout(const CacheHeader& header, size_t geometrySize)
+	{
+		auto align = [](size_t offset, size_t alignment) { return (offset + alignment - 1) & ~(alignment - 1); };
 
-		if (doc.HasParseError())
+		CacheLayout layout;
+		layout.lightsOffset = align(sizeof(CacheHeader), 16);
+		layout.materialsOffset = align(layout.lightsOffset + header.lightCount * sizeof(Light), 16);
+		layout.meshesOffset = align(layout.materialsOffset + header.materialCount * sizeof(Material), 16);
+		layout.geometryOffset = align(layout.meshesOffset + header.meshCount * sizeof(Mesh), GeometryArena::kAlignment);
+		layout.totalSize = layout.geometryOffset + geometrySize;
+		return layout;
+	}
+
+	bool loadCache(const std::string& cacheFileName, uint64_t sourceHash, const LoadOptions& options)
+	{
+		TraceScope trace("load cache", [&] { return cacheFileName; });
+		MappedFile file(cacheFileName, MappedFile::Access::COPY_ON_WRITE);
+		if (!file.IsOpen() || file.Size() < sizeof(CacheHeader))
+			return false;
+
+		CacheHeader header;
+		std::memcpy(&header, file.Data(), sizeof(header));
+		if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion || header.sourceHash != sourceHash)
+			return false;
+		if (header.optimizeMeshes != static_cast<uint32_t>(options.optimizeMeshes) || (options.optimizeMeshes && header.weldTolerance != options.weldTolerance))
+			return false;
+
+		// Every element takes at least two bytes, so counts the file cannot hold are rejected before they overflow
+		const GeometryArena::Counts& counts = header.geometryCounts;
+		if (std::max({ counts.vertexCount, counts.normalCount, counts.index32Count, counts.index16Count }) > file.Size())
+			return false;
+		const CacheLayout layout = computeCacheLayout(header, GeometryArena::SizeFor(counts));
+		if (layout.totalSize != file.Size())
+			return false;
+
+		const char* base = file.Data();
+		std::span<const Light> cachedLights{ reinterpret_cast<const Light*>(base + layout.lightsOffset), header.lightCount };
+		std::span<const Material> cachedMaterials{ reinterpret_cast<const Material*>(base + layout.materialsOffset), header.materialCount };
+		std::span<const Mesh> cachedMeshes{ reinterpret_cast<const Mesh*>(base + layout.meshesOffset), header.meshCount };
+
+		for (const auto& mesh : cachedMeshes)
 		{
-			std::cout << "Error : " << doc.GetParseError() << '\n';
-			std::cout << "Offset : " << doc.GetErrorOffset() << '\n';
-			assert(false);
+			const uint64_t indexCount = mesh.wideIndices ? counts.index32Count : counts.index16Count;
+			if (mesh.firstVertex + uint64_t(mesh.vertexCount) > counts.vertexCount || mesh.firstIndex + 3 * uint64_t(mesh.triangleCount) > indexCount ||
+				(mesh.HasNormals() && mesh.firstNormal + uint64_t(mesh.vertexCount) > counts.normalCount) || mesh.materialIndex >= header.materialCount)
+				return false;
 		}
-		assert(doc.IsObject());
+		for (const auto& material : cachedMaterials)
+		{
+			// Read as a number, as the bytes need not hold a valid Type
+			std::underlying_type_t<Material::Type> type;
+			std::memcpy(&type, &material.type, sizeof(type));
+			if (type > Material::Type::REFRACTIVE)
+				return false;
+		}
+
+		// The geometry is not copied: the arena views it in the mapping and keeps the file mapped. Its pages are read
+		// in as the index check below and rendering first touch them.
+		GeometryArena cachedGeometry(counts, std::move(file), layout.geometryOffset);
 
-		return doc;	// RVO
+		// A damaged file could still point triangles outside their mesh, so every index is checked before use
+		std::atomic<bool> indicesValid = true;
+		ParallelFor(cachedMeshes.size(), 1, [&](size_t meshIndex)
+			{
+				const Mesh& mesh = cachedMeshes[meshIndex];
+				for (size_t i = 0; i < 3 * size_t(mesh.triangleCount); ++i)
+				{
+					if (cachedGeometry.Index(mesh, i) >= mesh.vertexCount)
+					{
+						indicesValid = false;
+						return;
+					}
+				}
+			});
+		if (!indicesValid)
+			return false;
+
+		settings.backgroundColor = header.backgroundColor;
+		settings.imageSettings = { header.width, header.height };
+		camera = header.camera;
+		optimizationStats = header.optimizationStats;
+		lights.assign(cachedLights.begin(), cachedLights.end());
+		materials.assign(cachedMaterials.begin(), cachedMaterials.end());
+		meshes.assign(cachedMeshes.begin(), cachedMeshes.end());
+		geometry = std::move(cachedGeometry);
+
+		return true;
 	}
+
+	// Copies of records in zeroed memory, filled field by field, so their padding goes to the file as zeros. The
+	// cache is then the same bytes on every save and never carries leftover memory.
+	template <typename Record, typename Fill>
+	static std::vector<char> zeroPaddedRecords(const std::vector<Record>& records, Fill fill)
+	{
+		std::vector<char> bytes(records.size() * sizeof(Record), 0);
+		for (size_t i = 0; i < records.size(); ++i)
+			fill(*reinterpret_cast<Record*>(bytes.data() + i * sizeof(Record)), records[i]);
+		return bytes;
+	}
+
+	void saveCache(const std::string& cacheFileName, uint64_t sourceHash, const LoadOptions& options) const
+	{
+		TraceScope trace("save cache", [&] { return cacheFileName; });
+		// In zeroed bytes like the records below, so the padding of the header goes to the file as zeros too
+		alignas(CacheHeader) unsigned char headerBytes[sizeof(CacheHeader)]{};
+		CacheHeader& header = *reinterpret_cast<CacheHeader*>(headerBytes);
+		std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+		header.version = kCacheVersion;
+		header.width = settings.imageSettings.width;
+		header.height = settings.imageSettings.height;
+		header.lightCount = static_cast<uint32_t>(lights.size());
+		header.materialCount = static_cast<uint32_t>(materials.size());
+		header.meshCount = static_cast<uint32_t>(meshes.size());
+		header.optimizeMeshes = options.optimizeMeshes;
+		header.weldTolerance = options.weldTolerance;
+		header.sourceHash = sourceHash;
+		header.geometryCounts = geometry.GetCounts();
+		header.optimizationStats = optimizationStats;
+		header.backgroundColor = settings.backgroundColor;
+		header.camera.transform = camera.transform;
+		header.camera.projection = camera.projection;
+		header.camera.orthographicHeight = camera.orthographicHeight;
+		header.camera.apertureRadius = camera.apertureRadius;
+		header.camera.focusDistance = camera.focusDistance;
+
+		const std::vector<char> lightRecords = zeroPaddedRecords(lights, [](Light& record, const Light& light)
+			{
+				record.intensity = light.intensity;
+				record.position = light.position;
+			});
+		const std::vector<char> materialRecords = zeroPaddedRecords(materials, [](Material& record, const Material& material)
+			{
+				record.type = material.type;
+				record.albedo = material.albedo;
+				record.ior = material.ior;
+				record.smoothShading = material.smoothShading;
+			});
+		const std::vector<char> meshRecords = zeroPaddedRecords(meshes, [](Mesh& record, const Mesh& mesh)
+			{
+				record.firstIndex = mesh.firstIndex;
+				record.firstTriangle = mesh.firstTriangle;
+				record.triangleCount = mesh.triangleCount;
+				record.firstVertex = mesh.firstVertex;
+				record.vertexCount = mesh.vertexCount;
+				record.firstNormal = mesh.firstNormal;
+				record.wideIndices = mesh.wideIndices;
+				record.materialIndex = mesh.materialIndex;
+			});
+
+		const CacheLayout layout = computeCacheLayout(header, geometry.Size());
+
+		// Write to a temporary file first so a concurrent reader never maps a half written cache. The name is
+		// unique to this writer: other processes loading the same scene (workers on one host, the render server
+		// next to the command line) may be writing their own copy at the same time.
+		std::ostringstream tempSuffix;
+		tempSuffix << ".tmp." << std::hex << std::random_device{}() << '.' << std::hash<std::thread::id>{}(std::this_thread::get_id());
+		const std::string tempFileName = cacheFileName + tempSuffix.str();
+		{
+			std::ofstream ofs(tempFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!ofs.is_open())
+				return;
+
+			auto writeAt = [&ofs](size_t offset, const void* data, size_t size)
+				{
+					static const char zeros[GeometryArena::kAlignment] = {};
+					const size_t position = static_cast<size_t>(ofs.tellp());
+					ofs.write(zeros, offset - position);
+					ofs.write(static_cast<const char*>(data), size);
+				};
+
+			writeAt(0, headerBytes, sizeof(headerBytes));
+			writeAt(layout.lightsOffset, lightRecords.data(), lightRecords.size());
+			writeAt(layout.materialsOffset, materialRecords.data(), materialRecords.size());
+			writeAt(layout.meshesOffset, meshRecords.data(), meshRecords.size());
+			writeAt(layout.geometryOffset, geometry.Data(), geometry.Size());
+
+			if (!ofs.good())
+			{
+				ofs.close();
+				std::error_code error;
+				std::filesystem::remove(tempFileName, error);
+				return;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(tempFileName, cacheFileName, error);
+		if (error)
+			std::filesystem::remove(tempFileName, error);
+	}
+
+	std::vector<MeshData> pendingMeshes;
+	MeshOptimizationStats optimizationStats;	// Of all meshes, when loaded with optimizeMeshes
 };
\ No newline at end of file
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "Math3D.hpp"
+#include "Parallel.hpp"
+#include "Scene.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Depth cube maps of the occluders around every light, for previews that trade exact shadows for speed. Each of the
+// six faces of a map is a 90 degree perspective view from the light down one axis, and each texel keeps the smallest
+// depth along that axis of the triangles covering its center. A point is lit as far as the four texels around its
+// projection see nothing in front of it, blended by its position between them (percentage closer filtering), so
+// shadow edges come out soft by about a texel instead of stair-stepped.
+class ShadowCubeMaps
+{
+public:
+	// Texels a side of a face at most: 96 MB of depths per light
+	static constexpr uint32_t kMaxResolution = 2048;
+
+	ShadowCubeMaps() = default;
+
+	// The resolution maps are built with when asked for this one
+	static uint32_t ClampResolution(uint32_t resolution) { return std::clamp(resolution, 1u, kMaxResolution); }
+
+	// Rasterizes every triangle that blocks shadow rays, so refractive meshes are left out as in Scene::AnyHit(),
+	// into resolution x resolution texels per face, clamped to kMaxResolution. The faces of all lights are spread
+	// over all threads.
+	static ShadowCubeMaps Build(const Scene& scene, const std::vector<Light>& lights, uint32_t resolution)
+	{
+		TraceScope trace("build shadow maps", [&] { return std::to_string(lights.size()) + " x 6 x " + std::to_string(resolution) + "^2"; });
+		ShadowCubeMaps maps;
+		maps.resolution = ClampResolution(resolution);
+		maps.lightPositions.reserve(lights.size());
+		for (const Light& light : lights)
+			maps.lightPositions.push_back(light.position);
+		maps.depths.assign(lights.size() * kFaceCount * maps.texelsPerFace(), std::numeric_limits<float>::infinity());
+
+		ParallelFor(lights.size() * kFaceCount, 1, [&](size_t face)
+			{
+				maps.rasterizeFace(scene, static_cast<uint32_t>(face / kFaceCount), static_cast<uint32_t>(face % kFaceCount));
+			});
+		return maps;
+	}
+
+	// Whether the maps were built for these lights at this resolution
+	bool Matches(const std::vector<Light>& lights, uint32_t mapResolution) const
+	{
+		return resolution == ClampResolution(mapResolution) && lights.size() == lightPositions.size()
+			&& std::equal(lights.begin(), lights.end(), lightPositions.begin(), [](const Light& light, const Vector3& position)
+				{
+					return light.position.x == position.x && light.position.y == position.y && light.position.z == position.z;
+				});
+	}
+
+	uint32_t GetResolution() const { return resolution; }
+
+	size_t MemoryBytes() const { return depths.size() * sizeof(float); }
+
+	// Fraction of the light that reaches point, on a surface with the geometric normal given: 0 in shadow, 1 lit
+	float Visibility(uint32_t light, const Vector3& point, const Vector3& normal) const
+	{
+		const Vector3& lightPosition = lightPositions[light];
+		const Vector3 toLight = lightPosition - point;
+		const float distance = Magnitude(toLight);
+
+		// Normal offset: the point moves off its surface, toward the light's side, by about a texel, so the
+		// depths its own surface left in the map do not shadow it
+		const float texelSize = distance * 2.f / static_cast<float>(resolution);
+		const Vector3 offsetNormal = Dot(normal, toLight) < 0.f ? -normal : normal;
+		const Vector3 offset = point + offsetNormal * (kNormalOffset * texelSize) - lightPosition;
+
+		const float components[3] = { offset.x, offset.y, offset.z };
+		const float absolute[3] = { std::abs(offset.x), std::abs(offset.y), std::abs(offset.z) };
+		const uint32_t axis = absolute[0] >= absolute[1] && absolute[0] >= absolute[2] ? 0 : (absolute[1] >= absolute[2] ? 1 : 2);
+		const float depth = absolute[axis];
+		if (!(depth > kNearDepth))
+			return 1.f;
+
+		const float* face = faceDepths(light, 2 * axis + (components[axis] < 0.f ? 1 : 0));
+		const float x = toTexel(components[(axis + 1) % 3] / depth) - 0.5f;
+		const float y = toTexel(components[(axis + 2) % 3] / depth) - 0.5f;
+		const float receiver = depth * (1.f - kDepthBias);
+		const float column = std::floor(x), row = std::floor(y);
+		const float fx = x - column, fy = y - row;
+		auto lit = [&](float texelColumn, float texelRow)
+			{
+				const int32_t last = static_cast<int32_t>(resolution) - 1;
+				const int32_t tx = std::clamp(static_cast<int32_t>(texelColumn), 0, last);
+				const int32_t ty = std::clamp(static_cast<int32_t>(texelRow), 0, last);
+				return receiver <= face[size_t(ty) * resolution + size_t(tx)] ? 1.f : 0.f;
+			};
+		return (lit(column, row) * (1.f - fx) + lit(column + 1.f, row) * fx) * (1.f - fy)
+			+ (lit(column, row + 1.f) * (1.f - fx) + lit(column + 1.f, row + 1.f) * fx) * fy;
+	}
+
+private:
+	static constexpr uint32_t kFaceCount = 6;		// +x, -x, +y, -y, +z, -z
+	static constexpr float kNearDepth = 1e-3f;		// Triangles are clipped to this depth in front of the light
+	static constexpr float kNormalOffset = 1.5f;	// In texels
+	static constexpr float kDepthBias = 2e-3f;		// Of the depth of the receiver
+
+	// A corner of a triangle in the coordinates of one face: x and y across it, z the depth down its axis
+	struct FaceVertex
+	{
+		float x, y, z;
+	};
+
+	size_t texelsPerFace() const { return size_t(resolution) * resolution; }
+
+	const float* faceDepths(uint32_t light, uint32_t face) const
+	{
+		return depths.data() + (size_t(light) * kFaceCount + face) * texelsPerFace();
+	}
+
+	// From x / z in [-1, 1] to [0, resolution]
+	float toTexel(float slope) const
+	{
+		return (slope * 0.5f + 0.5f) * static_cast<float>(resolution);
+	}
+
+	void rasterizeFace(const Scene& scene, uint32_t light, uint32_t face)
+	{
+		float* faceTexels = depths.data() + (size_t(light) * kFaceCount + face) * texelsPerFace();
+		const uint32_t axis = face / 2;
+		const float sign = face % 2 ? -1.f : 1.f;
+		const Vector3& lightPosition = lightPositions[light];
+
+		for (const Mesh& mesh : scene.meshes)
+		{
+			if (scene.materials[mesh.materialIndex].type == Material::Type::REFRACTIVE)
+				continue;
+			const Vector3* positions = scene.geometry.Positions(mesh);
+			for (uint32_t triangleIndex = 0; triangleIndex < mesh.triangleCount; ++triangleIndex)
+			{
+				FaceVertex corners[3];
+				for (uint32_t corner = 0; corner < 3; ++corner)
+				{
+					const Vector3 p = positions[scene.geometry.Index(mesh, 3 * size_t(triangleIndex) + corner)] - lightPosition;
+					const float components[3] = { p.x, p.y, p.z };
+					corners[corner] = { components[(axis + 1) % 3], components[(axis + 2) % 3], sign * components[axis] };
+				}
+
+				// Clipped to the near plane, a triangle becomes a polygon of up to four corners, drawn as a fan
+				FaceVertex clipped[4];
+				uint32_t clippedCount = 0;
+				for (uint32_t corner = 0; corner < 3; ++corner)
+				{
+					const FaceVertex& a = corners[corner];
+					const FaceVertex& b = corners[(corner + 1) % 3];
+					const bool aInside = a.z >= kNearDepth, bInside = b.z >= kNearDepth;
+					if (aInside)
+						clipped[clippedCount++] = a;
+					if (aInside != bInside)
+					{
+						const float t = (kNearDepth - a.z) / (b.z - a.z);
+						clipped[clippedCount++] = { a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, kNearDepth };
+					}
+				}
+				for (uint32_t corner = 1; corner + 1 < clippedCount; ++corner)
+					rasterizeTriangle(faceTexels, clipped[0], clipped[corner], clipped[corner + 1]);
+			}
+		}
+	}
+
+	// Keeps the smaller depth at every texel whose center the triangle covers. Depth is interpolated through its
+	// reciprocal, which is linear across the face.
+	void rasterizeTriangle(float* faceTexels, const FaceVertex& a, const FaceVertex& b, const FaceVertex& c) const
+	{
+		const float x[3] = { toTexel(a.x / a.z), toTexel(b.x / b.z), toTexel(c.x / c.z) };
+		const float y[3] = { toTexel(a.y / a.z), toTexel(b.y / b.z), toTexel(c.y / c.z) };
+		const float inverseDepth[3] = { 1.f / a.z, 1.f / b.z, 1.f / c.z };
+		const float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (!(std::abs(area) > 0.f))
+			return;
+
+		const float size = static_cast<float>(resolution);
+		const float minX = std::max(std::min({ x[0], x[1], x[2] }), 0.f), maxX = std::min(std::max({ x[0], x[1], x[2] }), size);
+		const float minY = std::max(std::min({ y[0], y[1], y[2] }), 0.f), maxY = std::min(std::max({ y[0], y[1], y[2] }), size);
+		if (minX >= maxX || minY >= maxY)
+			return;
+
+		// Texels whose centers lie within the bounds
+		const uint32_t firstColumn = static_cast<uint32_t>(std::max(std::ceil(minX - 0.5f), 0.f));
+		const uint32_t endColumn = std::min(static_cast<uint32_t>(std::max(std::floor(maxX - 0.5f) + 1.f, 0.f)), resolution);
+		const uint32_t firstRow = static_cast<uint32_t>(std::max(std::ceil(minY - 0.5f), 0.f));
+		const uint32_t endRow = std::min(static_cast<uint32_t>(std::max(std::floor(maxY - 0.5f) + 1.f, 0.f)), resolution);
+
+		const float inverseArea = 1.f / area;
+		auto edge = [&](uint32_t from, uint32_t to, float px, float py)
+			{
+				return ((x[to] - x[from]) * (py - y[from]) - (px - x[from]) * (y[to] - y[from])) * inverseArea;
+			};
+		for (uint32_t row = firstRow; row < endRow; ++row)
+		{
+			const float py = static_cast<float>(row) + 0.5f;
+			for (uint32_t column = firstColumn; column < endColumn; ++column)
+			{
+				const float px = static_cast<float>(column) + 0.5f;
+				const float w0 = edge(1, 2, px, py), w1 = edge(2, 0, px, py), w2 = edge(0, 1, px, py);
+				if (w0 < 0.f || w1 < 0.f || w2 < 0.f)
+					continue;
+				float& texel = faceTexels[size_t(row) * resolution + column];
+				texel = std::min(texel, 1.f / (w0 * inverseDepth[0] + w1 * inverseDepth[1] + w2 * inverseDepth[2]));
+			}
+		}
+	}
+
+	uint32_t resolution = 0;
+	std::vector<Vector3> lightPositions;
+	std::vector<float> depths;		// Face after face of every light, row by row
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+// SSE2 is part of every x86-64 target, so code outside the per-target regions below may use it directly
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#else
+#define SIMD_SSE2 0
+#endif
+
+#if SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__GNUC__)
+#include <cpuid.h>
+#endif
+#endif
+
+// Regions of code compiled for one instruction set, whatever the flags of the build are. GCC and Clang need the
+// target to emit the instructions at all; MSVC accepts any intrinsic anywhere, so the regions are empty there.
+// Contraction of a * b + c into FMA is switched off so every target rounds exactly like the scalar code.
+// (Clang only contracts within one expression, which the intrinsic wrappers never span.)
+#define SIMD_PRAGMA(text) _Pragma(#text)
+#if SIMD_X86 && defined(__clang__)
+#define SIMD_BEGIN_TARGET(isa) SIMD_PRAGMA(clang attribute push(__attribute__((target(isa))), apply_to = function))
+#define SIMD_END_TARGET _Pragma("clang attribute pop")
+#elif SIMD_X86 && defined(__GNUC__)
+#define SIMD_BEGIN_TARGET(isa) _Pragma("GCC push_options") SIMD_PRAGMA(GCC target(isa)) _Pragma("GCC optimize(\"fp-contract=off\")")
+#define SIMD_END_TARGET _Pragma("GCC pop_options")
+#else
+#define SIMD_BEGIN_TARGET(isa)
+#define SIMD_END_TARGET
+#endif
+
+#define SIMD_TARGET_SSE42 "sse4.2,popcnt"
+#define SIMD_TARGET_AVX2 "avx2,bmi,bmi2,popcnt"
+#define SIMD_TARGET_AVX512 "avx512f,avx512vl,avx512dq,avx512bw,avx2,bmi,bmi2,popcnt"
+
+enum class SimdLevel
+{
+	SCALAR,
+	SSE42,
+	AVX2,
+	AVX512
+};
+
+inline const char* SimdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SimdLevel::SSE42: return "SSE4.2";
+	case SimdLevel::AVX2: return "AVX2";
+	case SimdLevel::AVX512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+// Best instruction set supported by both the CPU (CPUID) and the OS (XGETBV: the OS saves the wide registers)
+inline SimdLevel DetectSimdLevel()
+{
+#if SIMD_X86
+	auto cpuid = [](uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+		{
+#ifdef _MSC_VER
+			int values[4];
+			__cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+			for (int i = 0; i < 4; ++i)
+				registers[i] = static_cast<uint32_t>(values[i]);
+#else
+			__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+		};
+	auto xgetbv = []() -> uint64_t
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+		};
+
+	uint32_t registers[4];
+	cpuid(0, 0, registers);
+	const uint32_t maxLeaf = registers[0];
+	if (maxLeaf < 1)
+		return SimdLevel::SCALAR;
+
+	cpuid(1, 0, registers);
+	const bool sse42 = (registers[2] & (1u << 20)) != 0;
+	const bool osxsave = (registers[2] & (1u << 27)) != 0;
+	const bool avx = (registers[2] & (1u << 28)) != 0;
+	if (!sse42)
+		return SimdLevel::SCALAR;
+	if (!osxsave || !avx || maxLeaf < 7)
+		return SimdLevel::SSE42;
+
+	const uint64_t enabledState = xgetbv();
+	const bool ymmState = (enabledState & 0x6) == 0x6;
+	const bool zmmState = (enabledState & 0xe6) == 0xe6;
+
+	cpuid(7, 0, registers);
+	const bool avx2 = (registers[1] & (1u << 5)) != 0;
+	const bool bmi = (registers[1] & (1u << 3)) != 0;
+	const bool bmi2 = (registers[1] & (1u << 8)) != 0;
+	const bool avx512 = (registers[1] & (1u << 16)) != 0	// F
+		&& (registers[1] & (1u << 17)) != 0					// DQ
+		&& (registers[1] & (1u << 30)) != 0					// BW
+		&& (registers[1] & (1u << 31)) != 0;				// VL
+
+	if (!ymmState || !avx2 || !bmi || !bmi2)
+		return SimdLevel::SSE42;
+	if (!zmmState || !avx512)
+		return SimdLevel::AVX2;
+	return SimdLevel::AVX512;
+#else
+	return SimdLevel::SCALAR;
+#endif
+}
+
+#if SIMD_X86
+
+// Four floats in an SSE register. Comparisons return lane masks (all bits set or clear) of the same type.
+SIMD_BEGIN_TARGET(SIMD_TARGET_SSE42)
+
+struct Float4
+{
+	static constexpr uint32_t kWidth = 4;
+
+	__m128 v;
+
+	Float4() = default;
+	Float4(__m128 v) : v(v) {}
+	Float4(float s) : v(_mm_set1_ps(s)) {}
+
+	static Float4 Load(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_storeu_ps(p, v); }
+
+	// Lane i is base[offsets[i]]
+	static Float4 Gather(const float* base, const int32_t* offsets)
+	{
+		return _mm_setr_ps(base[offsets[0]], base[offsets[1]], base[offsets[2]], base[offsets[3]]);
+	}
+
+	// Mask of the first count lanes
+	static Float4 FirstLanes(uint32_t count)
+	{
+		return _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int32_t>(count)), _mm_setr_epi32(0, 1, 2, 3)));
+	}
+};
+
+inline Float4 operator +(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator -(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator *(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator /(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator &(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+inline Float4 operator |(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+inline Float4 operator <(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Float4 operator ==(Float4 a, Float4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+// True where a < b is false, NaN lanes included
+inline Float4 NotLess(Float4 a, Float4 b) { return _mm_cmpnlt_ps(a.v, b.v); }
+inline Float4 NotGreater(Float4 a, Float4 b) { return _mm_cmpngt_ps(a.v, b.v); }
+inline Float4 Min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 Max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 Sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+inline Float4 Select(Float4 mask, Float4 a, Float4 b) { return _mm_blendv_ps(b.v, a.v, mask.v); }
+inline uint32_t MoveMask(Float4 mask) { return static_cast<uint32_t>(_mm_movemask_ps(mask.v)); }
+
+SIMD_END_TARGET
+
+// Eight floats in an AVX register
+SIMD_BEGIN_TARGET(SIMD_TARGET_AVX2)
+
+struct Float8
+{
+	static constexpr uint32_t kWidth = 8;
+
+	__m256 v;
+
+	Float8() = default;
+	Float8(__m256 v) : v(v) {}
+	Float8(float s) : v(_mm256_set1_ps(s)) {}
+
+	static Float8 Load(const float* p) { return _mm256_loadu_ps(p); }
+	void Store(float* p) const { _mm256_storeu_ps(p, v); }
+
+	static Float8 Gather(const float* base, const int32_t* offsets)
+	{
+		return _mm256_i32gather_ps(base, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets)), 4);
+	}
+
+	static Float8 FirstLanes(uint32_t count)
+	{
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int32_t>(count)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	}
+};
+
+inline Float8 operator +(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+inline Float8 operator -(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float8 operator *(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float8 operator /(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+inline Float8 operator &(Float8 a, Float8 b) { return _mm256_and_ps(a.v, b.v); }
+inline Float8 operator |(Float8 a, Float8 b) { return _mm256_or_ps(a.v, b.v); }
+inline Float8 operator <(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Float8 operator ==(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline Float8 NotLess(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NLT_UQ); }
+inline Float8 NotGreater(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NGT_UQ); }
+inline Float8 Min(Float8 a, Float8 b) { return _mm256_min_ps(a.v, b.v); }
+inline Float8 Max(Float8 a, Float8 b) { return _mm256_max_ps(a.v, b.v); }
+inline Float8 Sqrt(Float8 a) { return _mm256_sqrt_ps(a.v); }
+inline Float8 Select(Float8 mask, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline uint32_t MoveMask(Float8 mask) { return static_cast<uint32_t>(_mm256_movemask_ps(mask.v)); }
+
+SIMD_END_TARGET
+
+#endif
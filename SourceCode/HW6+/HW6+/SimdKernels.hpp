@@ -0,0 +1,272 @@
+#pragma once
+
+#include "Camera.hpp"
+#include "Math3D.hpp"
+#include "Simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <limits>
+
+// One pass of the edge-avoiding a-trous filter of the Denoiser over planes of width x height floats. The taps of
+// the 5x5 kernel are step pixels apart. A tap's weight falls with the squared differences of its luminance, normal,
+// relative depth and albedo to those of the centre pixel, each divided by its sigma^2; the sigma of the luminance
+// scales with the standard deviation around the centre pixel, so noisy pixels are smoothed more than clean ones.
+// The variance is filtered along with the colour. Taps outside the image are left out.
+struct AtrousPass
+{
+	const float* color[3];
+	const float* variance;		// Of the luminance of color
+	const float* localVariance;	// variance blurred over 3x3 pixels, sets the luminance sigma
+	float* filtered[3];
+	float* filteredVariance;
+	const float* normal[3];
+	const float* depth;			// 0 where the primary ray escaped
+	const float* albedo[3];
+	uint32_t width;
+	uint32_t height;
+	uint32_t step;
+	float luminanceSigma2;		// Per unit of variance
+	float normalWeight;			// 1 / sigma^2
+	float depthWeight;
+	float albedoWeight;
+};
+
+// B3 spline
+constexpr float kAtrousKernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+// Added to the luminance sigma^2, so pixels without noise still blend with neighbours of the same luminance
+constexpr float kAtrousMinVariance = 1e-6f;
+
+// Scalar versions, used on CPUs without SSE4.2 and on other architectures
+namespace simd_scalar
+{
+	inline void PrimaryRays(const Camera::Basis& basis, const float* screenX, float screenY, const float* lensX, const float* lensY, size_t count, RayBatch& rays, size_t first)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			const float x = screenX[i];
+			Vector3 origin = basis.position;
+			Vector3 direction = basis.forward;
+			switch (basis.projection)
+			{
+			case Camera::Projection::PINHOLE:
+				direction = Normalize(basis.forward + basis.right * x + basis.up * screenY);
+				break;
+			case Camera::Projection::ORTHOGRAPHIC:
+				origin = basis.position + basis.right * (x * basis.orthographicScale) + basis.up * (screenY * basis.orthographicScale);
+				break;
+			case Camera::Projection::THIN_LENS:
+			{
+				const float f = basis.focusDistance;
+				origin = basis.position + basis.right * lensX[i] + basis.up * lensY[i];
+				direction = Normalize(basis.forward * f + basis.right * (x * f - lensX[i]) + basis.up * (screenY * f - lensY[i]));
+				break;
+			}
+			}
+			rays.originX[first + i] = origin.x;
+			rays.originY[first + i] = origin.y;
+			rays.originZ[first + i] = origin.z;
+			rays.directionX[first + i] = direction.x;
+			rays.directionY[first + i] = direction.y;
+			rays.directionZ[first + i] = direction.z;
+		}
+	}
+
+	template <typename Index>
+	bool ClosestHitTriangles(const Vector3* positions, const Index* indices, uint32_t triangleCount, uint32_t firstTriangle, const Ray& ray, TraversalHit& closest)
+	{
+		bool updated = false;
+		for (uint32_t triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex)
+		{
+			const Index* triangle = indices + 3 * size_t(triangleIndex);
+			if (IntersectTriangle(positions[triangle[0]], positions[triangle[1]], positions[triangle[2]], ray, closest.t, closest.t, closest.u, closest.v))
+			{
+				closest.primitiveId = firstTriangle + triangleIndex;
+				updated = true;
+			}
+		}
+		return updated;
+	}
+
+	// 1 / (the first five terms of the series of e^x), a cheap stand-in for e^-x that stays positive and decreasing.
+	// The vector kernels evaluate it in the same order.
+	inline float EdgeWeight(float x)
+	{
+		return 1.f / (1.f + x * (1.f + x * (0.5f + x * (1.f / 6.f + x * (1.f / 24.f)))));
+	}
+
+	inline float Luminance(float r, float g, float b)
+	{
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	}
+
+	inline void AtrousPixel(const AtrousPass& pass, uint32_t x, uint32_t y)
+	{
+		const size_t p = size_t(y) * pass.width + x;
+		const float luminance = Luminance(pass.color[0][p], pass.color[1][p], pass.color[2][p]);
+		const float luminanceWeight = 1.f / (pass.luminanceSigma2 * pass.localVariance[p] + kAtrousMinVariance);
+		float sumR = 0.f, sumG = 0.f, sumB = 0.f, varianceSum = 0.f, weightSum = 0.f;
+		for (int32_t dy = -2; dy <= 2; ++dy)
+		{
+			const int64_t qy = int64_t(y) + dy * int64_t(pass.step);
+			if (qy < 0 || qy >= pass.height)
+				continue;
+			for (int32_t dx = -2; dx <= 2; ++dx)
+			{
+				const int64_t qx = int64_t(x) + dx * int64_t(pass.step);
+				if (qx < 0 || qx >= pass.width)
+					continue;
+				const size_t q = size_t(qy) * pass.width + size_t(qx);
+
+				auto squaredDifference = [&](const float* const* planes)
+					{
+						const float d0 = planes[0][p] - planes[0][q], d1 = planes[1][p] - planes[1][q], d2 = planes[2][p] - planes[2][q];
+						return d0 * d0 + d1 * d1 + d2 * d2;
+					};
+				const float r = pass.color[0][q], g = pass.color[1][q], b = pass.color[2][q];
+				const float luminanceDifference = luminance - Luminance(r, g, b);
+				const float relativeDepth = (pass.depth[p] - pass.depth[q]) / std::max(std::max(pass.depth[p], pass.depth[q]), 1e-6f);
+				const float distance = luminanceWeight * (luminanceDifference * luminanceDifference) + pass.normalWeight * squaredDifference(pass.normal)
+					+ pass.depthWeight * (relativeDepth * relativeDepth) + pass.albedoWeight * squaredDifference(pass.albedo);
+				const float weight = kAtrousKernel[dy + 2] * kAtrousKernel[dx + 2] * EdgeWeight(distance);
+				sumR += weight * r;
+				sumG += weight * g;
+				sumB += weight * b;
+				varianceSum += (weight * weight) * pass.variance[q];
+				weightSum += weight;
+			}
+		}
+		pass.filtered[0][p] = sumR / weightSum;
+		pass.filtered[1][p] = sumG / weightSum;
+		pass.filtered[2][p] = sumB / weightSum;
+		pass.filteredVariance[p] = varianceSum / (weightSum * weightSum);
+	}
+
+	inline void AtrousRow(const AtrousPass& pass, uint32_t row)
+	{
+		for (uint32_t x = 0; x < pass.width; ++x)
+			AtrousPixel(pass, x, row);
+	}
+
+	template <typename Index>
+	bool AnyHitTriangles(const Vector3* positions, const Index* indices, uint32_t triangleCount, const Ray& ray)
+	{
+		float t, u, v;
+		for (uint32_t triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex)
+		{
+			const Index* triangle = indices + 3 * size_t(triangleIndex);
+			if (IntersectTriangle(positions[triangle[0]], positions[triangle[1]], positions[triangle[2]], ray, std::numeric_limits<float>::infinity(), t, u, v))
+				return true;
+		}
+		return false;
+	}
+
+	inline uint64_t PacketBoxHits(const RayPacket& rays, const float* boxMin, const float* boxMax, uint64_t candidates)
+	{
+		uint64_t hits = 0;
+		for (; candidates != 0; candidates &= candidates - 1)
+		{
+			const uint32_t i = static_cast<uint32_t>(std::countr_zero(candidates));
+			const float origin[3] = { rays.originX[i], rays.originY[i], rays.originZ[i] };
+			const float inverseDirection[3] = { rays.inverseDirectionX[i], rays.inverseDirectionY[i], rays.inverseDirectionZ[i] };
+			float entry = 0.f, exit = rays.maxT[i];
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const float t0 = (boxMin[axis] - origin[axis]) * inverseDirection[axis];
+				const float t1 = (boxMax[axis] - origin[axis]) * inverseDirection[axis];
+				entry = std::max(entry, std::min(t0, t1));
+				exit = std::min(exit, std::max(t0, t1) * kSlabFarScale);
+			}
+			hits |= uint64_t(entry <= exit) << i;
+		}
+		return hits;
+	}
+}
+
+#if SIMD_X86
+
+// Below this many triangles in a mesh, the vector kernels fall back to the scalar loop
+constexpr uint32_t kMinBatchTriangles = 16;
+
+SIMD_BEGIN_TARGET(SIMD_TARGET_SSE42)
+namespace simd_sse42
+{
+	using Float = Float4;
+#include "SimdKernels.inl"
+}
+SIMD_END_TARGET
+
+SIMD_BEGIN_TARGET(SIMD_TARGET_AVX2)
+namespace simd_avx2
+{
+	using Float = Float8;
+#include "SimdKernels.inl"
+}
+SIMD_END_TARGET
+
+// Not 16-wide kernels: the Float8 kernels of the AVX2 level compiled again with AVX-512 enabled, which only lets the
+// compiler use the EVEX encodings, 32 vector registers and mask registers for the lane compares
+SIMD_BEGIN_TARGET(SIMD_TARGET_AVX512)
+namespace simd_avx512
+{
+	using Float = Float8;
+#include "SimdKernels.inl"
+}
+SIMD_END_TARGET
+
+#endif
+
+// Entry points of the hot kernels for one instruction set
+struct SimdKernels
+{
+	SimdLevel level;
+	void (*primaryRays)(const Camera::Basis& basis, const float* screenX, float screenY, const float* lensX, const float* lensY, size_t count, RayBatch& rays, size_t first);
+	bool (*closestHit16)(const Vector3* positions, const uint16_t* indices, uint32_t triangleCount, uint32_t firstTriangle, const Ray& ray, TraversalHit& closest);
+	bool (*closestHit32)(const Vector3* positions, const uint32_t* indices, uint32_t triangleCount, uint32_t firstTriangle, const Ray& ray, TraversalHit& closest);
+	bool (*anyHit16)(const Vector3* positions, const uint16_t* indices, uint32_t triangleCount, const Ray& ray);
+	bool (*anyHit32)(const Vector3* positions, const uint32_t* indices, uint32_t triangleCount, const Ray& ray);
+	void (*atrousRow)(const AtrousPass& pass, uint32_t row);
+	// Mask of the rays among candidates that enter the box
+	uint64_t (*packetBoxHits)(const RayPacket& rays, const float* boxMin, const float* boxMax, uint64_t candidates);
+};
+
+#define SIMD_KERNEL_TABLE(level, ns) \
+	SimdKernels{ level, &ns::PrimaryRays, &ns::ClosestHitTriangles<uint16_t>, &ns::ClosestHitTriangles<uint32_t>, &ns::AnyHitTriangles<uint16_t>, &ns::AnyHitTriangles<uint32_t>, &ns::AtrousRow, \
+		&ns::PacketBoxHits }
+
+// Kernels for the given level, or for the best level below it that this build has
+inline const SimdKernels& GetSimdKernels(SimdLevel level)
+{
+	static const SimdKernels scalar = SIMD_KERNEL_TABLE(SimdLevel::SCALAR, simd_scalar);
+#if SIMD_X86
+	static const SimdKernels sse42 = SIMD_KERNEL_TABLE(SimdLevel::SSE42, simd_sse42);
+	static const SimdKernels avx2 = SIMD_KERNEL_TABLE(SimdLevel::AVX2, simd_avx2);
+	static const SimdKernels avx512 = SIMD_KERNEL_TABLE(SimdLevel::AVX512, simd_avx512);
+	switch (level)
+	{
+	case SimdLevel::AVX512: return avx512;
+	case SimdLevel::AVX2: return avx2;
+	case SimdLevel::SSE42: return sse42;
+	default: break;
+	}
+#endif
+	return scalar;
+}
+
+#undef SIMD_KERNEL_TABLE
+
+// Kernels for the best instruction set of this CPU, picked once at startup. Can be lowered with
+// SelectSimdLevel(), but never raised above what the CPU supports. Atomic, so that render threads never read it
+// while another thread switches levels.
+inline std::atomic<const SimdKernels*> activeSimdKernels = &GetSimdKernels(DetectSimdLevel());
+
+inline void SelectSimdLevel(SimdLevel level)
+{
+	activeSimdKernels.store(&GetSimdKernels(std::min(level, DetectSimdLevel())), std::memory_order_release);
+}
+
+inline const SimdKernels& ActiveSimdKernels()
+{
+	return *activeSimdKernels.load(std::memory_order_acquire);
+}
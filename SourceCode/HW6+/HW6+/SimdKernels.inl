@@ -0,0 +1,280 @@
+// Hot kernels of one instruction set. SimdKernels.hpp includes this file once per target, inside a namespace that
+// defines Float as the vector type of the target, so there is deliberately no include guard.
+
+// Primary rays through count consecutive pixels of one row, written to rays from index first on. screenX holds the
+// screen x of each pixel; lensX and lensY the offsets on the lens, used by the thin lens only. Each lane repeats the
+// operations of simd_scalar::PrimaryRays(), and the tail goes through that function, so all rays are the same.
+inline void PrimaryRays(const Camera::Basis& basis, const float* screenX, float screenY, const float* lensX, const float* lensY, size_t count, RayBatch& rays, size_t first)
+{
+	constexpr uint32_t W = Float::kWidth;
+	const Float px(basis.position.x), py(basis.position.y), pz(basis.position.z);
+	const Float fx(basis.forward.x), fy(basis.forward.y), fz(basis.forward.z);
+	const Float rx(basis.right.x), ry(basis.right.y), rz(basis.right.z);
+	const Float ux(basis.up.x), uy(basis.up.y), uz(basis.up.z);
+	const Float y(screenY);
+
+	// Normalize(): one reciprocal of the magnitude, then three multiplies
+	auto storeNormalized = [&](Float dx, Float dy, Float dz, size_t i)
+		{
+			const Float inverseLength = Float(1.f) / Sqrt(dx * dx + dy * dy + dz * dz);
+			(dx * inverseLength).Store(&rays.directionX[first + i]);
+			(dy * inverseLength).Store(&rays.directionY[first + i]);
+			(dz * inverseLength).Store(&rays.directionZ[first + i]);
+		};
+	auto storeOrigins = [&](Float ox, Float oy, Float oz, size_t i)
+		{
+			ox.Store(&rays.originX[first + i]);
+			oy.Store(&rays.originY[first + i]);
+			oz.Store(&rays.originZ[first + i]);
+		};
+
+	size_t i = 0;
+	for (; i + W <= count; i += W)
+	{
+		const Float x = Float::Load(screenX + i);
+		switch (basis.projection)
+		{
+		case Camera::Projection::PINHOLE:
+			storeOrigins(px, py, pz, i);
+			storeNormalized(fx + rx * x + ux * y, fy + ry * x + uy * y, fz + rz * x + uz * y, i);
+			break;
+		case Camera::Projection::ORTHOGRAPHIC:
+		{
+			const Float scale(basis.orthographicScale);
+			const Float sx = x * scale, sy = y * scale;
+			storeOrigins(px + rx * sx + ux * sy, py + ry * sx + uy * sy, pz + rz * sx + uz * sy, i);
+			fx.Store(&rays.directionX[first + i]);
+			fy.Store(&rays.directionY[first + i]);
+			fz.Store(&rays.directionZ[first + i]);
+			break;
+		}
+		case Camera::Projection::THIN_LENS:
+		{
+			const Float f(basis.focusDistance);
+			const Float lx = Float::Load(lensX + i), ly = Float::Load(lensY + i);
+			storeOrigins(px + rx * lx + ux * ly, py + ry * lx + uy * ly, pz + rz * lx + uz * ly, i);
+			const Float a = x * f - lx, b = y * f - ly;
+			storeNormalized(fx * f + rx * a + ux * b, fy * f + ry * a + uy * b, fz * f + rz * a + uz * b, i);
+			break;
+		}
+		}
+	}
+
+	if (i < count)
+		simd_scalar::PrimaryRays(basis, screenX + i, screenY, lensX ? lensX + i : nullptr, lensY ? lensY + i : nullptr, count - i, rays, first + i);
+}
+
+// One ray against Float::kWidth triangles at a time. Every lane repeats the operations of IntersectTriangle() in
+// the same order, so t, u and v come out bit for bit the same as from the scalar code. Among the lanes that hit,
+// the closest wins and ties go to the lowest triangle, exactly as in a sequential loop with a strict t < tMax.
+// Returns true if closest was updated (kAnyHit: as soon as any triangle is hit).
+// Meshes smaller than kMinBatchTriangles gain nothing from the gathers and go through the scalar loop.
+template <bool kAnyHit, typename Index>
+bool IntersectTriangles(const Vector3* positions, const Index* indices, uint32_t triangleCount, uint32_t firstTriangle, const Ray& ray, TraversalHit& closest)
+{
+	constexpr uint32_t W = Float::kWidth;
+	if (triangleCount < kMinBatchTriangles)
+	{
+		if constexpr (kAnyHit)
+			return simd_scalar::AnyHitTriangles(positions, indices, triangleCount, ray);
+		else
+			return simd_scalar::ClosestHitTriangles(positions, indices, triangleCount, firstTriangle, ray, closest);
+	}
+
+	const Float ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z);
+	const Float dx(ray.directionN.x), dy(ray.directionN.y), dz(ray.directionN.z);
+	const Float maxT(ray.maxT);
+	const Float zero(0.f);
+	const float* base = &positions[0].x;
+
+	bool updated = false;
+	for (uint32_t first = 0; first < triangleCount; first += W)
+	{
+		const uint32_t laneCount = std::min(W, triangleCount - first);
+
+		// Float offsets of the corners; lanes past the end repeat the last triangle and are masked out
+		alignas(32) int32_t offsets[3][W];
+		for (uint32_t lane = 0; lane < W; ++lane)
+		{
+			const Index* triangle = indices + 3 * size_t(first + std::min(lane, laneCount - 1));
+			offsets[0][lane] = 3 * static_cast<int32_t>(triangle[0]);
+			offsets[1][lane] = 3 * static_cast<int32_t>(triangle[1]);
+			offsets[2][lane] = 3 * static_cast<int32_t>(triangle[2]);
+		}
+		const Float ax = Float::Gather(base, offsets[0]), ay = Float::Gather(base + 1, offsets[0]), az = Float::Gather(base + 2, offsets[0]);
+		const Float bx = Float::Gather(base, offsets[1]), by = Float::Gather(base + 1, offsets[1]), bz = Float::Gather(base + 2, offsets[1]);
+		const Float cx = Float::Gather(base, offsets[2]), cy = Float::Gather(base + 1, offsets[2]), cz = Float::Gather(base + 2, offsets[2]);
+
+		// crossABC = Cross(b - a, c - a)
+		const Float e0x = bx - ax, e0y = by - ay, e0z = bz - az;
+		const Float e1x = cx - ax, e1y = cy - ay, e1z = cz - az;
+		const Float nx = e0y * e1z - e0z * e1y;
+		const Float ny = e0z * e1x - e0x * e1z;
+		const Float nz = e0x * e1y - e0y * e1x;
+
+		const Float dirDotNorm = dx * nx + dy * ny + dz * nz;
+		const Float t = ((ax - ox) * nx + (ay - oy) * ny + (az - oz) * nz) / dirDotNorm;
+		const Float tMax(kAnyHit ? std::numeric_limits<float>::infinity() : closest.t);
+		Float valid = Float::FirstLanes(laneCount) & (t < tMax) & NotLess(t, zero) & NotGreater(t, maxT);
+		if (MoveMask(valid) == 0)
+			continue;
+
+		const Float px = ox + dx * t, py = oy + dy * t, pz = oz + dz * t;
+
+		// Dot(crossABC, Cross(edge, p - corner)) for the three edges
+		auto edgeTest = [&](Float ex, Float ey, Float ez, Float qx, Float qy, Float qz)
+			{
+				const Float wx = px - qx, wy = py - qy, wz = pz - qz;
+				const Float rx = ey * wz - ez * wy;
+				const Float ry = ez * wx - ex * wz;
+				const Float rz = ex * wy - ey * wx;
+				return NotLess(nx * rx + ny * ry + nz * rz, zero);
+			};
+		valid = valid & edgeTest(e0x, e0y, e0z, ax, ay, az);
+		valid = valid & edgeTest(cx - bx, cy - by, cz - bz, bx, by, bz);
+		valid = valid & edgeTest(ax - cx, ay - cy, az - cz, cx, cy, cz);
+		const uint32_t hitMask = MoveMask(valid);
+		if (hitMask == 0)
+			continue;
+		if constexpr (kAnyHit)
+			return true;
+
+		// Barycentric coordinates from the areas of PBC and PCA relative to ABC
+		auto magnitude = [](Float x, Float y, Float z) { return Sqrt(x * x + y * y + z * z); };
+		auto crossMagnitude = [&](Float ux, Float uy, Float uz, Float vx, Float vy, Float vz)
+			{
+				return magnitude(uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx);
+			};
+		const Float areaABC = magnitude(nx, ny, nz);
+		const Float areaPBC = crossMagnitude(bx - px, by - py, bz - pz, cx - px, cy - py, cz - pz);
+		const Float areaPCA = crossMagnitude(cx - px, cy - py, cz - pz, ax - px, ay - py, az - pz);
+		const Float u = areaPBC / areaABC;
+		const Float v = areaPCA / areaABC;
+
+		float tLanes[W], uLanes[W], vLanes[W];
+		t.Store(tLanes);
+		u.Store(uLanes);
+		v.Store(vLanes);
+		for (uint32_t lane = 0; lane < laneCount; ++lane)
+		{
+			if ((hitMask & (1u << lane)) && tLanes[lane] < closest.t)
+			{
+				closest.t = tLanes[lane];
+				closest.u = uLanes[lane];
+				closest.v = vLanes[lane];
+				closest.primitiveId = firstTriangle + first + lane;
+				updated = true;
+			}
+		}
+	}
+	return updated;
+}
+
+template <typename Index>
+bool ClosestHitTriangles(const Vector3* positions, const Index* indices, uint32_t triangleCount, uint32_t firstTriangle, const Ray& ray, TraversalHit& closest)
+{
+	return IntersectTriangles<false>(positions, indices, triangleCount, firstTriangle, ray, closest);
+}
+
+template <typename Index>
+bool AnyHitTriangles(const Vector3* positions, const Index* indices, uint32_t triangleCount, const Ray& ray)
+{
+	TraversalHit unused;
+	return IntersectTriangles<true>(positions, indices, triangleCount, 0, ray, unused);
+}
+
+// One row of an a-trous pass, Float::kWidth pixels at a time. Every lane repeats the operations of
+// simd_scalar::AtrousPixel() in the same order; the columns within reach of the left and right edges, whose taps
+// would leave the image, go through that function.
+inline void AtrousRow(const AtrousPass& pass, uint32_t row)
+{
+	constexpr uint32_t W = Float::kWidth;
+	const uint32_t reach = 2 * pass.step;
+	const uint32_t interiorEnd = pass.width > reach ? pass.width - reach : 0;
+
+	uint32_t x = 0;
+	for (; x < std::min(reach, pass.width); ++x)
+		simd_scalar::AtrousPixel(pass, x, row);
+
+	auto luminanceOf = [](Float r, Float g, Float b) { return Float(0.2126f) * r + Float(0.7152f) * g + Float(0.0722f) * b; };
+	auto squaredDifference = [](const float* const* planes, Float p0, Float p1, Float p2, size_t q)
+		{
+			const Float d0 = p0 - Float::Load(planes[0] + q), d1 = p1 - Float::Load(planes[1] + q), d2 = p2 - Float::Load(planes[2] + q);
+			return d0 * d0 + d1 * d1 + d2 * d2;
+		};
+
+	const Float normalWeight(pass.normalWeight), depthWeight(pass.depthWeight), albedoWeight(pass.albedoWeight);
+	for (; x + W <= interiorEnd; x += W)
+	{
+		const size_t p = size_t(row) * pass.width + x;
+		const Float luminance = luminanceOf(Float::Load(pass.color[0] + p), Float::Load(pass.color[1] + p), Float::Load(pass.color[2] + p));
+		const Float luminanceWeight = Float(1.f) / (Float(pass.luminanceSigma2) * Float::Load(pass.localVariance + p) + Float(kAtrousMinVariance));
+		const Float nx = Float::Load(pass.normal[0] + p), ny = Float::Load(pass.normal[1] + p), nz = Float::Load(pass.normal[2] + p);
+		const Float ar = Float::Load(pass.albedo[0] + p), ag = Float::Load(pass.albedo[1] + p), ab = Float::Load(pass.albedo[2] + p);
+		const Float depth = Float::Load(pass.depth + p);
+
+		Float sumR(0.f), sumG(0.f), sumB(0.f), varianceSum(0.f), weightSum(0.f);
+		for (int32_t dy = -2; dy <= 2; ++dy)
+		{
+			const int64_t qy = int64_t(row) + dy * int64_t(pass.step);
+			if (qy < 0 || qy >= pass.height)
+				continue;
+			for (int32_t dx = -2; dx <= 2; ++dx)
+			{
+				const size_t q = size_t(qy) * pass.width + size_t(int64_t(x) + dx * int64_t(pass.step));
+				const Float r = Float::Load(pass.color[0] + q), g = Float::Load(pass.color[1] + q), b = Float::Load(pass.color[2] + q);
+				const Float luminanceDifference = luminance - luminanceOf(r, g, b);
+				const Float qDepth = Float::Load(pass.depth + q);
+				const Float relativeDepth = (depth - qDepth) / Max(Max(depth, qDepth), Float(1e-6f));
+				const Float distance = luminanceWeight * (luminanceDifference * luminanceDifference) + normalWeight * squaredDifference(pass.normal, nx, ny, nz, q)
+					+ depthWeight * (relativeDepth * relativeDepth) + albedoWeight * squaredDifference(pass.albedo, ar, ag, ab, q);
+				const Float edgeWeight = Float(1.f) / (Float(1.f) + distance * (Float(1.f) + distance * (Float(0.5f) + distance * (Float(1.f / 6.f) + distance * Float(1.f / 24.f)))));
+				const Float weight = Float(kAtrousKernel[dy + 2] * kAtrousKernel[dx + 2]) * edgeWeight;
+				sumR = sumR + weight * r;
+				sumG = sumG + weight * g;
+				sumB = sumB + weight * b;
+				varianceSum = varianceSum + (weight * weight) * Float::Load(pass.variance + q);
+				weightSum = weightSum + weight;
+			}
+		}
+		(sumR / weightSum).Store(pass.filtered[0] + p);
+		(sumG / weightSum).Store(pass.filtered[1] + p);
+		(sumB / weightSum).Store(pass.filtered[2] + p);
+		(varianceSum / (weightSum * weightSum)).Store(pass.filteredVariance + p);
+	}
+
+	for (; x < pass.width; ++x)
+		simd_scalar::AtrousPixel(pass, x, row);
+}
+
+// simd_scalar::PacketBoxHits() for Float::kWidth rays at a time; only the groups of lanes holding a candidate are
+// tested. A lane that turns NaN counts as a hit, which keeps the test conservative.
+inline uint64_t PacketBoxHits(const RayPacket& rays, const float* boxMin, const float* boxMax, uint64_t candidates)
+{
+	constexpr uint32_t W = Float::kWidth;
+	constexpr uint64_t kLanes = (uint64_t(1) << W) - 1;
+	const Float lower[3] = { Float(boxMin[0]), Float(boxMin[1]), Float(boxMin[2]) };
+	const Float upper[3] = { Float(boxMax[0]), Float(boxMax[1]), Float(boxMax[2]) };
+	const Float farScale(kSlabFarScale);
+
+	uint64_t hits = 0;
+	while (candidates != 0)
+	{
+		const uint32_t first = static_cast<uint32_t>(std::countr_zero(candidates)) / W * W;
+		const uint64_t lanes = (candidates >> first) & kLanes;
+		candidates &= ~(kLanes << first);
+
+		const Float origin[3] = { Float::Load(rays.originX + first), Float::Load(rays.originY + first), Float::Load(rays.originZ + first) };
+		const Float inverseDirection[3] = { Float::Load(rays.inverseDirectionX + first), Float::Load(rays.inverseDirectionY + first), Float::Load(rays.inverseDirectionZ + first) };
+		Float entry(0.f), exit = Float::Load(rays.maxT + first);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const Float t0 = (lower[axis] - origin[axis]) * inverseDirection[axis];
+			const Float t1 = (upper[axis] - origin[axis]) * inverseDirection[axis];
+			entry = Max(entry, Min(t0, t1));
+			exit = Min(exit, Max(t0, t1) * farScale);
+		}
+		hits |= uint64_t(MoveMask(NotGreater(entry, exit)) & lanes) << first;
+	}
+	return hits;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Blocking stream socket, TCP or local (a Unix domain socket at a file path). Send() and Receive() move whole buffers and return false once the connection is
+// closed, broken or, with a receive timeout set, silent for too long; the socket is unusable after that.
+class Socket
+{
+public:
+	Socket() = default;
+
+	// Listening socket on every interface; port 0 picks a free one, see GetPort()
+	static Socket Listen(uint16_t port)
+	{
+		initialize();
+		Socket listener(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+		if (!listener.IsOpen())
+			return listener;
+
+		const int reuse = 1;
+		setsockopt(listener.handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+		if (::bind(listener.handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener.handle, SOMAXCONN) != 0)
+			listener.Close();
+		return listener;
+	}
+
+	static Socket Connect(const std::string& host, uint16_t port)
+	{
+		initialize();
+		addrinfo hints{};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* addresses = nullptr;
+		if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+			return Socket();
+
+		Socket connection;
+		for (addrinfo* address = addresses; address && !connection.IsOpen(); address = address->ai_next)
+		{
+			Socket candidate(::socket(address->ai_family, address->ai_socktype, address->ai_protocol));
+			if (candidate.IsOpen() && ::connect(candidate.handle, address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0)
+				connection = std::move(candidate);
+		}
+		freeaddrinfo(addresses);
+		connection.setNoDelay();
+		return connection;
+	}
+
+	// Local socket at path. A socket file nobody listens on any more, left by a process that did not clean up, is
+	// replaced; anything else at path, a live socket included, makes it fail.
+	static Socket ListenLocal(const std::string& path)
+	{
+		initialize();
+		sockaddr_un address{};
+		if (path.size() >= sizeof(address.sun_path))
+			return Socket();
+		address.sun_family = AF_UNIX;
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		if (isSocketFile(path))
+		{
+			if (ConnectLocal(path).IsOpen())
+				return Socket();
+			removeFile(path);
+		}
+
+		Socket listener(::socket(AF_UNIX, SOCK_STREAM, 0));
+		if (!listener.IsOpen())
+			return listener;
+		if (::bind(listener.handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener.handle, SOMAXCONN) != 0)
+			listener.Close();
+		return listener;
+	}
+
+	static Socket ConnectLocal(const std::string& path)
+	{
+		initialize();
+		sockaddr_un address{};
+		if (path.size() >= sizeof(address.sun_path))
+			return Socket();
+		address.sun_family = AF_UNIX;
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		Socket connection(::socket(AF_UNIX, SOCK_STREAM, 0));
+		if (connection.IsOpen() && ::connect(connection.handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+			connection.Close();
+		return connection;
+	}
+
+	// Removes the file of a local socket once its listener is closed
+	static void RemoveLocal(const std::string& path)
+	{
+		if (isSocketFile(path))
+			removeFile(path);
+	}
+
+	// Waits up to timeoutMilliseconds for a connection; returns a closed socket if none came
+	Socket Accept(uint32_t timeoutMilliseconds) const
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(handle, &readable);
+		timeval timeout{ static_cast<long>(timeoutMilliseconds / 1000), static_cast<long>(timeoutMilliseconds % 1000 * 1000) };
+		if (::select(static_cast<int>(handle + 1), &readable, nullptr, nullptr, &timeout) <= 0)
+			return Socket();
+
+		Socket connection(::accept(handle, nullptr, nullptr));
+		connection.setNoDelay();
+		return connection;
+	}
+
+	Socket(const Socket&) = delete;
+	Socket& operator =(const Socket&) = delete;
+
+	Socket(Socket&& other) noexcept
+	{
+		std::swap(handle, other.handle);
+	}
+
+	Socket& operator =(Socket&& other) noexcept
+	{
+		Socket(std::move(other)).swap(*this);
+		return (*this);
+	}
+
+	~Socket()
+	{
+		Close();
+	}
+
+	bool IsOpen() const { return handle != kInvalidHandle; }
+
+	void Close()
+	{
+		if (!IsOpen())
+			return;
+#ifdef _WIN32
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+		handle = kInvalidHandle;
+	}
+
+	uint16_t GetPort() const
+	{
+		sockaddr_in address{};
+		socklen_t size = sizeof(address);
+		if (getsockname(handle, reinterpret_cast<sockaddr*>(&address), &size) != 0)
+			return 0;
+		return ntohs(address.sin_port);
+	}
+
+	// 0 waits forever
+	void SetReceiveTimeout(uint32_t milliseconds)
+	{
+#ifdef _WIN32
+		const DWORD timeout = milliseconds;
+#else
+		const timeval timeout{ static_cast<long>(milliseconds / 1000), static_cast<long>(milliseconds % 1000 * 1000) };
+#endif
+		setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+	}
+
+	bool Send(const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			const auto sent = ::send(handle, bytes, static_cast<int>(std::min<size_t>(size, kMaxChunk)), kSendFlags);
+			if (sent <= 0)
+			{
+				Close();
+				return false;
+			}
+			bytes += sent;
+			size -= static_cast<size_t>(sent);
+		}
+		return true;
+	}
+
+	bool Receive(void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+			const auto received = ::recv(handle, bytes, static_cast<int>(std::min<size_t>(size, kMaxChunk)), 0);
+			if (received <= 0)
+			{
+				Close();
+				return false;
+			}
+			bytes += received;
+			size -= static_cast<size_t>(received);
+		}
+		return true;
+	}
+
+	void swap(Socket& other) noexcept
+	{
+		std::swap(handle, other.handle);
+	}
+
+private:
+#ifdef _WIN32
+	using Handle = SOCKET;
+	static constexpr Handle kInvalidHandle = INVALID_SOCKET;
+	static constexpr int kSendFlags = 0;
+#else
+	using Handle = int;
+	static constexpr Handle kInvalidHandle = -1;
+#ifdef MSG_NOSIGNAL
+	static constexpr int kSendFlags = MSG_NOSIGNAL;	// A closed peer fails the send instead of raising SIGPIPE
+#else
+	static constexpr int kSendFlags = 0;
+#endif
+#endif
+	static constexpr size_t kMaxChunk = 1 << 20;
+
+	explicit Socket(Handle handle) : handle(handle) {}
+
+	static void initialize()
+	{
+#ifdef _WIN32
+		static const bool started = []()
+			{
+				WSADATA data;
+				return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+			}();
+		(void)started;
+#endif
+	}
+
+	static bool isSocketFile(const std::string& path)
+	{
+#ifdef _WIN32
+		const DWORD attributes = GetFileAttributesA(path.c_str());
+		return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+#else
+		struct stat fileStat;
+		return ::lstat(path.c_str(), &fileStat) == 0 && S_ISSOCK(fileStat.st_mode);
+#endif
+	}
+
+	static void removeFile(const std::string& path)
+	{
+#ifdef _WIN32
+		DeleteFileA(path.c_str());
+#else
+		::unlink(path.c_str());
+#endif
+	}
+
+	// Fails harmlessly on local sockets
+	void setNoDelay()
+	{
+		if (!IsOpen())
+			return;
+		const int noDelay = 1;
+		setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+	}
+
+	Handle handle = kInvalidHandle;
+};
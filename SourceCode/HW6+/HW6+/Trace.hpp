@@ -0,0 +1,200 @@
+#pragma once
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of scoped events in the Chrome trace event format, for chrome://tracing, Perfetto or any viewer that
+// reads it. Every thread records into a buffer of its own without locking; the buffers are only walked by Write(),
+// once the traced work is done. While tracing is off, a scope costs one relaxed atomic load.
+class Tracer
+{
+public:
+	struct Event
+	{
+		const char* name;		// Static string
+		std::string detail;		// Shown as the "detail" argument, if not empty
+		int64_t start;			// Nanoseconds since Enable()
+		int64_t duration;
+	};
+
+	static Tracer& Instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	void Enable()
+	{
+		origin = std::chrono::steady_clock::now();
+		enabled.store(true, std::memory_order_relaxed);
+	}
+
+	bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	int64_t Now() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	void Record(const char* name, std::string detail, int64_t start, int64_t end)
+	{
+		threadBuffer().events.push_back({ name, std::move(detail), start, end - start });
+	}
+
+	// Names the calling thread in the viewer. Threads are numbered in the order they first record.
+	void SetThreadName(std::string name)
+	{
+		threadBuffer().name = std::move(name);
+	}
+
+	// Writes every recorded event; call once no other thread records any more
+	bool Write(const std::string& fileName)
+	{
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		writer.StartObject();
+		writer.Key("displayTimeUnit");
+		writer.String("ms");
+		writer.Key("traceEvents");
+		writer.StartArray();
+
+		size_t eventCount = 0;
+		std::lock_guard lock(buffersMutex);
+		for (const auto& threadEvents : buffers)
+		{
+			if (!threadEvents->name.empty())
+			{
+				writer.StartObject();
+				writer.Key("name");
+				writer.String("thread_name");
+				writer.Key("ph");
+				writer.String("M");
+				writer.Key("pid");
+				writer.Uint(1);
+				writer.Key("tid");
+				writer.Uint(threadEvents->id);
+				writer.Key("args");
+				writer.StartObject();
+				writer.Key("name");
+				writer.String(threadEvents->name.c_str());
+				writer.EndObject();
+				writer.EndObject();
+			}
+
+			for (const auto& event : threadEvents->events)
+			{
+				writer.StartObject();
+				writer.Key("name");
+				writer.String(event.name);
+				writer.Key("ph");
+				writer.String("X");
+				writer.Key("pid");
+				writer.Uint(1);
+				writer.Key("tid");
+				writer.Uint(threadEvents->id);
+				writer.Key("ts");
+				writer.Double(event.start / 1000.0);
+				writer.Key("dur");
+				writer.Double(event.duration / 1000.0);
+				if (!event.detail.empty())
+				{
+					writer.Key("args");
+					writer.StartObject();
+					writer.Key("detail");
+					writer.String(event.detail.c_str());
+					writer.EndObject();
+				}
+				writer.EndObject();
+			}
+			eventCount += threadEvents->events.size();
+		}
+		writer.EndArray();
+		writer.EndObject();
+
+		std::ofstream ofs(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!ofs.is_open())
+		{
+			std::cout << "Failed to write trace " << fileName << '\n';
+			return false;
+		}
+		ofs.write(buffer.GetString(), buffer.GetSize());
+		std::cout << "Trace of " << eventCount << " events written to " << fileName << '\n';
+		return true;
+	}
+
+protected:
+	struct ThreadEvents
+	{
+		uint32_t id;
+		std::string name;
+		std::vector<Event> events;
+	};
+
+	Tracer() = default;
+
+	// The buffers belong to the tracer, so the events of finished threads stay until Write()
+	ThreadEvents& threadBuffer()
+	{
+		thread_local ThreadEvents* threadEvents = nullptr;
+		if (!threadEvents)
+		{
+			std::lock_guard lock(buffersMutex);
+			buffers.push_back(std::make_unique<ThreadEvents>());
+			threadEvents = buffers.back().get();
+			threadEvents->id = static_cast<uint32_t>(buffers.size());
+			threadEvents->events.reserve(1024);
+		}
+		return *threadEvents;
+	}
+
+	std::atomic<bool> enabled{ false };
+	std::chrono::steady_clock::time_point origin;
+	std::mutex buffersMutex;
+	std::vector<std::unique_ptr<ThreadEvents>> buffers;
+};
+
+// Records the time between its construction and destruction as one event of the calling thread
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : name(name)
+	{
+		if (Tracer::Instance().IsEnabled())
+			start = Tracer::Instance().Now();
+	}
+
+	// The detail is only built when tracing is on
+	template <typename MakeDetail>
+	TraceScope(const char* name, const MakeDetail& makeDetail) : name(name)
+	{
+		if (Tracer::Instance().IsEnabled())
+		{
+			detail = makeDetail();
+			start = Tracer::Instance().Now();
+		}
+	}
+
+	~TraceScope()
+	{
+		if (start >= 0)
+			Tracer::Instance().Record(name, std::move(detail), start, Tracer::Instance().Now());
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* name;
+	std::string detail;
+	int64_t start = -1;
+};